@@ -21,10 +21,15 @@
 #include "config.h"
 #include "Bus.h"
 #include "R6502.h"
+#include "Disassembly.h"
+#include "Breakpoints.h"
+#include "Profiler.h"
 #include "2DEngine.h"
 
 Bus nes;
-std::map<uint16_t, std::string> mapAsm;
+Disassembly disassembly(nes);
+Breakpoints breakpoints(nes);
+Profiler profiler;
 
 GLFWwindow* g_window;
 ImVec4 clear_color = ImVec4(1.0f, 1.0f, 0.60f, 1.00f);
@@ -301,6 +306,123 @@ void loop()
     ImGui::SetNextWindowPos(ImVec2(30, 550), ImGuiCond_FirstUseEver);
     ImGui::Begin("NES Debugger", &show_r6502_window);
     ImGui::Text("720 x 720 Dynamic Texture");
+
+    // Run and step, both stop at breakpoints
+    if (ImGui::Button(breakpoints.stopped() ? "Continue" : "Run frame"))
+    {
+      breakpoints.resume();
+      nes.run(29781);
+    }
+    ImGui::SameLine();
+    if (ImGui::Button("Step"))
+    {
+      breakpoints.resume();
+      nes.cpu.step_instruction();
+    }
+    static const char *kind_names[] = {"", "execute", "read", "", "write"};
+    if (breakpoints.stopped())
+    {
+      const Breakpoints::HIT &hit = breakpoints.hit();
+      ImGui::SameLine();
+      ImGui::Text("Stopped by #%u at $%04X: %s $%04X = $%02X", hit.id, hit.pc, kind_names[hit.kind], hit.addr,
+                  hit.value);
+    }
+
+    // The code around PC, from a cache that only decodes what changed. Clicking
+    // a line sets or clears an execute breakpoint there
+    Disassembly::LINE lines[27];
+    disassembly.update();
+    uint32_t count = disassembly.around(nes.cpu.pc, 13, 13, lines);
+    for (uint32_t i = 0; i < count; i++)
+    {
+      char label[48];
+      snprintf(label, sizeof(label), "%c %s", breakpoints.flags[lines[i].addr] & Breakpoints::EXECUTE ? '*' : ' ',
+               lines[i].text);
+      bool at_pc = lines[i].addr == nes.cpu.pc;
+      if (at_pc)
+        ImGui::PushStyleColor(ImGuiCol_Text, ImVec4(0.0f, 1.0f, 1.0f, 1.0f));
+      ImGui::PushID(lines[i].addr);
+      if (ImGui::Selectable(label, false))
+        breakpoints.toggle(lines[i].addr);
+      ImGui::PopID();
+      if (at_pc)
+        ImGui::PopStyleColor();
+    }
+
+    // Breakpoints and watchpoints over a range of addresses
+    ImGui::Separator();
+    static uint16_t break_first = 0, break_last = 0;
+    static unsigned int break_kinds = Breakpoints::WRITE;
+    static int break_condition = Breakpoints::ANY;
+    static uint8_t break_value = 0;
+    static const char *condition_names[] = {"any", "==", "!=", "<", ">", "changed"};
+    ImGui::InputScalar("First", ImGuiDataType_U16, &break_first, nullptr, nullptr, "%04X",
+                       ImGuiInputTextFlags_CharsHexadecimal);
+    ImGui::InputScalar("Last", ImGuiDataType_U16, &break_last, nullptr, nullptr, "%04X",
+                       ImGuiInputTextFlags_CharsHexadecimal);
+    ImGui::CheckboxFlags("Execute", &break_kinds, Breakpoints::EXECUTE);
+    ImGui::SameLine();
+    ImGui::CheckboxFlags("Read", &break_kinds, Breakpoints::READ);
+    ImGui::SameLine();
+    ImGui::CheckboxFlags("Write", &break_kinds, Breakpoints::WRITE);
+    ImGui::Combo("Condition", &break_condition, condition_names, IM_ARRAYSIZE(condition_names));
+    ImGui::InputScalar("Value", ImGuiDataType_U8, &break_value, nullptr, nullptr, "%02X",
+                       ImGuiInputTextFlags_CharsHexadecimal);
+    if (ImGui::Button("Add"))
+    {
+      Breakpoints::BREAKPOINT b;
+      b.first = break_first;
+      b.last = break_last < break_first ? break_first : break_last;
+      b.kinds = (uint8_t)break_kinds;
+      b.condition = (Breakpoints::CONDITION)break_condition;
+      b.value = break_value;
+      breakpoints.add(b);
+    }
+
+    for (uint32_t id = 0; id < breakpoints.size(); id++)
+    {
+      const Breakpoints::BREAKPOINT *b = breakpoints.get(id);
+      if (!b)
+        continue;
+      ImGui::PushID((int)id);
+      bool enabled = b->enabled;
+      if (ImGui::Checkbox("##enabled", &enabled))
+        breakpoints.enable(id, enabled);
+      ImGui::SameLine();
+      ImGui::Text("#%u %s%s%s $%04X-$%04X %s $%02X, %u hits", id, b->kinds & Breakpoints::EXECUTE ? "X" : "",
+                  b->kinds & Breakpoints::READ ? "R" : "", b->kinds & Breakpoints::WRITE ? "W" : "", b->first, b->last,
+                  condition_names[b->condition], b->value, b->hits);
+      ImGui::SameLine();
+      if (ImGui::Button("Remove"))
+        breakpoints.remove(id);
+      ImGui::PopID();
+    }
+
+    // Where the cycles go while the profiler is attached
+    ImGui::Separator();
+    bool profiling = nes.profiler != nullptr;
+    if (ImGui::Checkbox("Profile", &profiling))
+      nes.profiler = profiling ? &profiler : nullptr;
+    ImGui::SameLine();
+    if (ImGui::Button("Reset profile"))
+      profiler.reset();
+    uint64_t profiled = profiler.cycles();
+    if (profiled > 0)
+    {
+      for (const Profiler::SPOT &s : profiler.hot_spots(10))
+      {
+        uint8_t bytes[3];
+        char text[R6502::LINE_SIZE];
+        nes.peek_range(s.pc, 3, bytes);
+        R6502::format_instruction(s.pc, bytes, text, sizeof(text));
+        ImGui::Text("%5.1f%% %s", 100.0 * s.cycles / profiled, text);
+      }
+      std::vector<Profiler::FUNCTION> functions = profiler.functions();
+      for (size_t i = 0; i < functions.size() && i < 10; i++)
+        ImGui::Text("$%04X %5.1f%% self %5.1f%% total, %llu calls", functions[i].addr,
+                    100.0 * functions[i].self / profiled, 100.0 * functions[i].total / profiled,
+                    (unsigned long long)functions[i].calls);
+    }
     ImGui::End();
   }
 
@@ -17,7 +17,12 @@
 #include <cstring>
 #include <filesystem>
 
+// The headless (native) build has no ImGui; sprites only need an opaque texture handle
+#ifdef R6502_HEADLESS
+typedef void *ImTextureID;
+#else
 #include "imgui.h"
+#endif
 
 #if defined(__linux__) || defined(__APPLE__) || defined(__FreeBSD__) || defined(__EMSCRIPTEN__)
 #define IMAGE_LIBPNG
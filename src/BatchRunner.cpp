@@ -0,0 +1,158 @@
+#include "config.h"
+#include "BatchRunner.h"
+
+#include <algorithm>
+
+static inline uint64_t make_range(uint32_t first, uint32_t end) { return (uint64_t)first << 32 | end; }
+static inline uint32_t range_first(uint64_t range) { return (uint32_t)(range >> 32); }
+static inline uint32_t range_end(uint64_t range) { return (uint32_t)range; }
+
+BatchRunner::BatchRunner(size_t instances, uint32_t threads)
+{
+    if (threads == 0)
+        threads = std::max(1u, std::thread::hardware_concurrency());
+
+    machines.reserve(instances);
+    for (size_t i = 0; i < instances; i++)
+        machines.push_back(std::make_unique<Machine>());
+
+    for (uint32_t i = 0; i < threads; i++)
+        workers.push_back(std::make_unique<WORKER>());
+    for (uint32_t i = 0; i < threads; i++)
+        workers[i]->thread = std::thread(&BatchRunner::worker, this, i);
+}
+
+BatchRunner::~BatchRunner()
+{
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        quit = true;
+    }
+    wake.notify_all();
+    for (auto &w : workers)
+        w->thread.join();
+}
+
+/**
+ * @brief Runs task once for every instance and waits for all of them
+ *
+ * @param task called with the index and the machine of each instance
+ */
+void BatchRunner::run(const TASK &task)
+{
+    uint32_t n = (uint32_t)workers.size();
+    uint32_t count = (uint32_t)machines.size();
+
+    // Equal shares to start with, stealing does the rest
+    for (uint32_t i = 0; i < n; i++)
+    {
+        uint32_t first = (uint32_t)((uint64_t)count * i / n);
+        uint32_t end = (uint32_t)((uint64_t)count * (i + 1) / n);
+        workers[i]->range.store(make_range(first, end), std::memory_order_relaxed);
+        workers[i]->steals = 0;
+    }
+
+    std::unique_lock<std::mutex> guard(lock);
+    this->task = &task;
+    busy = n;
+    generation++;
+    wake.notify_all();
+    finished.wait(guard, [this] { return busy == 0; });
+    this->task = nullptr;
+
+    steals = 0;
+    for (auto &w : workers)
+        steals += w->steals;
+}
+
+/**
+ * @brief Thread body: waits for a run, works on it and reports back
+ */
+void BatchRunner::worker(uint32_t index)
+{
+    uint64_t seen = 0;
+    for (;;)
+    {
+        {
+            std::unique_lock<std::mutex> guard(lock);
+            wake.wait(guard, [&] { return quit || generation != seen; });
+            if (quit)
+                return;
+            seen = generation;
+        }
+
+        work(index);
+
+        std::lock_guard<std::mutex> guard(lock);
+        if (--busy == 0)
+            finished.notify_all();
+    }
+}
+
+/**
+ * @brief Runs the instances of a worker's own range, then steals more until
+ * there is nothing left anywhere
+ */
+void BatchRunner::work(uint32_t index)
+{
+    WORKER &self = *workers[index];
+    do
+    {
+        uint64_t range = self.range.load(std::memory_order_acquire);
+        while (range_first(range) < range_end(range))
+        {
+            // A failed exchange reloads range, a thief may have cut it short
+            uint32_t first = range_first(range);
+            if (self.range.compare_exchange_weak(range, make_range(first + 1, range_end(range)),
+                                                 std::memory_order_acq_rel))
+            {
+                (*task)(first, *machines[first]);
+                range = self.range.load(std::memory_order_acquire);
+            }
+        }
+    } while (steal(index));
+}
+
+/**
+ * @brief Moves the back half of the largest range left to the thief's own,
+ * empty range
+ *
+ * @param thief index of the stealing worker
+ * @return true if something was stolen, false once every range is empty
+ */
+bool BatchRunner::steal(uint32_t thief)
+{
+    uint32_t n = (uint32_t)workers.size();
+    for (;;)
+    {
+        WORKER *victim = nullptr;
+        uint64_t range = 0;
+        uint32_t most = 0;
+        for (uint32_t i = 1; i < n; i++)
+        {
+            WORKER &w = *workers[(thief + i) % n];
+            uint64_t r = w.range.load(std::memory_order_acquire);
+            uint32_t left = range_end(r) - std::min(range_first(r), range_end(r));
+            if (left > most)
+            {
+                victim = &w;
+                range = r;
+                most = left;
+            }
+        }
+        if (!victim)
+            return false;
+
+        // The victim keeps the front half, which it is working through. A
+        // single instance left goes to the thief
+        uint32_t first = range_first(range), end = range_end(range);
+        uint32_t split = first + (end - first) / 2;
+        if (victim->range.compare_exchange_strong(range, make_range(first, split), std::memory_order_acq_rel))
+        {
+            WORKER &self = *workers[thief];
+            self.range.store(make_range(split, end), std::memory_order_release);
+            self.steals++;
+            return true;
+        }
+    }
+}
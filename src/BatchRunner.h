@@ -0,0 +1,70 @@
+#pragma once
+#include "config.h"
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "Mapper.h"
+
+// Runs many independent machines on a work stealing thread pool. The runner
+// owns a pool of Machine instances, each allocated on its own, and run() calls
+// a task once per instance. A task only touches its own machine, so tasks
+// share no mutable state and nothing is locked while they run.
+//
+// Each worker starts a run with an equal, contiguous range of instances and
+// takes them one at a time from the front. A worker that runs out steals the
+// back half of the largest range left, so instances that run for longer (a
+// program that finishes late, a slower mapper) even out across the threads.
+// The ranges are single words changed with compare and swap.
+class BatchRunner
+{
+public:
+    // Sets up, runs or inspects instance index. Tasks must not throw
+    using TASK = std::function<void(size_t index, Machine &machine)>;
+
+    // A pool of instances run by up to threads threads (0: one per core)
+    explicit BatchRunner(size_t instances, uint32_t threads = 0);
+    ~BatchRunner();
+    BatchRunner(const BatchRunner &) = delete;
+    BatchRunner &operator=(const BatchRunner &) = delete;
+
+    // Calls task for every instance and returns once all calls are done
+    void run(const TASK &task);
+
+    Machine &operator[](size_t index) { return *machines[index]; }
+    size_t size() const { return machines.size(); }
+    uint32_t threads() const { return (uint32_t)workers.size(); }
+
+    // Ranges stolen during the last run
+    uint64_t steals = 0;
+
+private:
+    struct alignas(64) WORKER
+    {
+        std::atomic<uint64_t> range{0}; // First instance in the high word, end in the low word
+        uint64_t steals = 0;
+        std::thread thread;
+    };
+
+    std::vector<std::unique_ptr<Machine>> machines;
+    std::vector<std::unique_ptr<WORKER>> workers;
+
+    // Handing a run to the workers
+    std::mutex lock;
+    std::condition_variable wake;
+    std::condition_variable finished;
+    const TASK *task = nullptr;
+    uint32_t busy = 0;
+    uint64_t generation = 0;
+    bool quit = false;
+
+    void worker(uint32_t index);
+    void work(uint32_t index);
+    bool steal(uint32_t thief);
+};
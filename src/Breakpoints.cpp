@@ -0,0 +1,211 @@
+#include "config.h"
+#include "Breakpoints.h"
+
+#include "Bus.h"
+
+Breakpoints::Breakpoints(Bus &bus) : bus(bus)
+{
+    bus.breakpoints = this;
+}
+
+Breakpoints::~Breakpoints()
+{
+    clear();
+    bus.breakpoints = nullptr;
+}
+
+uint32_t Breakpoints::add(const BREAKPOINT &breakpoint)
+{
+    if (breakpoint.first > breakpoint.last || (breakpoint.kinds & (EXECUTE | READ | WRITE)) == 0)
+        return NONE;
+
+    uint32_t id;
+    if (!free_ids.empty())
+    {
+        id = free_ids.back();
+        free_ids.pop_back();
+    }
+    else
+    {
+        id = (uint32_t)entries.size();
+        entries.emplace_back();
+    }
+    entries[id].breakpoint = breakpoint;
+    entries[id].valid = true;
+    rebuild();
+    return id;
+}
+
+bool Breakpoints::remove(uint32_t id)
+{
+    if (!get(id))
+        return false;
+    entries[id].valid = false;
+    free_ids.push_back(id);
+    rebuild();
+    return true;
+}
+
+bool Breakpoints::enable(uint32_t id, bool enabled)
+{
+    if (!get(id))
+        return false;
+    entries[id].breakpoint.enabled = enabled;
+    rebuild();
+    return true;
+}
+
+void Breakpoints::clear()
+{
+    entries.clear();
+    free_ids.clear();
+    stop = false;
+    resume_pending = false;
+    rebuild();
+}
+
+bool Breakpoints::toggle(uint16_t addr)
+{
+    for (uint32_t id = 0; id < entries.size(); id++)
+    {
+        const BREAKPOINT *b = get(id);
+        if (b && b->enabled && b->kinds == EXECUTE && b->first == addr && b->last == addr)
+        {
+            remove(id);
+            return false;
+        }
+    }
+    BREAKPOINT b;
+    b.first = b.last = addr;
+    add(b);
+    return true;
+}
+
+const Breakpoints::BREAKPOINT *Breakpoints::get(uint32_t id) const
+{
+    return id < entries.size() && entries[id].valid ? &entries[id].breakpoint : nullptr;
+}
+
+uint32_t Breakpoints::find(uint16_t addr, uint8_t kinds) const
+{
+    for (uint32_t id = 0; id < entries.size(); id++)
+    {
+        const BREAKPOINT *b = get(id);
+        if (b && b->enabled && (b->kinds & kinds) && addr >= b->first && addr <= b->last)
+            return id;
+    }
+    return NONE;
+}
+
+void Breakpoints::resume()
+{
+    if (stop && last_hit.kind == EXECUTE)
+    {
+        resume_pending = true;
+        resume_pc = last_hit.pc;
+    }
+    stop = false;
+}
+
+/**
+ * @brief Takes the permission to run the instruction at pc past its execute
+ * breakpoint, which resume() gives to the instruction stopped at only
+ */
+bool Breakpoints::resuming(uint16_t pc)
+{
+    bool skip = resume_pending && pc == resume_pc;
+    resume_pending = false;
+    return skip;
+}
+
+/**
+ * @brief Recomputes the flags of every address and page from the enabled
+ * breakpoints, and the fast path pointers of the pages whose watchpoints
+ * changed
+ */
+void Breakpoints::rebuild()
+{
+    std::array<uint8_t, 256> previous = page_kinds;
+    flags.fill(0);
+    page_kinds.fill(0);
+    enabled_count = 0;
+
+    for (const ENTRY &e : entries)
+    {
+        if (!e.valid || !e.breakpoint.enabled)
+            continue;
+        enabled_count++;
+        for (uint32_t addr = e.breakpoint.first; addr <= e.breakpoint.last; addr++)
+            flags[addr] |= e.breakpoint.kinds;
+        for (uint32_t page = e.breakpoint.first >> 8; page <= (uint32_t)(e.breakpoint.last >> 8); page++)
+            page_kinds[page] |= e.breakpoint.kinds & (READ | WRITE);
+    }
+
+    for (uint32_t page = 0; page < 256; page++)
+        if (page_kinds[page] != previous[page])
+            bus.update_page((uint8_t)page);
+}
+
+bool Breakpoints::matches(const BREAKPOINT &b, uint8_t value, uint8_t old) const
+{
+    uint8_t v = value & b.mask;
+    uint8_t w = b.value & b.mask;
+    switch (b.condition)
+    {
+    case ANY:
+        return true;
+    case EQUAL:
+        return v == w;
+    case NOT_EQUAL:
+        return v != w;
+    case LESS:
+        return v < w;
+    case GREATER:
+        return v > w;
+    case CHANGED:
+        return value != old;
+    }
+    return false;
+}
+
+void Breakpoints::stop_at(uint32_t id, KIND kind, uint16_t addr, uint8_t value)
+{
+    entries[id].breakpoint.hits++;
+    if (!stop)
+    {
+        stop = true;
+        last_hit = {id, kind, addr, value, instruction_pc};
+    }
+}
+
+/**
+ * @brief The CPU is about to execute the instruction at pc, which has the
+ * EXECUTE flag
+ *
+ * @return true if it stops there
+ */
+bool Breakpoints::execute(uint16_t pc, uint8_t opcode)
+{
+    instruction_pc = pc;
+    uint32_t id = find(pc, EXECUTE);
+    if (id == NONE)
+        return false;
+    stop_at(id, EXECUTE, pc, opcode);
+    return true;
+}
+
+/**
+ * @brief A read or write of an address with the READ or WRITE flag
+ *
+ * @param old the value in memory before a write, the value read for reads
+ */
+void Breakpoints::access(uint16_t addr, uint8_t value, KIND kind, uint8_t old)
+{
+    for (uint32_t id = 0; id < entries.size(); id++)
+    {
+        const ENTRY &e = entries[id];
+        if (e.valid && e.breakpoint.enabled && (e.breakpoint.kinds & kind) && addr >= e.breakpoint.first &&
+            addr <= e.breakpoint.last && matches(e.breakpoint, value, old))
+            stop_at(id, kind, addr, value);
+    }
+}
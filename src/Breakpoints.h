@@ -0,0 +1,135 @@
+#pragma once
+#include "config.h"
+
+#include <array>
+#include <cstdint>
+#include <vector>
+
+class Bus;
+
+// Execute breakpoints and read and write watchpoints, with conditions on the
+// value, for the CPU of a bus. They cost nothing while none is armed (enabled):
+// the engines run exactly as without them. Once one is:
+//   - run() goes through a loop of its own (R6502::run_checked) testing a flag
+//     of the address of every instruction, which runs CACHED and JIT as SWITCH
+//   - pages with a read or write watchpoint lose their fast path pointers, as
+//     clean pages do with dirty tracking, so only accesses to those pages go
+//     out of line, where they test the flag of their address
+// Reads are every read the CPU makes, opcode and operand fetches included,
+// but not the ReadOnly reads of debuggers and the disassembler.
+//
+// A hit stops R6502::run and Bus::run: before the instruction at an execute
+// breakpoint, or after the instruction making the access that hits a
+// watchpoint (its write has been done). They stay stopped until resume(),
+// which lets the instruction at an execute breakpoint run once.
+class Breakpoints
+{
+public:
+    enum KIND : uint8_t
+    {
+        EXECUTE = 0x01,
+        READ = 0x02,
+        WRITE = 0x04,
+    };
+
+    // Which values read or written hit a watchpoint, after masking. CHANGED
+    // is a write of something else than the memory held
+    enum CONDITION : uint8_t
+    {
+        ANY,
+        EQUAL,
+        NOT_EQUAL,
+        LESS,
+        GREATER,
+        CHANGED,
+    };
+
+    struct BREAKPOINT
+    {
+        uint16_t first = 0, last = 0; // The addresses covered
+        uint8_t kinds = EXECUTE;      // Any of EXECUTE, READ and WRITE
+        CONDITION condition = ANY;    // Of READ and WRITE, execution always hits
+        uint8_t value = 0;
+        uint8_t mask = 0xFF;
+        bool enabled = true;
+        uint32_t hits = 0;
+    };
+
+    struct HIT
+    {
+        uint32_t id;
+        KIND kind;
+        uint16_t addr;
+        uint8_t value; // The value read or written, or the opcode
+        uint16_t pc;   // Of the instruction
+    };
+
+    static constexpr uint32_t NONE = ~0u;
+
+    // Attaches to bus (as Bus::breakpoints) until destroyed
+    explicit Breakpoints(Bus &bus);
+    ~Breakpoints();
+    Breakpoints(const Breakpoints &) = delete;
+    Breakpoints &operator=(const Breakpoints &) = delete;
+
+    // Add a breakpoint, returning its id, or NONE if it covers no address or
+    // has no kind
+    uint32_t add(const BREAKPOINT &breakpoint);
+    bool remove(uint32_t id);
+    bool enable(uint32_t id, bool enabled);
+    void clear();
+
+    // An execute breakpoint on addr alone: removes the enabled one there, or
+    // adds one (a disabled one there is left as it is). Returns true if there
+    // is one now
+    bool toggle(uint16_t addr);
+
+    // The breakpoint with an id, nullptr once removed. Ids run up to size()
+    const BREAKPOINT *get(uint32_t id) const;
+    uint32_t size() const { return (uint32_t)entries.size(); }
+
+    // The first enabled breakpoint covering addr with any of kinds, or NONE
+    uint32_t find(uint16_t addr, uint8_t kinds) const;
+
+    // Any breakpoint enabled, or the CPU stopped by one
+    bool armed() const { return enabled_count > 0 || stop; }
+
+    bool stopped() const { return stop; }
+    const HIT &hit() const { return last_hit; }
+    void resume();
+
+    // Per address, the kinds of the enabled breakpoints covering it. Kept up
+    // to date by the members above, for the CPU and the bus to test
+    std::array<uint8_t, 64 * 1024> flags = {};
+    std::array<uint8_t, 256> page_kinds = {};
+
+    // Called by the CPU (run_checked) and the bus for a flagged address
+    uint16_t instruction_pc = 0;
+    bool execute(uint16_t pc, uint8_t opcode);
+    void access(uint16_t addr, uint8_t value, KIND kind, uint8_t old);
+
+    // True (once) if run() carries on from the execute breakpoint at pc it
+    // stopped at, which is not hit again
+    bool resuming(uint16_t pc);
+
+private:
+    struct ENTRY
+    {
+        BREAKPOINT breakpoint;
+        bool valid = false;
+    };
+
+    Bus &bus;
+    std::vector<ENTRY> entries;
+    std::vector<uint32_t> free_ids;
+    uint32_t enabled_count = 0;
+
+    bool stop = false;
+    HIT last_hit = {};
+    bool resume_pending = false;
+    uint16_t resume_pc = 0;
+
+    void rebuild();
+    bool matches(const BREAKPOINT &b, uint8_t value, uint8_t old) const;
+    void stop_at(uint32_t id, KIND kind, uint16_t addr, uint8_t value);
+};
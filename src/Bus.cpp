@@ -1,11 +1,23 @@
 #include "config.h"
 #include "Bus.h"
+#include "Breakpoints.h"
+#include "Mapper.h"
+
+#include <algorithm>
+#include <cstring>
 
 Bus::Bus()
 {
     // Reset RAM content
     for (auto &i : ram) i = 0x00;
 
+    // Map the RAM range
+    for (uint32_t page = MIN_RAM_ADDR >> 8; page <= (MAX_RAM_ADDR >> 8); page++)
+    {
+        memory_read[page] = read_pages[page] = &ram[page << 8];
+        memory_write[page] = write_pages[page] = &ram[page << 8];
+    }
+
     // Connect cpu to BUS
     cpu.ConnectBus(this);
 }
@@ -15,36 +27,420 @@ Bus::~Bus()
 }
 
 /**
- * @brief write data to a specified address
+ * @brief Points the host memory of one page somewhere else
+ */
+void Bus::map_page(uint8_t page, const uint8_t *read, uint8_t *write)
+{
+    memory_read[page] = read;
+    memory_write[page] = write;
+    if (dirty_mode != DIRTY_OFF)
+    {
+        dirty_pages[page >> 6] |= 1ull << (page & 63);
+        dirty_lines[page >> 4] |= 0xFull << ((page & 15) * 4);
+    }
+    update_page(page);
+}
+
+/**
+ * @brief Recomputes the fast path pointers of a page after its memory, its
+ * devices, its dirty state or its watchpoints changed. Instructions the CPU
+ * has decoded from the page are dropped
+ */
+void Bus::update_page(uint8_t page)
+{
+    bool io = device_bytes[page] != 0;
+
+    // Writes to pages that still have to be marked dirty go out of line
+    bool clean = (dirty_pages[page >> 6] >> (page & 63) & 1) == 0;
+    bool watched = dirty_mode == DIRTY_LINES || (dirty_mode == DIRTY_PAGES && clean);
+
+    // And so do the accesses watchpoints watch
+    uint8_t kinds = breakpoints ? breakpoints->page_kinds[page] : 0;
+
+    read_pages[page] = io || (kinds & Breakpoints::READ) ? nullptr : memory_read[page];
+    write_pages[page] = io || watched || (kinds & Breakpoints::WRITE) ? nullptr : memory_write[page];
+    cpu.notify_remap(page);
+}
+
+/**
+ * @brief Marks a written address dirty. Once a page is marked, DIRTY_PAGES
+ * gives it its write pointer back
+ */
+void Bus::mark_dirty(uint16_t addr)
+{
+    if (dirty_mode == DIRTY_OFF)
+        return;
+    dirty_pages[addr >> 14] |= 1ull << ((addr >> 8) & 63);
+    dirty_lines[addr >> 12] |= 1ull << ((addr >> 6) & 63);
+    if (dirty_mode == DIRTY_PAGES && device_bytes[addr >> 8] == 0 &&
+        !(breakpoints && (breakpoints->page_kinds[addr >> 8] & Breakpoints::WRITE)))
+        write_pages[addr >> 8] = memory_write[addr >> 8];
+}
+
+/**
+ * @brief Switches dirty tracking, clearing the bitmaps
+ * 
+ * @param mode DIRTY_OFF, DIRTY_PAGES or DIRTY_LINES
+ */
+void Bus::track_dirty(DIRTY mode)
+{
+    dirty_mode = mode;
+    dirty_pages = {};
+    dirty_lines = {};
+    for (uint32_t page = 0; page < 256; page++)
+        update_page(page);
+    map_version++;
+}
+
+/**
+ * @brief Takes the dirty bitmaps, leaving them clear
+ * 
+ * @param pages receives 4 words, a bit per page
+ * @param lines receives 16 words, a bit per 64 byte line, or nullptr
+ */
+void Bus::take_dirty(uint64_t *pages, uint64_t *lines)
+{
+    std::array<uint64_t, 4> taken = dirty_pages;
+    std::copy(taken.begin(), taken.end(), pages);
+    dirty_pages = {};
+
+    // Watch the pages that were written again
+    if (dirty_mode == DIRTY_PAGES)
+        for (uint32_t page = 0; page < 256; page++)
+            if (taken[page >> 6] >> (page & 63) & 1)
+                update_page(page);
+
+    for (size_t i = 0; i < dirty_lines.size(); i++)
+    {
+        if (lines)
+            lines[i] = dirty_lines[i];
+        dirty_lines[i] = 0;
+    }
+}
+
+/**
+ * @brief Maps host memory that can be read and written
+ * 
+ * @param addr first address, a multiple of 256
+ * @param size number of bytes, a multiple of 256
+ * @param memory the memory to map, at least size bytes
+ */
+void Bus::map_ram(uint16_t addr, uint32_t size, uint8_t *memory)
+{
+    for (uint32_t i = 0; i < (size >> 8) && (addr >> 8) + i < 256; i++)
+        map_page((addr >> 8) + i, memory + (i << 8), memory + (i << 8));
+    map_version++;
+}
+
+/**
+ * @brief Maps host memory that can only be read, writes to it are ignored
+ * 
+ * @param addr first address, a multiple of 256
+ * @param size number of bytes, a multiple of 256
+ * @param memory the memory to map, at least size bytes
+ */
+void Bus::map_rom(uint16_t addr, uint32_t size, const uint8_t *memory)
+{
+    for (uint32_t i = 0; i < (size >> 8) && (addr >> 8) + i < 256; i++)
+        map_page((addr >> 8) + i, memory + (i << 8), nullptr);
+    map_version++;
+}
+
+/**
+ * @brief Removes the host memory of a range, which then reads as 0 and
+ * ignores writes wherever no device is attached
+ * 
+ * @param addr first address, a multiple of 256
+ * @param size number of bytes, a multiple of 256
+ */
+void Bus::unmap(uint16_t addr, uint32_t size)
+{
+    for (uint32_t i = 0; i < (size >> 8) && (addr >> 8) + i < 256; i++)
+        map_page((addr >> 8) + i, nullptr, nullptr);
+    map_version++;
+}
+
+/**
+ * @brief Attaches a device to a range of addresses, replacing any device
+ * attached there before. A device replaced at all its addresses is detached
+ * 
+ * @param device the device
+ * @param first first address of the range
+ * @param last last address of the range
+ * @param mask ANDed with the address before it is passed to the device
+ * @return true on success, false if the range is empty or all slots are taken
+ */
+bool Bus::attach(BusDevice *device, uint16_t first, uint16_t last, uint16_t mask)
+{
+    if (!device || first > last)
+        return false;
+
+    // Share the slot of the same device and mask, else take a free one
+    uint16_t slot = 0;
+    for (uint16_t i = 1; i < slots.size() && !slot; i++)
+        if (slots[i].device == device && slots[i].mask == mask)
+            slot = i;
+    for (uint16_t i = 1; i < slots.size() && !slot; i++)
+        if (!slots[i].device)
+            slot = i;
+    if (!slot)
+        return false;
+    slots[slot].device = device;
+    slots[slot].mask = mask;
+
+    bool replaced = false;
+    for (uint32_t addr = first; addr <= last; addr++)
+    {
+        if (!device_map[addr])
+            device_bytes[addr >> 8]++;
+        else if (device_map[addr] != slot)
+            replaced = true;
+        device_map[addr] = (uint8_t)slot;
+    }
+    for (uint32_t page = first >> 8; page <= (uint32_t)(last >> 8); page++)
+        update_page(page);
+
+    // Free the slots of devices now hidden at every address, so they are
+    // neither listed by devices() nor hold on to a slot
+    if (replaced)
+    {
+        std::array<bool, 256> used = {};
+        for (uint8_t s : device_map)
+            used[s] = true;
+        for (uint16_t i = 1; i < slots.size(); i++)
+            if (!used[i])
+                slots[i] = DEVICE_SLOT();
+    }
+    map_version++;
+    return true;
+}
+
+/**
+ * @brief Lists the attached devices. A device attached with several masks has
+ * several slots but is listed once, at its first
+ */
+uint32_t Bus::devices(BusDevice **list) const
+{
+    uint32_t count = 0;
+    for (uint32_t i = 1; i < slots.size(); i++)
+        if (slots[i].device && std::find(list, list + count, slots[i].device) == list + count)
+            list[count++] = slots[i].device;
+    return count;
+}
+
+/**
+ * @brief Detaches a device from every address it is attached to, which then
+ * go back to the memory mapped there
+ * 
+ * @param device the device
+ */
+void Bus::detach(BusDevice *device)
+{
+    for (uint16_t i = 1; i < slots.size(); i++)
+        if (slots[i].device == device)
+            slots[i] = DEVICE_SLOT();
+
+    for (uint32_t page = 0; page < 256; page++)
+    {
+        uint16_t before = device_bytes[page];
+        for (uint32_t addr = page << 8; addr < ((page + 1) << 8); addr++)
+        {
+            if (device_map[addr] && !slots[device_map[addr]].device)
+            {
+                device_map[addr] = 0;
+                device_bytes[page]--;
+            }
+        }
+        if (device_bytes[page] != before)
+            update_page(page);
+    }
+    map_version++;
+}
+
+/**
+ * @brief Schedules an event, replacing its pending time if it has one
+ * 
+ * @param event the event
+ * @param cycle clock_count to fire it at
+ */
+void Bus::schedule(BusEvent *event, uint32_t cycle)
+{
+    for (auto &e : events)
+    {
+        if (e.event == event)
+        {
+            e.cycle = cycle;
+            return;
+        }
+    }
+    events.push_back({event, cycle});
+}
+
+/**
+ * @brief Removes an event's pending time, if it has one
+ */
+void Bus::cancel(BusEvent *event)
+{
+    events.erase(std::remove_if(events.begin(), events.end(),
+                                [&](const TIMED_EVENT &e) { return e.event == event; }),
+                 events.end());
+}
+
+/**
+ * @brief Raises or releases one source's hold on the IRQ line
+ * 
+ * @param source a bit owned by the source
+ * @param asserted true to hold the line
+ */
+void Bus::set_irq(uint32_t source, bool asserted)
+{
+    irq_lines = asserted ? irq_lines | source : irq_lines & ~source;
+}
+
+/**
+ * @brief Fires the events that are due, including those they schedule
+ */
+void Bus::fire_events()
+{
+    for (size_t i = 0; i < events.size();)
+    {
+        // Times wrap with clock_count
+        if ((int32_t)(events[i].cycle - cpu.clock_count) > 0)
+        {
+            i++;
+            continue;
+        }
+        TIMED_EVENT due = events[i];
+        events.erase(events.begin() + i);
+        due.event->fire(due.cycle);
+        i = 0;
+    }
+}
+
+/**
+ * @brief Runs the CPU until at least budget cycles are used, stopping at each
+ * event and taking pending interrupts
+ * 
+ * @param budget number of cycles
+ * @return uint32_t cycles used
+ */
+uint32_t Bus::run(uint32_t budget)
+{
+    uint32_t used = 0;
+    while (used < budget)
+    {
+        fire_events();
+        if (breakpoints && breakpoints->stopped())
+            break;
+        if (irq_lines)
+        {
+            // Ignored while I is set
+            cpu.irq();
+            used += cpu.step_instruction();
+            continue;
+        }
+
+        uint32_t slice = budget - used;
+        for (const auto &e : events)
+            slice = std::min(slice, e.cycle - cpu.clock_count);
+        used += cpu.run(slice);
+    }
+    fire_events();
+    return used;
+}
+
+/**
+ * @brief write data to an address without a fast path: a device, ROM (the
+ * mapper's registers), memory watched for dirty tracking or by a watchpoint,
+ * or nothing
  * 
  * @param addr address to be written to
  * @param data data to be written
  */
-void Bus::write(uint16_t addr, uint8_t data)
+void Bus::write_io(uint16_t addr, uint8_t data)
 {
-    if (addr >= MIN_RAM_ADDR && addr <= MAX_RAM_ADDR) 
-        ram[addr] = data;
+    if (breakpoints && (breakpoints->flags[addr] & Breakpoints::WRITE))
+        breakpoints->access(addr, data, Breakpoints::WRITE, peek_io(addr));
+
+    const DEVICE_SLOT &slot = slots[device_map[addr]];
+    if (slot.device)
+        slot.device->write(addr & slot.mask, data);
+    else if (memory_write[addr >> 8])
+    {
+        memory_write[addr >> 8][addr & 0xFF] = data;
+        mark_dirty(addr);
+    }
+    else if (mapper && addr >= 0x4020)
+        mapper->write(addr, data);
 }
 
 /**
- * @brief read data from a  specified address, returns data
+ * @brief read data from an address without a fast path: a device, memory
+ * watched by a watchpoint, or nothing
  * In normal operation "Read Only" is set to false.
  * Some devices on the bus may change state when they are read from, and this 
  * is intentional under normal circumstances. However the disassembler will
  * want to read the data at an address without changing the state of the
- * devices on the bus
+ * devices on the bus, so those reads go to the device's peek instead
  * 
  * @param addr address to be read from
- * @param ReadOnly true if only read is needed, default is false
+ * @param ReadOnly true if only read is needed
  * @return uint8_t 
  */
-uint8_t Bus::read(uint16_t addr, bool ReadOnly)
+uint8_t Bus::read_io(uint16_t addr, bool ReadOnly)
 {
-    if (addr >= MIN_RAM_ADDR && addr <= MAX_RAM_ADDR)
-        return ram[addr];
+    if (ReadOnly)
+        return peek_io(addr);
+
+    const DEVICE_SLOT &slot = slots[device_map[addr]];
+    uint8_t data = slot.device ? slot.device->read(addr & slot.mask) : peek_io(addr);
+    if (breakpoints && (breakpoints->flags[addr] & Breakpoints::READ))
+        breakpoints->access(addr, data, Breakpoints::READ, data);
+    return data;
+}
+
+/**
+ * @brief ReadOnly read of an address without a fast path
+ * 
+ * @param addr address to be read from
+ * @return uint8_t 
+ */
+uint8_t Bus::peek_io(uint16_t addr) const
+{
+    const DEVICE_SLOT &slot = slots[device_map[addr]];
+    if (slot.device)
+        return slot.device->peek(addr & slot.mask);
+    if (memory_read[addr >> 8])
+        return memory_read[addr >> 8][addr & 0xFF];
     return 0x00;
 }
 
+/**
+ * @brief Copies a range of the address space without side effects
+ * 
+ * @param start first address, the range wraps around at $FFFF
+ * @param len number of bytes
+ * @param dst receives len bytes
+ */
+void Bus::peek_range(uint16_t start, uint32_t len, uint8_t *dst) const
+{
+    uint16_t addr = start;
+    while (len > 0)
+    {
+        // The rest of the page
+        uint32_t n = std::min<uint32_t>(len, 0x100 - (addr & 0xFF));
+        const uint8_t *memory = read_pages[addr >> 8];
+        if (memory)
+            std::memcpy(dst, memory + (addr & 0xFF), n);
+        else
+            for (uint32_t i = 0; i < n; i++)
+                dst[i] = peek_io((uint16_t)(addr + i));
+        dst += n;
+        addr += n;
+        len -= n;
+    }
+}
+
 
 
 
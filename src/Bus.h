@@ -3,11 +3,51 @@
 
 #include <cstdint>
 #include <array>
+#include <vector>
 #include "config.h"
 #include "R6502.h"
+#ifdef R6502_TRACE
+#include "BusTrace.h"
+#endif
 
+class Mapper;
+class Breakpoints;
+class InstructionTrace;
+class Profiler;
+class StateWriter;
+class StateReader;
 
 
+// A memory mapped device, attached to a range of addresses with Bus::attach.
+// It gets every access to the range, with the address already mirrored
+class BusDevice
+{
+public:
+    virtual ~BusDevice() = default;
+
+    virtual uint8_t read(uint16_t addr) = 0;
+    virtual void write(uint16_t addr, uint8_t data) = 0;
+
+    // What read would return, without any of its side effects. Used for the
+    // ReadOnly reads of debuggers and the disassembler
+    virtual uint8_t peek(uint16_t addr) const = 0;
+
+    // Save states (SaveState.h): write the device's state, and read it back in
+    // the same order. Devices without state need neither
+    virtual void save_state(StateWriter &) const {}
+    virtual void load_state(StateReader &) {}
+};
+
+
+// Something that acts at a known clock_count, see Bus::schedule
+class BusEvent
+{
+public:
+    virtual ~BusEvent() = default;
+
+    // cycle is the clock_count it was scheduled for, the CPU may be a little past it
+    virtual void fire(uint32_t cycle) = 0;
+};
 
 
 class Bus
@@ -24,10 +64,194 @@ public:
     // Fake RAM 64KB (note: compiler might complain about this)
     std::array<uint8_t, 64 * 1024> ram;
 
-    // bus read & write functions
-    void write(uint16_t addr, uint8_t data);
-    uint8_t read(uint16_t addr, bool ReadOnly = false);
+    // The memory map: one entry per 256 byte page. Pages backed by host memory
+    // (RAM or ROM) point straight at it, so accessing them is a single indexed
+    // load or store; ROM pages have no write pointer. Pages with a device
+    // attached anywhere in them, or without memory, have no pointers and go
+    // through the device table. Initially the pages between MIN_RAM_ADDR and
+    // MAX_RAM_ADDR are mapped to ram.
+    std::array<const uint8_t *, 256> read_pages = {};
+    std::array<uint8_t *, 256> write_pages = {};
 
-};
+    // Incremented by every change to the memory map
+    uint32_t map_version = 0;
+
+    // Map size bytes at addr (both multiples of 256) to host memory, or remove
+    // it. Only pointers are swapped, so bank switching costs nothing per access.
+    // The memory must stay valid while it is mapped. Unmapped addresses read as 0.
+    void map_ram(uint16_t addr, uint32_t size, uint8_t *memory);
+    void map_rom(uint16_t addr, uint32_t size, const uint8_t *memory);
+    void unmap(uint16_t addr, uint32_t size);
+
+    // Attach a device to the addresses first to last, in front of any memory
+    // mapped there. The device sees addr & mask, so a mask repeats its registers
+    // through the range, e.g. attach(&ppu, 0x2000, 0x3FFF, 0x2007). Attaching is
+    // resolved into a table with a slot per address, so an access costs one
+    // lookup and a virtual call whatever the number of devices (at most 255
+    // device and mask pairs). A device covered at all its addresses by a later
+    // attach is detached.
+    bool attach(BusDevice *device, uint16_t first, uint16_t last, uint16_t mask = 0xFFFF);
+    void detach(BusDevice *device);
+
+    // The attached devices, each once, in slot order into list (room for 255).
+    // Returns how many there are
+    uint32_t devices(BusDevice **list) const;
+
+    // True if the page reads and writes the same page of ram with no device in
+    // front of it. Those are the pages the JIT's compiled code accesses directly
+    bool ram_page(uint8_t page) const
+    {
+        return device_bytes[page] == 0 && memory_read[page] == &ram[page << 8] &&
+               memory_write[page] == &ram[page << 8];
+    }
+
+    // The host memory a page writes to, nullptr for ROM and unmapped pages
+    uint8_t *page_memory(uint8_t page) const { return memory_write[page]; }
+
+    // Dirty tracking: which memory has been written through the bus since the
+    // last take_dirty. With DIRTY_PAGES (a bit per 256 byte page) a clean page
+    // has no write pointer, so only its first write goes out of line to set the
+    // bit. DIRTY_LINES adds a bit per 64 byte line and sends every write to
+    // memory out of line. With DIRTY_OFF, the default, writes are not touched.
+    // Mapping memory marks its pages; device writes and direct stores into ram
+    // by the host are not tracked.
+    enum DIRTY
+    {
+        DIRTY_OFF,
+        DIRTY_PAGES,
+        DIRTY_LINES,
+    };
+    void track_dirty(DIRTY mode);
+    DIRTY dirty_tracking() const { return dirty_mode; }
+
+    // Copy the bitmaps into pages (256 bits) and lines (1024 bits, may be null)
+    // and clear them in the same call, so no write can fall in between. Bit n
+    // is bit n % 64 of word n / 64. Call it on the thread running the CPU
+    void take_dirty(uint64_t *pages, uint64_t *lines = nullptr);
+
+    // The bitmaps themselves, also set by the JIT's compiled stores
+    std::array<uint64_t, 4> dirty_pages = {};
+    std::array<uint64_t, 16> dirty_lines = {};
 
+#ifdef R6502_TRACE
+    // Records every access while set. CACHED and JIT then run as SWITCH, as
+    // they don't make all their accesses through the bus
+    BusTrace *trace = nullptr;
+#endif
 
+    // bus read & write functions. Host memory is accessed inline, the rest
+    // calls through to read_io and write_io
+    inline void write(uint16_t addr, uint8_t data)
+    {
+#ifdef R6502_TRACE
+        if (trace)
+            trace->record(addr, data, BusTrace::WRITE);
+#endif
+        // Let the CPU drop any instructions it has decoded from this address
+        cpu.notify_write(addr);
+
+        uint8_t *memory = write_pages[addr >> 8];
+        if (memory)
+            memory[addr & 0xFF] = data;
+        else
+            write_io(addr, data);
+    }
+
+    inline uint8_t read(uint16_t addr, bool ReadOnly = false)
+    {
+        const uint8_t *memory = read_pages[addr >> 8];
+        uint8_t data = memory ? memory[addr & 0xFF] : read_io(addr, ReadOnly);
+#ifdef R6502_TRACE
+        if (trace && !ReadOnly)
+            trace->record(addr, data, BusTrace::READ);
+#endif
+        return data;
+    }
+
+    // An opcode fetch, which is a read that traces as one
+    inline uint8_t fetch(uint16_t addr)
+    {
+        const uint8_t *memory = read_pages[addr >> 8];
+        uint8_t data = memory ? memory[addr & 0xFF] : read_io(addr, false);
+#ifdef R6502_TRACE
+        if (trace)
+            trace->record(addr, data, BusTrace::READ | BusTrace::FETCH);
+#endif
+        return data;
+    }
+
+    // The cartridge's mapper (Mapper.h). Writes to cartridge space ($4020-$FFFF)
+    // that hit neither memory nor a device, that is writes to ROM, are its
+    // registers; nothing else on the bus involves it
+    Mapper *mapper = nullptr;
+
+    // Breakpoints and watchpoints (Breakpoints.h), set while one is attached.
+    // Watched pages lose their fast path pointers, like clean pages with
+    // dirty tracking, and run() stops at a hit
+    Breakpoints *breakpoints = nullptr;
+
+    // Records every instruction the CPU starts while set (InstructionTrace.h)
+    InstructionTrace *instruction_trace = nullptr;
+
+    // Counts the instructions and cycles of every address and call stack while
+    // set (Profiler.h)
+    Profiler *profiler = nullptr;
+
+    // Timed events: run() runs the CPU in slices that end at the next event, so
+    // devices that act at a known time (an MMC3 scanline IRQ) need no polling.
+    // An event fires after the instruction during which its cycle is reached.
+    // An event is pending at most once, scheduling it again moves it
+    void schedule(BusEvent *event, uint32_t cycle);
+    void cancel(BusEvent *event);
+
+    // The IRQ line, level triggered: each source holds its bit until it is
+    // acknowledged. run() takes the interrupt as soon as the I flag allows
+    void set_irq(uint32_t source, bool asserted);
+    uint32_t irq_sources() const { return irq_lines; }
+
+    // R6502::run with events and interrupts. While an IRQ is pending, the CPU
+    // goes instruction by instruction until it is taken and acknowledged.
+    // Returns early once a breakpoint has stopped the CPU
+    uint32_t run(uint32_t budget);
+
+    // Copy len bytes from start on (wrapping at $FFFF) into dst without side
+    // effects, as ReadOnly reads would return them. Memory pages are copied
+    // whole, only device addresses are peeked one by one
+    void peek_range(uint16_t start, uint32_t len, uint8_t *dst) const;
+
+private:
+    friend class Breakpoints;
+
+    struct DEVICE_SLOT
+    {
+        BusDevice *device = nullptr;
+        uint16_t mask = 0;
+    };
+
+    // Slot of the device attached to each address, 0 for none
+    std::array<uint8_t, 64 * 1024> device_map = {};
+    std::array<DEVICE_SLOT, 256> slots = {};
+    std::array<uint16_t, 256> device_bytes = {}; // Addresses with a device, per page
+
+    // Host memory of each page, also for pages a device hides from the fast path
+    std::array<const uint8_t *, 256> memory_read = {};
+    std::array<uint8_t *, 256> memory_write = {};
+
+    DIRTY dirty_mode = DIRTY_OFF;
+
+    struct TIMED_EVENT
+    {
+        BusEvent *event;
+        uint32_t cycle;
+    };
+    std::vector<TIMED_EVENT> events;
+    uint32_t irq_lines = 0;
+
+    void map_page(uint8_t page, const uint8_t *read, uint8_t *write);
+    void update_page(uint8_t page);
+    void mark_dirty(uint16_t addr);
+    void fire_events();
+    void write_io(uint16_t addr, uint8_t data);
+    uint8_t read_io(uint16_t addr, bool ReadOnly);
+    uint8_t peek_io(uint16_t addr) const;
+};
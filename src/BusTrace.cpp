@@ -0,0 +1,105 @@
+#include "config.h"
+#include "BusTrace.h"
+
+#include <algorithm>
+#include <chrono>
+
+BusTrace::BusTrace(uint32_t capacity_log2)
+{
+    ring.resize((size_t)1 << std::min<uint32_t>(capacity_log2, 30));
+    mask = ring.size() - 1;
+}
+
+BusTrace::~BusTrace()
+{
+    stop();
+}
+
+/**
+ * @brief Opens the trace file and starts the thread draining the ring into it
+ *
+ * @param path the file, replaced if it exists
+ * @return true if the file could be created
+ */
+bool BusTrace::start(const std::string &path)
+{
+    stop();
+    file = fopen(path.c_str(), "wb");
+    if (!file)
+        return false;
+
+    uint8_t header[16] = {'R', '6', '5', '0', '2', 'B', 'T', 0};
+    uint32_t version = VERSION, size = sizeof(RECORD);
+    std::copy((uint8_t *)&version, (uint8_t *)&version + 4, header + 8);
+    std::copy((uint8_t *)&size, (uint8_t *)&size + 4, header + 12);
+    fwrite(header, 1, sizeof(header), file);
+
+    running.store(true, std::memory_order_release);
+    drainer = std::thread([this]
+    {
+        while (running.load(std::memory_order_acquire))
+            if (drain() == 0)
+                std::this_thread::sleep_for(std::chrono::microseconds(100));
+    });
+    return true;
+}
+
+/**
+ * @brief Stops the drain thread, writes the records still in the ring and
+ * closes the file
+ */
+void BusTrace::stop()
+{
+    flush();
+    if (drainer.joinable())
+    {
+        running.store(false, std::memory_order_release);
+        drainer.join();
+    }
+    if (file)
+    {
+        while (drain() != 0)
+            ;
+        fclose(file);
+        file = nullptr;
+    }
+}
+
+/**
+ * @brief Writes the records between tail and head, up to the end of the ring
+ *
+ * @return size_t number of records written
+ */
+size_t BusTrace::drain()
+{
+    uint64_t h = head.load(std::memory_order_acquire);
+    uint64_t t = tail.load(std::memory_order_relaxed);
+    if (h == t)
+        return 0;
+    size_t first = t & mask;
+    size_t n = std::min<uint64_t>(h - t, ring.size() - first);
+    fwrite(&ring[first], sizeof(RECORD), n, file);
+    tail.store(t + n, std::memory_order_release);
+    return n;
+}
+
+/**
+ * @brief Called by record() when the ring is full: waits until the drain
+ * thread frees a slot, or drops the record
+ *
+ * @param h the producer's head
+ * @return true if there is space
+ */
+bool BusTrace::wait_for_space(uint64_t h)
+{
+    flush();
+    while (lossless && running.load(std::memory_order_acquire))
+    {
+        std::this_thread::yield();
+        tail_seen = tail.load(std::memory_order_acquire);
+        if (h - tail_seen < ring.size())
+            return true;
+    }
+    lost++;
+    return false;
+}
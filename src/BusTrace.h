@@ -0,0 +1,109 @@
+#pragma once
+#include "config.h"
+
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Bus access tracer, built in with R6502_TRACE (config.h). Attached to
+// Bus::trace, every CPU read, write and opcode fetch is stored as an 8 byte
+// record in a fixed size single producer, single consumer ring, and a thread
+// started by start() drains the ring to a file. The producer is the thread
+// running the CPU and only touches the ring and its own head index.
+//
+// The file is a 16 byte header ("R6502BT", a version and the record size)
+// followed by the records.
+class BusTrace
+{
+public:
+    enum FLAGS : uint8_t
+    {
+        READ = 0x01,
+        WRITE = 0x02,
+        FETCH = 0x04, // An opcode fetch, with READ
+    };
+
+    struct RECORD
+    {
+        uint32_t delta; // Cycles since the previous record
+        uint16_t addr;
+        uint8_t data;
+        uint8_t flags;
+    };
+    static_assert(sizeof(RECORD) == 8, "trace records are 8 bytes");
+
+    static constexpr uint32_t VERSION = 1;
+
+    // A ring of 1 << capacity_log2 records
+    explicit BusTrace(uint32_t capacity_log2 = 16);
+    ~BusTrace();
+    BusTrace(const BusTrace &) = delete;
+    BusTrace &operator=(const BusTrace &) = delete;
+
+    // Cycle at which the current instruction started, kept up to date by the
+    // CPU. In a cycle exact build the accesses of an instruction are on
+    // consecutive cycles from there
+    uint32_t cycle = 0;
+
+    // When the ring is full the CPU waits for the drain thread (lossless, the
+    // default) or the record is dropped and counted
+    bool lossless = true;
+
+    inline void record(uint16_t addr, uint8_t data, uint8_t flags)
+    {
+        uint64_t h = written;
+        if (h - tail_seen == ring.size())
+        {
+            tail_seen = tail.load(std::memory_order_acquire);
+            if (h - tail_seen == ring.size() && !wait_for_space(h))
+                return;
+        }
+        ring[h & mask] = {cycle - last_cycle, addr, data, flags};
+        last_cycle = cycle;
+        written = h + 1;
+
+        // Handing records over in batches keeps the consumer off the cache
+        // line of every single one
+        if ((written & (PUBLISH - 1)) == 0)
+            head.store(written, std::memory_order_release);
+    }
+
+    // Hand over the records of an unfinished batch, done by stop()
+    void flush() { head.store(written, std::memory_order_release); }
+
+    // Open the file and start draining into it, or stop, drain what is left
+    // and close it. stop() is called on the producer thread, or once it is done
+    bool start(const std::string &path);
+    void stop();
+
+    // Counts, for the producer thread or after stop()
+    uint64_t records() const { return written; }
+    uint64_t dropped() const { return lost; }
+
+private:
+    std::vector<RECORD> ring;
+    uint64_t mask;
+
+    static constexpr uint64_t PUBLISH = 256;
+
+    // Producer side
+    alignas(64) uint64_t written = 0;
+    uint64_t tail_seen = 0;
+    uint32_t last_cycle = 0;
+    uint64_t lost = 0;
+
+    // Shared: records handed over and records drained
+    alignas(64) std::atomic<uint64_t> head{0};
+    alignas(64) std::atomic<uint64_t> tail{0};
+
+    // Consumer side
+    std::atomic<bool> running{false};
+    std::thread drainer;
+    FILE *file = nullptr;
+
+    bool wait_for_space(uint64_t h);
+    size_t drain();
+};
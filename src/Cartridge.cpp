@@ -0,0 +1,253 @@
+#include "config.h"
+#include "Cartridge.h"
+
+#include <fstream>
+#include <iterator>
+
+#include "Bus.h"
+
+#if defined(__unix__) || defined(__APPLE__)
+#define CARTRIDGE_MMAP 1
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#else
+#define CARTRIDGE_MMAP 0
+#endif
+
+// Header layout: https://www.nesdev.org/wiki/INES and https://www.nesdev.org/wiki/NES_2.0
+static constexpr uint32_t HEADER_SIZE = 16;
+static constexpr uint32_t TRAINER_SIZE = 512;
+static constexpr uint32_t PRG_UNIT = 16 * 1024;
+static constexpr uint32_t CHR_UNIT = 8 * 1024;
+
+Cartridge::~Cartridge()
+{
+    unload();
+}
+
+/**
+ * @brief Maps an image file read-only. Where the platform has no mmap the file
+ * is read into memory instead
+ *
+ * @param path the .nes file
+ * @return true if the file is a valid image
+ */
+bool Cartridge::load(const std::string &path)
+{
+    unload();
+
+#if CARTRIDGE_MMAP
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+    {
+        error = "cannot open " + path;
+        return false;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size < (off_t)HEADER_SIZE)
+    {
+        close(fd);
+        error = path + " is too small for an iNES image";
+        return false;
+    }
+    // The mapping keeps the file open
+    void *memory = mmap(nullptr, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (memory == MAP_FAILED)
+    {
+        error = "cannot map " + path;
+        return false;
+    }
+    image = (const uint8_t *)memory;
+    image_size = (size_t)st.st_size;
+    mapped = true;
+#else
+    std::ifstream file(path, std::ios::binary);
+    if (!file)
+    {
+        error = "cannot open " + path;
+        return false;
+    }
+    contents.assign(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+    image = contents.data();
+    image_size = contents.size();
+#endif
+
+    if (!parse())
+    {
+        std::string reason = error;
+        unload();
+        error = path + ": " + reason;
+        return false;
+    }
+    return true;
+}
+
+/**
+ * @brief Uses an image that is already in memory, without copying it
+ *
+ * @param data the image, valid until the cartridge is unloaded
+ * @param size its size in bytes
+ * @return true if it is a valid image
+ */
+bool Cartridge::load(const uint8_t *data, size_t size)
+{
+    unload();
+    image = data;
+    image_size = size;
+    if (!parse())
+    {
+        std::string reason = error;
+        unload();
+        error = reason;
+        return false;
+    }
+    return true;
+}
+
+/**
+ * @brief Releases the image. Buses it was mapped into must be remapped first
+ */
+void Cartridge::unload()
+{
+#if CARTRIDGE_MMAP
+    if (mapped)
+        munmap((void *)image, image_size);
+#endif
+    image = nullptr;
+    image_size = 0;
+    mapped = false;
+    contents.clear();
+    contents.shrink_to_fit();
+
+    format = FORMAT_NONE;
+    mapper = 0;
+    submapper = 0;
+    mirror = MIRROR_HORIZONTAL;
+    battery = false;
+    prg_ram_size = 0;
+    chr_ram_size = 0;
+    trainer = SPAN();
+    prg = SPAN();
+    chr = SPAN();
+    error.clear();
+}
+
+/**
+ * @brief Size of a NES 2.0 ROM from its size bytes. Returns false for sizes
+ * that can't be real (over 4GB)
+ */
+static bool nes2_rom_size(uint8_t lsb, uint8_t msb, uint32_t unit, uint64_t &size)
+{
+    if (msb != 0x0F)
+    {
+        size = (uint64_t)(msb << 8 | lsb) * unit;
+        return true;
+    }
+    // Exponent-multiplier notation: 2^E * (MM * 2 + 1) bytes
+    uint32_t exponent = lsb >> 2;
+    if (exponent > 31)
+        return false;
+    size = ((uint64_t)1 << exponent) * ((lsb & 0x03) * 2 + 1);
+    return true;
+}
+
+/**
+ * @brief Validates the header and sets up the fields and spans
+ */
+bool Cartridge::parse()
+{
+    const uint8_t *h = image;
+    if (image_size < HEADER_SIZE || h[0] != 'N' || h[1] != 'E' || h[2] != 'S' || h[3] != 0x1A)
+    {
+        error = "not an iNES image";
+        return false;
+    }
+
+    format = (h[7] & 0x0C) == 0x08 ? FORMAT_NES2 : FORMAT_INES;
+    mirror = (h[6] & 0x08) ? MIRROR_FOUR_SCREEN : (h[6] & 0x01) ? MIRROR_VERTICAL : MIRROR_HORIZONTAL;
+    battery = (h[6] & 0x02) != 0;
+    bool has_trainer = (h[6] & 0x04) != 0;
+
+    uint64_t prg_size, chr_size;
+    if (format == FORMAT_NES2)
+    {
+        mapper = (uint16_t)((h[8] & 0x0F) << 8 | (h[7] & 0xF0) | h[6] >> 4);
+        submapper = h[8] >> 4;
+        if (!nes2_rom_size(h[4], h[9] & 0x0F, PRG_UNIT, prg_size) ||
+            !nes2_rom_size(h[5], h[9] >> 4, CHR_UNIT, chr_size))
+        {
+            error = "invalid ROM size";
+            return false;
+        }
+        // RAM sizes are shift counts, 64 << n bytes
+        auto shifted = [](uint8_t n) -> uint32_t { return n ? 64u << n : 0; };
+        prg_ram_size = shifted(h[10] & 0x0F) + shifted(h[10] >> 4);
+        chr_ram_size = shifted(h[11] & 0x0F) + shifted(h[11] >> 4);
+    }
+    else
+    {
+        // Old dumps tagged with "DiskDude!" have garbage from byte 7 on, their
+        // upper mapper nibble is not to be trusted
+        bool dirty_tail = h[12] || h[13] || h[14] || h[15];
+        mapper = (uint16_t)((dirty_tail ? 0 : h[7] & 0xF0) | h[6] >> 4);
+        submapper = 0;
+        prg_size = (uint64_t)h[4] * PRG_UNIT;
+        chr_size = (uint64_t)h[5] * CHR_UNIT;
+        prg_ram_size = (dirty_tail || h[8] == 0 ? 1 : h[8]) * 8 * 1024;
+        chr_ram_size = chr_size ? 0 : CHR_UNIT;
+    }
+
+    if (prg_size == 0)
+    {
+        error = "no PRG ROM";
+        return false;
+    }
+    uint64_t offset = HEADER_SIZE + (has_trainer ? TRAINER_SIZE : 0);
+    if (offset + prg_size + chr_size > image_size)
+    {
+        error = "image is shorter than its header says";
+        return false;
+    }
+
+    if (has_trainer)
+        trainer = {image + HEADER_SIZE, TRAINER_SIZE};
+    prg = {image + offset, (uint32_t)prg_size};
+    chr = {image + offset + prg_size, (uint32_t)chr_size};
+    return true;
+}
+
+/**
+ * @brief A bank of a ROM
+ *
+ * @param rom the PRG or CHR ROM
+ * @param index bank number, wrapped around the number of banks
+ * @param size bank size in bytes
+ * @return SPAN the bank, empty if the ROM is smaller than a bank
+ */
+Cartridge::SPAN Cartridge::bank(const SPAN &rom, uint32_t index, uint32_t size)
+{
+    uint32_t count = size ? rom.size / size : 0;
+    if (count == 0)
+        return SPAN();
+    return {rom.data + (uint64_t)(index % count) * size, size};
+}
+
+/**
+ * @brief Maps the PRG ROM into the CPU address space: the first 16KB at $8000
+ * and the last at $C000, so 16KB images appear twice and 32KB images whole.
+ * That is NROM, and the power on state of UxROM-like boards
+ *
+ * @param bus the bus to map into
+ * @return true on success, false if nothing is loaded
+ */
+bool Cartridge::map(Bus &bus) const
+{
+    if (prg.size < PRG_UNIT)
+        return false;
+    bus.map_rom(0x8000, PRG_UNIT, prg_bank(0, PRG_UNIT).data);
+    bus.map_rom(0xC000, PRG_UNIT, prg_bank(prg.size / PRG_UNIT - 1, PRG_UNIT).data);
+    return true;
+}
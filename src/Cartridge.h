@@ -0,0 +1,91 @@
+#pragma once
+#include "config.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+class Bus;
+
+// An iNES or NES 2.0 cartridge image. The file is mapped read-only rather than
+// read, so loading only parses the 16 byte header, and the PRG and CHR banks
+// are spans into the mapping: nothing is copied, and every emulator instance
+// running the same file shares its physical pages through the page cache.
+// The cartridge has to outlive any Bus it is mapped into.
+class Cartridge
+{
+public:
+    Cartridge() = default;
+    ~Cartridge();
+    Cartridge(const Cartridge &) = delete;
+    Cartridge &operator=(const Cartridge &) = delete;
+
+    // A range of the image
+    struct SPAN
+    {
+        const uint8_t *data = nullptr;
+        uint32_t size = 0;
+
+        const uint8_t &operator[](uint32_t i) const { return data[i]; }
+        bool empty() const { return size == 0; }
+    };
+
+    enum FORMAT
+    {
+        FORMAT_NONE,
+        FORMAT_INES,
+        FORMAT_NES2,
+    };
+
+    // Nametable mirroring. The single screen modes are set by mappers such as MMC1
+    enum MIRROR
+    {
+        MIRROR_HORIZONTAL,
+        MIRROR_VERTICAL,
+        MIRROR_FOUR_SCREEN,
+        MIRROR_SINGLE_LOWER,
+        MIRROR_SINGLE_UPPER,
+    };
+
+    // Map and validate a file, or an image already in memory (which must stay
+    // valid while the cartridge uses it). On failure false is returned and
+    // error says why
+    bool load(const std::string &path);
+    bool load(const uint8_t *image, size_t size);
+    void unload();
+
+    // Header fields
+    FORMAT format = FORMAT_NONE;
+    uint16_t mapper = 0;
+    uint8_t submapper = 0;
+    MIRROR mirror = MIRROR_HORIZONTAL;
+    bool battery = false;
+    uint32_t prg_ram_size = 0; // Work RAM the cartridge provides at $6000, volatile and battery backed
+    uint32_t chr_ram_size = 0; // CHR RAM, when the image has no CHR ROM
+
+    // The image's contents
+    SPAN trainer; // 512 bytes for $7000-$71FF, or empty
+    SPAN prg;
+    SPAN chr;
+
+    std::string error;
+
+    // Bank index of the PRG or CHR ROM, in banks of size bytes. The index wraps
+    // around the number of banks like the address lines of a smaller ROM do
+    SPAN prg_bank(uint32_t index, uint32_t size) const { return bank(prg, index, size); }
+    SPAN chr_bank(uint32_t index, uint32_t size) const { return bank(chr, index, size); }
+
+    // Map the PRG ROM into $8000-$FFFF as NROM (mapper 0) boards do, mirroring
+    // 16KB images into both halves
+    bool map(Bus &bus) const;
+
+private:
+    const uint8_t *image = nullptr;
+    size_t image_size = 0;
+    bool mapped = false;            // image is a mapping of the file
+    std::vector<uint8_t> contents;  // The file where it can't be mapped
+
+    static SPAN bank(const SPAN &rom, uint32_t index, uint32_t size);
+    bool parse();
+};
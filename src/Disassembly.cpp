@@ -0,0 +1,154 @@
+#include "config.h"
+#include "Disassembly.h"
+
+#include <algorithm>
+#include <cstring>
+
+Disassembly::Disassembly(Bus &bus) : bus(bus), slots(64 * 1024) {}
+
+uint32_t Disassembly::length(uint32_t addr) const
+{
+    return R6502::instruction_length(bytes[addr]);
+}
+
+/**
+ * @brief Compares memory with the bytes decoded so far, clears the slots of
+ * the pages that differ and re-sweeps the instruction boundaries through them
+ *
+ * @return the number of pages that changed (all of them the first time)
+ */
+uint32_t Disassembly::update()
+{
+    std::array<bool, 256> changed;
+    uint32_t count = 0;
+    uint8_t page_bytes[256];
+    for (uint32_t page = 0; page < 256; page++)
+    {
+        // Memory pages are compared where they are, only device pages are peeked
+        uint8_t *old = &bytes[page << 8];
+        const uint8_t *now = bus.read_pages[page];
+        if (!now)
+        {
+            bus.peek_range((uint16_t)(page << 8), 256, page_bytes);
+            now = page_bytes;
+        }
+        changed[page] = !swept || std::memcmp(old, now, 256) != 0;
+        if (!changed[page])
+            continue;
+        std::memcpy(old, now, 256);
+        count++;
+
+        // The two instructions before the page may have operands in it
+        for (uint32_t addr = (page << 8) - 2; addr != (page << 8) + 256; addr++)
+            slots[addr & 0xFFFF].length = 0;
+    }
+
+    if (!swept)
+    {
+        sweep(0, NONE);
+        swept = true;
+        return count;
+    }
+
+    // Re-sweep each run of changed pages
+    for (uint32_t page = 0; page < 256;)
+    {
+        if (!changed[page])
+        {
+            page++;
+            continue;
+        }
+        uint32_t first = page;
+        while (page < 256 && changed[page])
+            page++;
+        sweep(first << 8, page << 8);
+    }
+    return count;
+}
+
+/**
+ * @brief Follows the instructions from the last boundary at or before from,
+ * marking where each starts, until past changed_end it reaches a boundary the
+ * old sweep had too. From there on nothing differs
+ */
+void Disassembly::sweep(uint32_t from, uint32_t changed_end)
+{
+    uint32_t addr = from;
+    while (addr > 0 && !is_start(addr))
+        addr--;
+
+    while (addr < NONE)
+    {
+        if (addr >= changed_end && is_start(addr))
+            break;
+        starts[addr >> 6] |= 1ull << (addr & 63);
+        uint32_t next = addr + length(addr);
+        for (uint32_t inside = addr + 1; inside < next && inside < NONE; inside++)
+            starts[inside >> 6] &= ~(1ull << (inside & 63));
+        addr = next;
+    }
+}
+
+/**
+ * @brief The closest boundary of the sweep whose instruction ends at or before
+ * addr, NONE if there is none. At most a few bytes back
+ */
+uint32_t Disassembly::previous(uint32_t addr) const
+{
+    for (uint32_t at = addr; at-- > 0;)
+        if (is_start(at) && at + length(at) <= addr)
+            return at;
+    return NONE;
+}
+
+/**
+ * @brief Fills the slot of addr with the text of the instruction there. The
+ * operands wrap around at $FFFF
+ */
+void Disassembly::decode(uint16_t addr)
+{
+    const uint8_t instruction[3] = {bytes[addr], bytes[(uint16_t)(addr + 1)], bytes[(uint16_t)(addr + 2)]};
+    SLOT &slot = slots[addr];
+    R6502::format_instruction(addr, instruction, slot.text, TEXT_SIZE);
+    slot.length = (uint8_t)length(addr);
+    decoded++;
+}
+
+Disassembly::LINE Disassembly::line(uint16_t addr)
+{
+    if (!swept)
+        update();
+    if (slots[addr].length == 0)
+        decode(addr);
+    return {addr, slots[addr].length, slots[addr].text};
+}
+
+/**
+ * @brief The lines around an address, for a debugger's view of the code
+ * around PC
+ */
+uint32_t Disassembly::around(uint16_t addr, uint32_t before, uint32_t after, LINE *lines)
+{
+    if (!swept)
+        update();
+
+    // Walk back along the sweep, then put those lines in order
+    uint32_t count = 0;
+    for (uint32_t at = addr; count < before;)
+    {
+        at = previous(at);
+        if (at == NONE)
+            break;
+        lines[count++] = line((uint16_t)at);
+    }
+    std::reverse(lines, lines + count);
+
+    // And forward from addr, the way the CPU would go
+    uint32_t at = addr;
+    for (uint32_t i = 0; i <= after && at < NONE; i++)
+    {
+        lines[count] = line((uint16_t)at);
+        at += lines[count++].length;
+    }
+    return count;
+}
@@ -0,0 +1,85 @@
+#pragma once
+#include "config.h"
+
+#include <array>
+#include <cstdint>
+#include <vector>
+
+#include "Bus.h"
+
+// A disassembly of the whole address space that is kept up to date instead of
+// rebuilt. Every address has a fixed size slot holding the text of the
+// instruction starting there (in the format of R6502::disassemble), filled the
+// first time it is asked for. update() compares memory, as ReadOnly reads see
+// it, with the bytes the slots were decoded from, and only clears the slots of
+// pages that changed, so calling it every frame costs a pass over 64K of
+// memory and no decoding while the program does not change.
+//
+// Which addresses start an instruction depends on where decoding starts. Going
+// forward from an address the cache follows the instructions from there, as
+// the CPU would. Going backward it uses the instruction boundaries of a sweep
+// from $0000, which update() re-sweeps from just before a change until it
+// falls back in step with the old boundaries. That is usually a few bytes on,
+// but a change can shift every boundary after it (through a long run of two
+// byte BRKs, which is what zeros decode to), and then the sweep goes on to the
+// end: still only the instruction lengths, some 25 us for 32K of them.
+//
+// The bus's dirty bitmaps are not used, so a disassembly works next to
+// Snapshots or anything else taking them, and also sees stores into Bus::ram
+// that bypass the bus and banks switched by a mapper.
+class Disassembly
+{
+public:
+    struct LINE
+    {
+        uint16_t addr;
+        uint8_t length; // Bytes of the instruction, 1 to 3
+        const char *text;
+    };
+
+    // Decodes lazily, nothing is read before the first update()
+    explicit Disassembly(Bus &bus);
+
+    // Catch up with memory. Returns the number of pages that changed
+    uint32_t update();
+
+    // The instruction at addr. The text stays valid until the next update()
+    LINE line(uint16_t addr);
+
+    // Up to before lines ending at or before addr, the line at addr and after
+    // lines following it, in address order, into lines (room for before +
+    // after + 1). Returns the number of lines, which stops early at $FFFF.
+    // Costs O(before + after)
+    uint32_t around(uint16_t addr, uint32_t before, uint32_t after, LINE *lines);
+
+    // Slots decoded since the disassembly was made
+    uint64_t decoded = 0;
+
+private:
+    // Long enough for the longest line, "$FFFF: BNE $FF [$FFFF] {REL}"
+    static constexpr uint32_t TEXT_SIZE = 31;
+
+    struct SLOT
+    {
+        char text[TEXT_SIZE];
+        uint8_t length = 0; // 0 while not decoded
+    };
+
+    Bus &bus;
+    bool swept = false;
+
+    // The bytes the slots and the sweep were decoded from
+    std::array<uint8_t, 64 * 1024> bytes;
+    std::vector<SLOT> slots;
+
+    // A bit per address, set where the sweep from $0000 starts an instruction
+    std::array<uint64_t, 1024> starts = {};
+
+    static constexpr uint32_t NONE = 0x10000;
+
+    bool is_start(uint32_t addr) const { return starts[addr >> 6] >> (addr & 63) & 1; }
+    uint32_t length(uint32_t addr) const;
+    void sweep(uint32_t from, uint32_t changed_end);
+    uint32_t previous(uint32_t addr) const;
+    void decode(uint16_t addr);
+};
@@ -0,0 +1,382 @@
+#include "config.h"
+#include "InstructionTrace.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+
+static const uint8_t trace_magic[8] = {'R', '6', '5', '0', '2', 'I', 'T', 0};
+
+InstructionTrace::InstructionTrace(uint32_t block_log2, uint32_t blocks) : code(64 * 1024)
+{
+    block_size = 1u << std::min<uint32_t>(std::max<uint32_t>(block_log2, 12), 28);
+    uint32_t count = 1;
+    while (count < blocks && count < (1u << 16))
+        count <<= 1;
+    // And one more to fill when records are thrown away
+    buffer.resize((size_t)block_size * (count + 1));
+    mask = count - 1;
+    scratch = &buffer[(size_t)block_size * count];
+
+    for (uint32_t opcode = 0; opcode < 256; opcode++)
+    {
+        lengths[opcode] = (uint8_t)R6502::instruction_length((uint8_t)opcode);
+        base_cycles[opcode] = (uint8_t)R6502::instruction_cycles((uint8_t)opcode);
+        code_mask[opcode] = 0xFFFFFFu >> (8 * (3 - lengths[opcode]));
+    }
+}
+
+InstructionTrace::~InstructionTrace()
+{
+    stop();
+}
+
+/**
+ * @brief Opens the trace file and starts the thread writing blocks into it.
+ * Record indexes start again from 0
+ *
+ * @param path the file, replaced if it exists
+ * @return true if the file could be created
+ */
+bool InstructionTrace::start(const std::string &path)
+{
+    stop();
+    file = fopen(path.c_str(), "wb");
+    if (!file)
+        return false;
+
+    uint8_t header[16];
+    uint32_t version = VERSION, size = sizeof(BLOCK);
+    std::copy(trace_magic, trace_magic + 8, header);
+    std::copy((uint8_t *)&version, (uint8_t *)&version + 4, header + 8);
+    std::copy((uint8_t *)&size, (uint8_t *)&size + 4, header + 12);
+    fwrite(header, 1, sizeof(header), file);
+    file_bytes = sizeof(header);
+    written = 0;
+    lost = 0;
+
+    running.store(true, std::memory_order_release);
+    writer = std::thread([this]
+    {
+        while (running.load(std::memory_order_acquire))
+            if (drain() == 0)
+                std::this_thread::sleep_for(std::chrono::microseconds(100));
+    });
+    return true;
+}
+
+/**
+ * @brief Hands over the block being filled, stops the writer thread, writes
+ * the blocks still in the ring and closes the file
+ */
+void InstructionTrace::stop()
+{
+    close_block();
+    if (writer.joinable())
+    {
+        running.store(false, std::memory_order_release);
+        writer.join();
+    }
+    if (file)
+    {
+        while (drain() != 0)
+            ;
+        fclose(file);
+        file = nullptr;
+    }
+}
+
+/**
+ * @brief Fills in the header of the block being filled and hands it over to
+ * the writer thread. An empty block is not handed over
+ */
+void InstructionTrace::close_block()
+{
+    if (!block)
+        return;
+    BLOCK *header = (BLOCK *)block;
+    uint32_t records = (uint32_t)(written - header->first_index);
+    if (block == scratch)
+        lost += records;
+    else if (records > 0)
+    {
+        header->size = (uint32_t)(out - block - sizeof(BLOCK));
+        header->records = records;
+        blocks_filled++;
+        head.store(blocks_filled, std::memory_order_release);
+    }
+    block = out = limit = nullptr;
+}
+
+/**
+ * @brief The code bytes at pc for record(), when they cross a page or the
+ * page is not plain memory
+ */
+uint32_t InstructionTrace::code_at(Bus &bus, uint32_t pc)
+{
+    return bus.read((uint16_t)pc, true) | bus.read((uint16_t)(pc + 1), true) << 8 |
+           bus.read((uint16_t)(pc + 2), true) << 16;
+}
+
+/**
+ * @brief Called by record() when the block is full, or there is none: hands
+ * it over and starts the next one. Waits for the writer thread to free a
+ * block, or fills the scratch block, whose records are thrown away
+ *
+ * @param clock the clock of the record about to be made
+ */
+void InstructionTrace::next_block(uint32_t clock)
+{
+    close_block();
+
+    uint64_t h = blocks_filled;
+    if (h - tail_seen == mask + 1)
+    {
+        tail_seen = tail.load(std::memory_order_acquire);
+        while (h - tail_seen == mask + 1 && lossless && running.load(std::memory_order_acquire))
+        {
+            std::this_thread::yield();
+            tail_seen = tail.load(std::memory_order_acquire);
+        }
+    }
+    block = h - tail_seen == mask + 1 ? scratch : &buffer[(h & mask) * block_size];
+
+    // Every block starts from nothing known. Blocks are short enough for
+    // clock not to wrap twice within one
+    block_cycle = written == 0 ? clock : block_cycle + (clock - block_clock);
+    block_clock = clock;
+    last_clock = clock;
+    expected = 0;
+    next_pc = NO_PC;
+    registers = 0;
+    generation += 0x01000000;
+    if (generation == 0)
+    {
+        std::fill(code.begin(), code.end(), 0);
+        generation = 0x01000000;
+    }
+
+    BLOCK *header = (BLOCK *)block;
+    header->first_cycle = block_cycle;
+    header->first_index = written;
+    out = block + sizeof(BLOCK);
+    limit = block + block_size - MAX_RECORD;
+}
+
+/**
+ * @brief Writes the oldest block handed over
+ *
+ * @return size_t number of blocks written, 0 or 1
+ */
+size_t InstructionTrace::drain()
+{
+    uint64_t h = head.load(std::memory_order_acquire);
+    uint64_t t = tail.load(std::memory_order_relaxed);
+    if (h == t)
+        return 0;
+    const uint8_t *b = &buffer[(t & mask) * block_size];
+    size_t size = sizeof(BLOCK) + ((const BLOCK *)b)->size;
+    fwrite(b, 1, size, file);
+    file_bytes += size;
+    tail.store(t + 1, std::memory_order_release);
+    return 1;
+}
+
+InstructionTraceReader::InstructionTraceReader() : code(64 * 1024) {}
+
+InstructionTraceReader::~InstructionTraceReader()
+{
+    close();
+}
+
+/**
+ * @brief Opens a trace written by InstructionTrace
+ *
+ * @param path the file
+ * @return true if it is one, of this version
+ */
+bool InstructionTraceReader::open(const std::string &path)
+{
+    close();
+    file = fopen(path.c_str(), "rb");
+    if (!file)
+        return false;
+
+    uint8_t header[16];
+    uint32_t version, size;
+    if (fread(header, 1, sizeof(header), file) != sizeof(header) ||
+        !std::equal(trace_magic, trace_magic + 8, header))
+    {
+        close();
+        return false;
+    }
+    std::copy(header + 8, header + 12, (uint8_t *)&version);
+    std::copy(header + 12, header + 16, (uint8_t *)&size);
+    if (version != InstructionTrace::VERSION || size != sizeof(InstructionTrace::BLOCK))
+    {
+        close();
+        return false;
+    }
+    return true;
+}
+
+void InstructionTraceReader::close()
+{
+    if (file)
+        fclose(file);
+    file = nullptr;
+    left = 0;
+    damaged = false;
+    blocks = 0;
+    record_bytes = 0;
+}
+
+/**
+ * @brief Reads the next block and resets the state its records decode against
+ *
+ * @return false at the end of the file or at a block cut short
+ */
+bool InstructionTraceReader::read_block()
+{
+    do
+    {
+        if (!file || fread(&block, sizeof(block), 1, file) != 1)
+            return false;
+        data.resize(block.size);
+        if (fread(data.data(), 1, block.size, file) != block.size)
+        {
+            damaged = true;
+            return false;
+        }
+        blocks++;
+        record_bytes += block.size;
+    } while (block.records == 0);
+
+    at = 0;
+    left = block.records;
+    std::fill(registers, registers + 5, 0);
+    std::fill(code.begin(), code.end(), 0);
+    next_pc = 0x10000;
+    expected = 0;
+    cycle = block.first_cycle;
+    index = block.first_index;
+    return true;
+}
+
+/**
+ * @brief Decodes the next record, the inverse of InstructionTrace::record
+ */
+bool InstructionTraceReader::next(RECORD &record)
+{
+    if (left == 0 && !read_block())
+        return false;
+
+    // The longest record fits in what is left, or the block is damaged
+    const uint8_t *p = data.data() + at;
+    const uint8_t *end = data.data() + data.size();
+    auto byte = [&]() -> uint8_t {
+        if (p == end)
+        {
+            damaged = true;
+            return 0;
+        }
+        return *p++;
+    };
+
+    uint8_t header = byte();
+    for (uint32_t i = 0; i < 5; i++)
+        if (header >> i & 1)
+            registers[i] = byte();
+
+    uint32_t pc = next_pc;
+    if (header & InstructionTrace::PC)
+    {
+        pc = byte();
+        pc |= byte() << 8;
+    }
+    if (pc > 0xFFFF)
+        damaged = true;
+    pc &= 0xFFFF;
+
+    uint32_t bytes = code[pc];
+    if (header & InstructionTrace::CODE)
+    {
+        uint8_t opcode = byte();
+        uint32_t length = R6502::instruction_length(opcode);
+        bytes = opcode | 0x01000000;
+        for (uint32_t i = 1; i < length; i++)
+            bytes |= byte() << (8 * i);
+        code[pc] = bytes;
+    }
+    else if (bytes == 0)
+        damaged = true;
+
+    uint32_t delta = expected;
+    if (header & InstructionTrace::CYCLES)
+    {
+        delta = 0;
+        for (uint32_t shift = 0; shift < 35; shift += 7)
+        {
+            uint8_t b = byte();
+            delta |= (uint32_t)(b & 0x7F) << shift;
+            if (!(b & 0x80))
+                break;
+        }
+    }
+    if (damaged)
+        return false;
+
+    uint8_t opcode = (uint8_t)bytes;
+    cycle += delta;
+    record.index = index++;
+    record.cycle = cycle;
+    record.pc = (uint16_t)pc;
+    record.bytes[0] = opcode;
+    record.bytes[1] = (uint8_t)(bytes >> 8);
+    record.bytes[2] = (uint8_t)(bytes >> 16);
+    record.length = (uint8_t)R6502::instruction_length(opcode);
+    record.a = registers[0];
+    record.x = registers[1];
+    record.y = registers[2];
+    record.sp = registers[3];
+    record.p = registers[4];
+
+    next_pc = (uint16_t)(pc + record.length);
+    expected = R6502::instruction_cycles(opcode);
+    at = p - data.data();
+    left--;
+    return true;
+}
+
+/**
+ * @brief Skips to a record, reading only the headers of the blocks before
+ * the one holding it
+ */
+bool InstructionTraceReader::seek(uint64_t target)
+{
+    if (!file)
+        return false;
+    fseek(file, 16, SEEK_SET);
+    left = 0;
+    for (;;)
+    {
+        long position = ftell(file);
+        InstructionTrace::BLOCK header;
+        if (fread(&header, sizeof(header), 1, file) != 1)
+            return false;
+        if (header.first_index + header.records > target)
+        {
+            fseek(file, position, SEEK_SET);
+            break;
+        }
+        fseek(file, header.size, SEEK_CUR);
+    }
+
+    if (!read_block())
+        return false;
+    RECORD record;
+    while (index < target)
+        if (!next(record))
+            return false;
+    return true;
+}
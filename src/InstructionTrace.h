@@ -0,0 +1,263 @@
+#pragma once
+#include "config.h"
+
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "Bus.h"
+
+// Instruction tracer. Attached to Bus::instruction_trace, every instruction
+// the CPU starts is recorded with its address, opcode and operands, the
+// registers before it and the cycle it starts on. run() then goes through
+// R6502::run_checked, which runs CACHED and JIT as SWITCH; detached it costs
+// nothing. Records go into large blocks in a single producer, single consumer
+// ring, and a thread started by start() writes full blocks to a file.
+//
+// Each record only holds what the previous one does not predict. A header
+// byte has a bit per field present, in this order:
+//   A, X, Y, SP, P  a byte each, when the register changed
+//   PC              2 bytes, when it is not the address after the previous
+//                   instruction (branches taken, jumps, interrupts)
+//   CODE            the opcode and operands, 1 to 3 bytes, when they differ
+//                   from the last instruction recorded at that address
+//   CYCLES          cycles since the previous record (LEB128), when they are
+//                   not the base cycles of the previous instruction
+// which comes to 2-3 bytes per instruction for most code.
+//
+// The file is a 16 byte header ("R6502IT", a version and the block header
+// size) followed by blocks, each with a BLOCK header and its records. Every
+// block decodes on its own, starting from zeroed registers and no known code,
+// so a reader can skip blocks by their headers.
+class InstructionTrace
+{
+public:
+    enum FIELDS : uint8_t
+    {
+        A = 0x01,
+        X = 0x02,
+        Y = 0x04,
+        SP = 0x08,
+        P = 0x10,
+        PC = 0x20,
+        CODE = 0x40,
+        CYCLES = 0x80,
+    };
+
+    struct BLOCK
+    {
+        uint32_t size;        // Bytes of records after this header
+        uint32_t records;
+        uint64_t first_cycle; // Of the first record
+        uint64_t first_index; // Instructions recorded before it
+    };
+    static_assert(sizeof(BLOCK) == 24, "trace block headers are 24 bytes");
+
+    static constexpr uint32_t VERSION = 1;
+    static constexpr uint32_t MAX_RECORD = 1 + 5 + 2 + 3 + 5;
+
+    // A ring of blocks of 1 << block_log2 bytes
+    explicit InstructionTrace(uint32_t block_log2 = 16, uint32_t blocks = 64);
+    ~InstructionTrace();
+    InstructionTrace(const InstructionTrace &) = delete;
+    InstructionTrace &operator=(const InstructionTrace &) = delete;
+
+    // When the ring is full the CPU waits for the writer thread (lossless, the
+    // default) or the block being filled is thrown away and counted
+    bool lossless = true;
+
+    // Record the instruction the CPU of bus is about to execute, starting on
+    // clock (R6502::clock_count, cycles are kept in 64 bits across its wrap)
+    inline void record(Bus &bus, uint32_t clock)
+    {
+        uint8_t *o = out;
+        if (o >= limit)
+        {
+            next_block(clock);
+            o = out;
+        }
+
+        // The code bytes with one load, unless they cross the page or are not
+        // in memory
+        const R6502 &cpu = bus.cpu;
+        uint32_t pc = cpu.pc;
+        const uint8_t *page = bus.read_pages[pc >> 8];
+        uint32_t bytes;
+        if (page && (pc & 0xFF) <= 0xFC)
+            memcpy(&bytes, page + (pc & 0xFF), 4);
+        else
+            bytes = code_at(bus, pc);
+        uint32_t opcode = bytes & 0xFF;
+        bytes = (bytes & code_mask[opcode]) | generation;
+
+        // A, X, Y and SP are next to each other in R6502, so the compiler
+        // makes this one load, without relying on it
+        uint32_t axys = cpu.a | cpu.x << 8 | cpu.y << 16 | (uint32_t)cpu.stkp << 24;
+        uint64_t now = axys | (uint64_t)(uint8_t)cpu.status << 32;
+        uint64_t changed = now ^ registers;
+        registers = now;
+
+        // Bit 7 of each byte that changed, then gathered into bits 0-4. Each
+        // register is stored, and kept if it changed
+        changed = (((changed & 0x7F7F7F7F7Full) + 0x7F7F7F7F7Full) | changed) & 0x8080808080ull;
+        uint32_t header = (uint32_t)(((changed >> 7) * 0x0102040810000000ull) >> 56) & 0x1F;
+        uint8_t *p = o + 1;
+        p[0] = (uint8_t)now;
+        p += header & 1;
+        p[0] = (uint8_t)(now >> 8);
+        p += header >> 1 & 1;
+        p[0] = (uint8_t)(now >> 16);
+        p += header >> 2 & 1;
+        p[0] = (uint8_t)(now >> 24);
+        p += header >> 3 & 1;
+        p[0] = (uint8_t)(now >> 32);
+        p += header >> 4;
+
+        if (pc != next_pc)
+        {
+            header |= PC;
+            memcpy(p, &pc, 2);
+            p += 2;
+        }
+        uint32_t &known = code[pc];
+        if (known != bytes)
+        {
+            header |= CODE;
+            known = bytes;
+            memcpy(p, &bytes, 4);
+            p += lengths[opcode];
+        }
+        uint32_t delta = clock - last_clock;
+        if (delta != expected)
+        {
+            header |= CYCLES;
+            for (; delta >= 0x80; delta >>= 7)
+                *p++ = (uint8_t)(delta | 0x80);
+            *p++ = (uint8_t)delta;
+        }
+        o[0] = (uint8_t)header;
+        out = p;
+
+        last_clock = clock;
+        next_pc = (pc + lengths[opcode]) & 0xFFFF;
+        expected = base_cycles[opcode];
+        written++;
+    }
+
+    // Open the file and start writing into it, or stop, write what is left
+    // and close it. stop() is called on the thread running the CPU, or once
+    // it is done
+    bool start(const std::string &path);
+    void stop();
+
+    // Counts, for the thread running the CPU or after stop(), and the size of
+    // the file after stop()
+    uint64_t records() const { return written; }
+    uint64_t dropped() const { return lost; }
+    uint64_t bytes() const { return file_bytes; }
+
+private:
+    static constexpr uint32_t NO_PC = 0x10000;
+
+    uint32_t block_size;
+    uint64_t mask;
+    std::vector<uint8_t> buffer;
+    uint8_t *scratch;
+
+    // Per opcode: bytes, base cycles and which of the three bytes are its own
+    uint8_t lengths[256];
+    uint8_t base_cycles[256];
+    uint32_t code_mask[256];
+
+    // Producer side: the state the next record is encoded against
+    alignas(64) uint8_t *out = nullptr;
+    uint8_t *limit = nullptr;
+    uint8_t *block = nullptr;
+    uint64_t registers = 0; // A, X, Y, SP and P from the low byte up
+    uint32_t next_pc = NO_PC;
+    uint32_t expected = 0;
+    uint32_t last_clock = 0;
+    uint64_t written = 0;
+    uint32_t block_clock = 0; // Of the block's first record
+    uint64_t block_cycle = 0;
+    uint64_t lost = 0;
+    uint64_t blocks_filled = 0;
+    uint64_t tail_seen = 0;
+    // Per address, the bytes last recorded there in the top byte's generation,
+    // which moves on with every block so the table needs no clearing
+    std::vector<uint32_t> code;
+    uint32_t generation = 0;
+
+    // Shared: blocks handed over and blocks written
+    alignas(64) std::atomic<uint64_t> head{0};
+    alignas(64) std::atomic<uint64_t> tail{0};
+
+    // Consumer side
+    std::atomic<bool> running{false};
+    std::thread writer;
+    FILE *file = nullptr;
+    uint64_t file_bytes = 0;
+
+    uint32_t code_at(Bus &bus, uint32_t pc);
+    void next_block(uint32_t clock);
+    void close_block();
+    size_t drain();
+};
+
+// Reads the records of an instruction trace back, in order
+class InstructionTraceReader
+{
+public:
+    struct RECORD
+    {
+        uint64_t index; // Of the instruction since the trace started
+        uint64_t cycle;
+        uint16_t pc;
+        uint8_t bytes[3]; // Opcode and operands, zero past the instruction's length
+        uint8_t length;
+        uint8_t a, x, y, p, sp;
+    };
+
+    InstructionTraceReader();
+    ~InstructionTraceReader();
+    InstructionTraceReader(const InstructionTraceReader &) = delete;
+    InstructionTraceReader &operator=(const InstructionTraceReader &) = delete;
+
+    // Open a trace, checking its header
+    bool open(const std::string &path);
+    void close();
+
+    // The next record, false at the end of the file or at a damaged block
+    bool next(RECORD &record);
+
+    // Go to the record with an index, skipping the blocks before it unread.
+    // False if the trace ends before it
+    bool seek(uint64_t index);
+
+    // Set when reading stopped at a block that does not decode
+    bool damaged = false;
+
+    // Blocks read so far, and the bytes of their records
+    uint64_t blocks = 0;
+    uint64_t record_bytes = 0;
+
+private:
+    FILE *file = nullptr;
+    std::vector<uint8_t> data;
+    InstructionTrace::BLOCK block = {};
+    size_t at = 0;
+    uint32_t left = 0; // Records left in the block
+
+    uint8_t registers[5];
+    uint32_t next_pc;
+    uint32_t expected;
+    uint64_t cycle;
+    uint64_t index;
+    std::vector<uint32_t> code;
+
+    bool read_block();
+};
@@ -0,0 +1,560 @@
+#include "config.h"
+#include "Mapper.h"
+
+#include <algorithm>
+
+// Register behaviour: https://www.nesdev.org/wiki/Mapper
+
+Mapper::Mapper(const Cartridge &cart, Bus &bus) : cart(cart), bus(bus)
+{
+    mirror = cart.mirror;
+    if (cart.chr.empty())
+        chr_ram.assign(std::max<uint32_t>(cart.chr_ram_size, 0x2000), 0x00);
+    if (cart.prg_ram_size)
+    {
+        prg_ram.assign(std::max<uint32_t>(cart.prg_ram_size, 0x2000), 0x00);
+        bus.map_ram(0x6000, 0x2000, prg_ram.data());
+    }
+}
+
+Mapper::~Mapper()
+{
+    if (bus.mapper == this)
+        bus.mapper = nullptr;
+    bus.set_irq(IRQ_SOURCE, false);
+
+    // Back to the bus's own RAM, as at power on
+    bus.map_ram(0x6000, 0xA000, &bus.ram[0x6000]);
+}
+
+/**
+ * @brief Maps a PRG ROM bank into the CPU address space. Windows that already
+ * show the bank are left alone, so the code decoded from them stays valid
+ *
+ * @param addr first address of the window, $8000-$E000 in steps of 8KB
+ * @param size window and bank size, a multiple of 8KB
+ * @param bank bank number in banks of size bytes
+ */
+void Mapper::map_prg(uint16_t addr, uint32_t size, uint32_t bank)
+{
+    const uint8_t *data = cart.prg_bank(bank, size).data;
+    for (uint32_t offset = 0; offset < size && data; offset += 0x2000)
+    {
+        uint32_t window = (addr + offset - 0x8000) >> 13;
+        if (prg_windows[window] == data + offset)
+            continue;
+        prg_windows[window] = data + offset;
+        bus.map_rom((uint16_t)(addr + offset), 0x2000, data + offset);
+    }
+}
+
+/**
+ * @brief Maps a CHR ROM (or RAM) bank into the pattern tables
+ *
+ * @param addr first address of the window, a multiple of 1KB
+ * @param size window and bank size, a multiple of 1KB
+ * @param bank bank number in banks of size bytes
+ */
+void Mapper::map_chr(uint16_t addr, uint32_t size, uint32_t bank)
+{
+    const uint8_t *read;
+    uint8_t *write = nullptr;
+    if (chr_ram.empty())
+        read = cart.chr_bank(bank, size).data;
+    else
+        read = write = chr_ram.data() + (bank % std::max<size_t>(chr_ram.size() / size, 1)) * size;
+    if (!read)
+        return;
+
+    for (uint32_t offset = 0; offset < size; offset += 0x400)
+    {
+        chr_read[(addr + offset) >> 10] = read + offset;
+        chr_write[(addr + offset) >> 10] = write ? write + offset : nullptr;
+    }
+}
+
+/**
+ * @brief Saves what every mapper has: the mirroring and the PRG and CHR RAM.
+ * The mapper number goes first so a state can't be loaded into another one
+ */
+void Mapper::save_state(StateWriter &out) const
+{
+    out.u16(cart.mapper);
+    out.u8((uint8_t)mirror);
+    out.block(prg_ram.data(), (uint32_t)prg_ram.size());
+    out.block(chr_ram.data(), (uint32_t)chr_ram.size());
+}
+
+void Mapper::load_state(StateReader &in)
+{
+    uint16_t number = in.u16();
+    uint8_t mode = in.u8();
+    if (number != cart.mapper || mode > Cartridge::MIRROR_SINGLE_UPPER)
+    {
+        in.fail();
+        return;
+    }
+    mirror = (Cartridge::MIRROR)mode;
+    in.block(prg_ram.data(), (uint32_t)prg_ram.size());
+    in.block(chr_ram.data(), (uint32_t)chr_ram.size());
+}
+
+bool Mapper::check_state(StateReader in) const
+{
+    if (in.u16() != cart.mapper || in.u8() > Cartridge::MIRROR_SINGLE_UPPER)
+        return false;
+    in.block(nullptr, (uint32_t)prg_ram.size());
+    in.block(nullptr, (uint32_t)chr_ram.size());
+    return !in.failed();
+}
+
+/////////////////////////////////// NROM (0) ///////////////////////////////////
+
+// No registers: 16 or 32KB of PRG, 8KB of CHR
+class Nrom : public Mapper
+{
+public:
+    Nrom(const Cartridge &cart, Bus &bus) : Mapper(cart, bus)
+    {
+        map_prg(0x8000, 0x4000, 0);
+        map_prg(0xC000, 0x4000, prg_banks(0x4000) - 1);
+        map_chr(0x0000, 0x2000, 0);
+    }
+
+    void write(uint16_t, uint8_t) override {}
+};
+
+/////////////////////////////////// MMC1 (1) ///////////////////////////////////
+
+// Registers are written a bit at a time through a 5 bit shift register
+class Mmc1 : public Mapper
+{
+public:
+    Mmc1(const Cartridge &cart, Bus &bus) : Mapper(cart, bus) { update(); }
+
+    void write(uint16_t addr, uint8_t data) override
+    {
+        // The registers are only decoded at $8000-$FFFF, writes to $6000
+        // with PRG RAM disabled go nowhere
+        if (addr < 0x8000)
+            return;
+        if (data & 0x80)
+        {
+            shift = 0x10;
+            control |= 0x0C;
+            update();
+            return;
+        }
+
+        // The marker bit reaching bit 0 means this is the fifth write
+        bool full = shift & 0x01;
+        shift = (uint8_t)(shift >> 1 | (data & 0x01) << 4);
+        if (!full)
+            return;
+        switch ((addr >> 13) & 0x03)
+        {
+        case 0: control = shift; break;
+        case 1: chr0 = shift; break;
+        case 2: chr1 = shift; break;
+        case 3: prg = shift; break;
+        }
+        shift = 0x10;
+        update();
+    }
+
+    void save_state(StateWriter &out) const override
+    {
+        Mapper::save_state(out);
+        out.u8(shift);
+        out.u8(control);
+        out.u8(chr0);
+        out.u8(chr1);
+        out.u8(prg);
+    }
+
+    void load_state(StateReader &in) override
+    {
+        Mapper::load_state(in);
+        shift = in.u8();
+        control = in.u8();
+        chr0 = in.u8();
+        chr1 = in.u8();
+        prg = in.u8();
+        ram_disabled = 0xFF; // Neither state, so update() maps the PRG RAM either way
+        update();
+    }
+
+private:
+    uint8_t shift = 0x10;
+    uint8_t control = 0x0C;
+    uint8_t chr0 = 0, chr1 = 0, prg = 0;
+
+    void update()
+    {
+        static const Cartridge::MIRROR mirrors[] = {
+            Cartridge::MIRROR_SINGLE_LOWER, Cartridge::MIRROR_SINGLE_UPPER,
+            Cartridge::MIRROR_VERTICAL, Cartridge::MIRROR_HORIZONTAL};
+        mirror = mirrors[control & 0x03];
+
+        // 512KB boards (SUROM) select the 256KB half with a CHR register bit
+        uint32_t outer = cart.prg.size > 0x40000 ? (chr0 & 0x10) : 0;
+        uint32_t bank = outer | (prg & 0x0F);
+        switch ((control >> 2) & 0x03)
+        {
+        case 0:
+        case 1:
+            map_prg(0x8000, 0x8000, bank >> 1);
+            break;
+        case 2:
+            map_prg(0x8000, 0x4000, outer);
+            map_prg(0xC000, 0x4000, bank);
+            break;
+        case 3:
+            map_prg(0x8000, 0x4000, bank);
+            map_prg(0xC000, 0x4000, outer | 0x0F);
+            break;
+        }
+
+        if (control & 0x10)
+        {
+            map_chr(0x0000, 0x1000, chr0);
+            map_chr(0x1000, 0x1000, chr1);
+        }
+        else
+            map_chr(0x0000, 0x2000, chr0 >> 1);
+
+        // Bit 4 of the PRG register disables the PRG RAM
+        if (!prg_ram.empty() && (prg & 0x10) != ram_disabled)
+        {
+            ram_disabled = prg & 0x10;
+            if (ram_disabled)
+                bus.unmap(0x6000, 0x2000);
+            else
+                bus.map_ram(0x6000, 0x2000, prg_ram.data());
+        }
+    }
+    uint8_t ram_disabled = 0;
+};
+
+////////////////////////////////// UxROM (2) ///////////////////////////////////
+
+// A switchable 16KB bank at $8000, the last bank fixed at $C000
+class Uxrom : public Mapper
+{
+public:
+    Uxrom(const Cartridge &cart, Bus &bus) : Mapper(cart, bus)
+    {
+        map_prg(0x8000, 0x4000, 0);
+        map_prg(0xC000, 0x4000, prg_banks(0x4000) - 1);
+        map_chr(0x0000, 0x2000, 0);
+    }
+
+    void write(uint16_t addr, uint8_t data) override
+    {
+        if (addr < 0x8000)
+            return;
+        bank = data;
+        map_prg(0x8000, 0x4000, bank);
+    }
+
+    void save_state(StateWriter &out) const override
+    {
+        Mapper::save_state(out);
+        out.u8(bank);
+    }
+
+    void load_state(StateReader &in) override
+    {
+        Mapper::load_state(in);
+        bank = in.u8();
+        map_prg(0x8000, 0x4000, bank);
+    }
+
+private:
+    uint8_t bank = 0;
+};
+
+////////////////////////////////// CNROM (3) ///////////////////////////////////
+
+// Fixed PRG as NROM, a switchable 8KB CHR bank
+class Cnrom : public Nrom
+{
+public:
+    using Nrom::Nrom;
+
+    void write(uint16_t addr, uint8_t data) override
+    {
+        if (addr < 0x8000)
+            return;
+        bank = data;
+        map_chr(0x0000, 0x2000, bank);
+    }
+
+    void save_state(StateWriter &out) const override
+    {
+        Mapper::save_state(out);
+        out.u8(bank);
+    }
+
+    void load_state(StateReader &in) override
+    {
+        Mapper::load_state(in);
+        bank = in.u8();
+        map_chr(0x0000, 0x2000, bank);
+    }
+
+private:
+    uint8_t bank = 0;
+};
+
+/////////////////////////////////// MMC3 (4) ///////////////////////////////////
+
+// NTSC PPU timing, in PPU dots (3 per CPU cycle). With the PPU rendering,
+// A12 rises once per scanline at dot 260, when the sprite patterns are fetched
+// from $1000, on the visible lines 0-239 and the pre-render line 261. There is
+// no PPU to report the edges, so frames are taken to run back to back from
+// power on.
+static constexpr uint64_t DOTS_PER_LINE = 341;
+static constexpr uint64_t DOTS_PER_FRAME = 262 * DOTS_PER_LINE;
+static constexpr uint64_t A12_DOT = 260;
+static constexpr uint64_t A12_PER_FRAME = 241;
+
+// Number of A12 rises before dot
+static uint64_t a12_rises(uint64_t dot)
+{
+    uint64_t n = dot / DOTS_PER_FRAME * A12_PER_FRAME;
+    uint64_t in_frame = dot % DOTS_PER_FRAME;
+    if (in_frame > A12_DOT)
+        n += std::min<uint64_t>((in_frame - A12_DOT - 1) / DOTS_PER_LINE + 1, 240);
+    if (in_frame > 261 * DOTS_PER_LINE + A12_DOT)
+        n++;
+    return n;
+}
+
+// Dot of A12 rise number n
+static uint64_t a12_dot(uint64_t n)
+{
+    uint64_t line = n % A12_PER_FRAME;
+    return n / A12_PER_FRAME * DOTS_PER_FRAME + (line < 240 ? line : 261) * DOTS_PER_LINE + A12_DOT;
+}
+
+// 8KB PRG and 1 or 2KB CHR banks, and a scanline counter that raises an IRQ
+// when it reaches 0. Rather than clocking the counter, each register write
+// works out the rises since the last one and schedules a bus event at the
+// rise that will reach 0
+class Mmc3 : public Mapper, public BusEvent
+{
+public:
+    Mmc3(const Cartridge &cart, Bus &bus) : Mapper(cart, bus)
+    {
+        cycle_base = bus.cpu.clock_count;
+        update();
+    }
+
+    ~Mmc3() override { bus.cancel(this); }
+
+    void write(uint16_t addr, uint8_t data) override
+    {
+        switch (addr & 0xE001)
+        {
+        case 0x8000:
+            select = data;
+            update();
+            break;
+        case 0x8001:
+            regs[select & 0x07] = data;
+            update();
+            break;
+        case 0xA000:
+            if (cart.mirror != Cartridge::MIRROR_FOUR_SCREEN)
+                mirror = (data & 0x01) ? Cartridge::MIRROR_HORIZONTAL : Cartridge::MIRROR_VERTICAL;
+            break;
+        case 0xA001:
+            protect(data);
+            break;
+
+        // The counter registers take effect at the current cycle. During a
+        // run() slice that is its start: Bus::run steps instruction by
+        // instruction while the IRQ is pending, and the reload registers are
+        // written in vblank, where A12 does not rise
+        case 0xC000:
+            sync(bus.cpu.clock_count);
+            latch = data;
+            reschedule();
+            break;
+        case 0xC001:
+            sync(bus.cpu.clock_count);
+            counter = 0;
+            reload = true;
+            reschedule();
+            break;
+        case 0xE000:
+            sync(bus.cpu.clock_count);
+            enabled = false;
+            bus.set_irq(IRQ_SOURCE, false);
+            reschedule();
+            break;
+        case 0xE001:
+            sync(bus.cpu.clock_count);
+            enabled = true;
+            reschedule();
+            break;
+        }
+    }
+
+    void fire(uint32_t) override
+    {
+        sync(bus.cpu.clock_count);
+        reschedule();
+    }
+
+    void save_state(StateWriter &out) const override
+    {
+        Mapper::save_state(out);
+        out.u8(select);
+        for (uint8_t r : regs)
+            out.u8(r);
+        out.u8(ram_state);
+        out.u8(latch);
+        out.u8(counter);
+        out.u8(reload);
+        out.u8(enabled);
+        out.u64(rises);
+        out.u64(dot_base);
+        out.u32(cycle_base);
+    }
+
+    // The CPU is loaded first, so the IRQ is scheduled against its clock
+    void load_state(StateReader &in) override
+    {
+        Mapper::load_state(in);
+        select = in.u8();
+        for (uint8_t &r : regs)
+            r = in.u8();
+        uint8_t protection = in.u8();
+        latch = in.u8();
+        counter = in.u8();
+        reload = in.u8() != 0;
+        enabled = in.u8() != 0;
+        rises = in.u64();
+        dot_base = in.u64();
+        cycle_base = in.u32();
+
+        update();
+        ram_state = protection ^ 0x80; // Differs, so protect() maps the PRG RAM
+        protect(protection);
+        reschedule();
+    }
+
+private:
+    uint8_t select = 0;
+    std::array<uint8_t, 8> regs = {0, 2, 4, 5, 6, 7, 0, 1};
+    uint8_t ram_state = 0x80;
+
+    uint8_t latch = 0;
+    uint8_t counter = 0;
+    bool reload = false;
+    bool enabled = false;
+    uint64_t rises = 0;    // A12 rises the counter has seen
+    uint64_t dot_base = 0; // The dot at cycle_base
+    uint32_t cycle_base = 0;
+
+    void update()
+    {
+        uint32_t last = prg_banks(0x2000) - 1;
+        bool swap = select & 0x40;
+        map_prg(0x8000, 0x2000, swap ? last - 1 : regs[6] & 0x3F);
+        map_prg(0xA000, 0x2000, regs[7] & 0x3F);
+        map_prg(0xC000, 0x2000, swap ? regs[6] & 0x3F : last - 1);
+        map_prg(0xE000, 0x2000, last);
+
+        uint16_t invert = (select & 0x80) ? 0x1000 : 0x0000;
+        map_chr(invert, 0x0800, regs[0] >> 1);
+        map_chr(invert | 0x0800, 0x0800, regs[1] >> 1);
+        for (int i = 0; i < 4; i++)
+            map_chr((uint16_t)((invert ^ 0x1000) + i * 0x400), 0x0400, regs[2 + i]);
+    }
+
+    // Bit 7 enables the PRG RAM, bit 6 makes it read only
+    void protect(uint8_t data)
+    {
+        data &= 0xC0;
+        if (prg_ram.empty() || data == ram_state)
+            return;
+        ram_state = data;
+        if (!(data & 0x80))
+            bus.unmap(0x6000, 0x2000);
+        else if (data & 0x40)
+            bus.map_rom(0x6000, 0x2000, prg_ram.data());
+        else
+            bus.map_ram(0x6000, 0x2000, prg_ram.data());
+    }
+
+    // Applies the A12 rises up to cycle to the counter
+    void sync(uint32_t cycle)
+    {
+        int32_t elapsed = (int32_t)(cycle - cycle_base);
+        if (elapsed > 0)
+        {
+            dot_base += (uint64_t)elapsed * 3;
+            cycle_base = cycle;
+        }
+        uint64_t target = a12_rises(dot_base + 1);
+        while (rises < target)
+        {
+            if (counter == 0 || reload)
+            {
+                counter = latch;
+                reload = false;
+                rises++;
+            }
+            else
+            {
+                uint64_t n = std::min<uint64_t>(target - rises, counter);
+                counter = (uint8_t)(counter - n);
+                rises += n;
+            }
+            if (counter == 0 && enabled)
+                bus.set_irq(IRQ_SOURCE, true);
+        }
+    }
+
+    // Schedules the rise that takes the counter to 0
+    void reschedule()
+    {
+        bus.cancel(this);
+        if (!enabled)
+            return;
+        uint64_t n = (counter == 0 || reload) ? (uint64_t)latch + 1 : counter;
+        uint64_t dot = a12_dot(rises + n - 1);
+        bus.schedule(this, cycle_base + (uint32_t)((dot - dot_base + 2) / 3));
+    }
+};
+
+////////////////////////////////////////////////////////////////////////////////
+
+/**
+ * @brief Creates the mapper of a cartridge and connects it to the bus
+ *
+ * @param cart a loaded cartridge
+ * @param bus the bus to map it into
+ * @return std::unique_ptr<Mapper> the mapper, nullptr if it is not supported
+ */
+std::unique_ptr<Mapper> Mapper::create(const Cartridge &cart, Bus &bus)
+{
+    if (cart.prg.size < 0x4000)
+        return nullptr;
+
+    std::unique_ptr<Mapper> mapper;
+    switch (cart.mapper)
+    {
+    case 0: mapper.reset(new Nrom(cart, bus)); break;
+    case 1: mapper.reset(new Mmc1(cart, bus)); break;
+    case 2: mapper.reset(new Uxrom(cart, bus)); break;
+    case 3: mapper.reset(new Cnrom(cart, bus)); break;
+    case 4: mapper.reset(new Mmc3(cart, bus)); break;
+    default: return nullptr;
+    }
+    bus.mapper = mapper.get();
+    return mapper;
+}
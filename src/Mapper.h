@@ -0,0 +1,77 @@
+#pragma once
+#include "config.h"
+
+#include <array>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+#include "Bus.h"
+#include "Cartridge.h"
+#include "SaveState.h"
+
+// The bank switching hardware of a cartridge: NROM (0), MMC1 (1), UxROM (2),
+// CNROM (3) and MMC3 (4). A mapper maps its banks into the Bus with map_rom and
+// map_ram and is otherwise only involved when the CPU writes to ROM, which is
+// where its registers are. Switching a bank re-points the bus pages of its
+// window at another part of the cartridge; bank data is never copied.
+//
+// The PPU side is exposed the same way, as pointers to the 1KB windows of the
+// pattern tables, for a PPU to read from.
+class Mapper
+{
+public:
+    virtual ~Mapper();
+
+    // The mapper for a cartridge, connected to bus with its power on banks
+    // mapped, or nullptr if the cartridge's mapper is not supported. The
+    // cartridge has to outlive it
+    static std::unique_ptr<Mapper> create(const Cartridge &cart, Bus &bus);
+
+    // A CPU write to cartridge space ($4020-$FFFF) that hit ROM or nothing.
+    // Each mapper decodes only the addresses its registers are at
+    virtual void write(uint16_t addr, uint8_t data) = 0;
+
+    // The iNES mapper number
+    uint16_t number() const { return cart.mapper; }
+
+    // Save states: the registers, the PRG and CHR RAM. Loading maps the banks
+    // the registers select. Mappers call the base class before their own part
+    virtual void save_state(StateWriter &out) const;
+    virtual void load_state(StateReader &in);
+
+    // Whether in starts with a good base class part for this mapper: the
+    // number, a known mirroring and the PRG and CHR RAM. Nothing is changed
+    bool check_state(StateReader in) const;
+
+    // Pattern table windows: $0000-$1FFF in 1KB pages. chr_write is null for
+    // pages of CHR ROM
+    std::array<const uint8_t *, 8> chr_read = {};
+    std::array<uint8_t *, 8> chr_write = {};
+
+    Cartridge::MIRROR mirror = Cartridge::MIRROR_HORIZONTAL;
+
+    // The bit of the bus IRQ line mappers hold
+    static constexpr uint32_t IRQ_SOURCE = 0x01;
+
+protected:
+    Mapper(const Cartridge &cart, Bus &bus);
+
+    const Cartridge &cart;
+    Bus &bus;
+    std::vector<uint8_t> prg_ram; // At $6000-$7FFF
+    std::vector<uint8_t> chr_ram; // When the cartridge has no CHR ROM
+    std::array<const uint8_t *, 4> prg_windows = {}; // Mapped at $8000-$FFFF, per 8KB
+
+    // Point a window of size bytes at bank number bank, counted in banks of
+    // that size and wrapped around the ROM
+    void map_prg(uint16_t addr, uint32_t size, uint32_t bank);
+    void map_chr(uint16_t addr, uint32_t size, uint32_t bank);
+    uint32_t prg_banks(uint32_t size) const { return cart.prg.size / size; }
+};
+
+// A bus that owns the mapper of its cartridge, which goes before the bus does
+struct Machine : public Bus
+{
+    std::unique_ptr<Mapper> cartridge_mapper;
+};
@@ -0,0 +1,205 @@
+#include "config.h"
+#include "Profiler.h"
+
+#include <algorithm>
+
+Profiler::Profiler() : pc_instructions(64 * 1024), pc_cycles(64 * 1024)
+{
+    reset();
+}
+
+void Profiler::reset()
+{
+    std::fill(pc_instructions.begin(), pc_instructions.end(), 0);
+    std::fill(pc_cycles.begin(), pc_cycles.end(), 0);
+    nodes.assign(1, NODE{0, 0, 0});
+    stack_cycles.assign(1, 0);
+    children.clear();
+    node = 0;
+    frames = 0;
+    last_sp = NO_SP;
+}
+
+uint64_t Profiler::instructions() const
+{
+    uint64_t sum = 0;
+    for (uint64_t n : pc_instructions)
+        sum += n;
+    return sum;
+}
+
+uint64_t Profiler::cycles() const
+{
+    uint64_t sum = 0;
+    for (uint64_t n : stack_cycles)
+        sum += n;
+    return sum;
+}
+
+/**
+ * @brief SP moved, from before to after, in an instruction or between two.
+ * Enters the function at pc on a call or an interrupt, and returns from the
+ * functions whose return address is gone
+ *
+ * @param before SP before the move, NO_SP on the first instruction counted
+ * @param pc where the CPU goes on
+ */
+void Profiler::moved(uint32_t before, uint8_t after, uint16_t pc)
+{
+    if (before == NO_SP)
+    {
+        nodes[0].function = pc;
+        return;
+    }
+
+    uint8_t down = (uint8_t)(before - after);
+    if (down == 2 || down == 3)
+    {
+        // Too deep to be anything but a runaway stack: stay in the caller
+        if (frames == MAX_DEPTH)
+            return;
+        uint64_t key = (uint64_t)node << 16 | pc;
+        auto child = children.find(key);
+        if (child == children.end())
+        {
+            child = children.emplace(key, (uint32_t)nodes.size()).first;
+            nodes.push_back(NODE{node, pc, 0});
+            stack_cycles.push_back(0);
+        }
+        entry_sp[frames++] = (uint8_t)before;
+        node = child->second;
+        nodes[node].calls++;
+        return;
+    }
+
+    while (frames > 0 && after >= entry_sp[frames - 1])
+    {
+        frames--;
+        node = nodes[node].parent;
+    }
+}
+
+std::vector<Profiler::SPOT> Profiler::hot_spots(uint32_t count) const
+{
+    std::vector<SPOT> spots;
+    for (uint32_t pc = 0; pc < 0x10000; pc++)
+        if (pc_instructions[pc] > 0)
+            spots.push_back(SPOT{(uint16_t)pc, pc_instructions[pc], pc_cycles[pc]});
+
+    auto hotter = [](const SPOT &a, const SPOT &b) {
+        return a.cycles != b.cycles ? a.cycles > b.cycles : a.pc < b.pc;
+    };
+    count = std::min<uint32_t>(count, (uint32_t)spots.size());
+    std::partial_sort(spots.begin(), spots.begin() + count, spots.end(), hotter);
+    spots.resize(count);
+    return spots;
+}
+
+/**
+ * @brief Adds up the call stacks by the function they entered last. A
+ * function's total counts each stack once, however many times the function
+ * is on it, so recursion is not counted twice
+ */
+std::vector<Profiler::FUNCTION> Profiler::functions() const
+{
+    std::vector<FUNCTION> sums;
+    std::vector<int32_t> index(64 * 1024, -1);
+    auto of = [&](uint16_t addr) -> FUNCTION & {
+        if (index[addr] < 0)
+        {
+            index[addr] = (int32_t)sums.size();
+            sums.push_back(FUNCTION{addr, 0, 0, 0});
+        }
+        return sums[index[addr]];
+    };
+
+    std::vector<uint32_t> seen(64 * 1024, ~0u);
+    for (uint32_t n = 0; n < nodes.size(); n++)
+    {
+        FUNCTION &f = of(nodes[n].function);
+        f.calls += nodes[n].calls;
+        f.self += stack_cycles[n];
+        for (uint32_t up = n;; up = nodes[up].parent)
+        {
+            uint16_t addr = nodes[up].function;
+            if (seen[addr] != n)
+            {
+                seen[addr] = n;
+                of(addr).total += stack_cycles[n];
+            }
+            if (up == 0)
+                break;
+        }
+    }
+
+    std::sort(sums.begin(), sums.end(), [](const FUNCTION &a, const FUNCTION &b) {
+        return a.self != b.self ? a.self > b.self : a.addr < b.addr;
+    });
+    return sums;
+}
+
+void Profiler::name(uint16_t addr, const DisassemblySymbols *symbols, char *out, size_t size) const
+{
+    const char *symbol = symbols ? symbols->name(addr) : nullptr;
+    if (symbol)
+        snprintf(out, size, "%s", symbol);
+    else
+        snprintf(out, size, "$%04X", addr);
+}
+
+void Profiler::write_report(FILE *file, const Bus &bus, uint32_t count, const DisassemblySymbols *symbols) const
+{
+    uint64_t all = std::max<uint64_t>(cycles(), 1);
+    fprintf(file, "%llu instructions, %llu cycles, %u call stacks\n\n", (unsigned long long)instructions(),
+            (unsigned long long)cycles(), stacks());
+
+    fprintf(file, "%-4s %12s %6s %12s %6s  %s\n", "rank", "cycles", "%", "instructions", "cyc/in", "instruction");
+    uint32_t rank = 1;
+    for (const SPOT &s : hot_spots(count))
+    {
+        uint8_t bytes[3];
+        char text[R6502::LINE_SIZE];
+        bus.peek_range(s.pc, 3, bytes);
+        R6502::format_instruction(s.pc, bytes, text, sizeof(text), symbols);
+        fprintf(file, "%4u %12llu %6.2f %12llu %6.2f  %s\n", rank++, (unsigned long long)s.cycles,
+                100.0 * s.cycles / all, (unsigned long long)s.instructions, (double)s.cycles / s.instructions, text);
+    }
+
+    fprintf(file, "\n%-4s %-24s %10s %12s %6s %12s %6s\n", "rank", "function", "calls", "self", "%", "total",
+            "%");
+    rank = 1;
+    for (const FUNCTION &f : functions())
+    {
+        if (rank > count)
+            break;
+        char text[64];
+        name(f.addr, symbols, text, sizeof(text));
+        fprintf(file, "%4u %-24s %10llu %12llu %6.2f %12llu %6.2f\n", rank++, text, (unsigned long long)f.calls,
+                (unsigned long long)f.self, 100.0 * f.self / all, (unsigned long long)f.total,
+                100.0 * f.total / all);
+    }
+}
+
+void Profiler::write_folded(FILE *file, const DisassemblySymbols *symbols) const
+{
+    std::vector<uint32_t> path;
+    char text[64];
+    for (uint32_t n = 0; n < nodes.size(); n++)
+    {
+        if (stack_cycles[n] == 0)
+            continue;
+        path.clear();
+        for (uint32_t up = n;; up = nodes[up].parent)
+        {
+            path.push_back(up);
+            if (up == 0)
+                break;
+        }
+        for (size_t i = path.size(); i-- > 0;)
+        {
+            name(nodes[path[i]].function, symbols, text, sizeof(text));
+            fprintf(file, "%s%s", text, i > 0 ? ";" : "");
+        }
+        fprintf(file, " %llu\n", (unsigned long long)stack_cycles[n]);
+    }
+}
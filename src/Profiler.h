@@ -0,0 +1,119 @@
+#pragma once
+#include "config.h"
+
+#include <cstdint>
+#include <cstdio>
+#include <unordered_map>
+#include <vector>
+
+#include "Bus.h"
+
+// Guest cycle profiler. Attached to Bus::profiler, it counts the instructions
+// and cycles of every address the CPU executes, and the cycles spent under
+// every call stack. run() then goes through R6502::run_checked, as it does
+// for InstructionTrace; detached it costs nothing. The counts are flat arrays
+// indexed by PC and by call stack, a handful of adds per instruction, so it
+// can stay on for long runs.
+//
+// Calls are followed from the stack pointer, without decoding anything: an
+// instruction that moves SP down by 2 is a JSR and by 3 a BRK, and SP down by
+// 3 between two instructions is an interrupt. Each enters a function at the
+// new PC. A function returns once SP is back where it was when it was
+// entered, by RTS, RTI or any other way of dropping its return address.
+// Cycles of the interrupt sequences themselves happen outside instructions
+// and are not counted.
+class Profiler
+{
+public:
+    // An address, from hot_spots()
+    struct SPOT
+    {
+        uint16_t pc;
+        uint64_t instructions;
+        uint64_t cycles;
+    };
+
+    // A function, by the address it was entered at, from functions(). The
+    // cycles of the instructions run in it, and in it and what it called
+    struct FUNCTION
+    {
+        uint16_t addr;
+        uint64_t calls;
+        uint64_t self;
+        uint64_t total;
+    };
+
+    Profiler();
+
+    // Count the instruction at pc, which started with SP at sp and took cycles,
+    // cpu being in the state after it
+    inline void instruction(uint16_t pc, uint8_t sp, uint32_t cycles, const R6502 &cpu)
+    {
+        if (sp != last_sp)
+            moved(last_sp, sp, pc);
+        pc_instructions[pc]++;
+        pc_cycles[pc] += cycles;
+        stack_cycles[node] += cycles;
+        if (cpu.stkp != sp)
+            moved(sp, cpu.stkp, cpu.pc);
+        last_sp = cpu.stkp;
+    }
+
+    // Forget everything counted. The next instruction is the root of the call
+    // stacks
+    void reset();
+
+    // Totals of everything counted
+    uint64_t instructions() const;
+    uint64_t cycles() const;
+
+    // Call stacks seen, and how deep the current one is
+    uint32_t stacks() const { return (uint32_t)nodes.size(); }
+    uint32_t depth() const { return frames; }
+
+    // Up to count addresses that took the most cycles, the most first
+    std::vector<SPOT> hot_spots(uint32_t count) const;
+
+    // Every function entered, the root included, by self cycles, most first
+    std::vector<FUNCTION> functions() const;
+
+    // The hot spots and functions as a text report, with the instruction at
+    // each hot spot as bus reads it now. Names come from symbols when given
+    void write_report(FILE *file, const Bus &bus, uint32_t count,
+                      const DisassemblySymbols *symbols = nullptr) const;
+
+    // One line per call stack that ran instructions, in the folded format of
+    // flame graph tools: the functions from the root separated by ';', then a
+    // space and the cycles spent in the last one
+    void write_folded(FILE *file, const DisassemblySymbols *symbols = nullptr) const;
+
+private:
+    static constexpr uint32_t NO_SP = 0x100;
+    static constexpr uint32_t MAX_DEPTH = 256;
+
+    std::vector<uint64_t> pc_instructions;
+    std::vector<uint64_t> pc_cycles;
+
+    // A node per call stack: the function it entered last and the stack it
+    // was called from. Its cycles are kept apart, as the only per instruction
+    // field
+    struct NODE
+    {
+        uint32_t parent;
+        uint16_t function;
+        uint64_t calls;
+    };
+    std::vector<NODE> nodes;
+    std::vector<uint64_t> stack_cycles;
+    std::unordered_map<uint64_t, uint32_t> children; // (parent << 16 | function) to node
+
+    // The current call stack: its node, and the SP each function was entered
+    // with (returning brings SP back to it)
+    uint32_t node = 0;
+    uint32_t frames = 0;
+    uint8_t entry_sp[MAX_DEPTH];
+    uint32_t last_sp = NO_SP;
+
+    void moved(uint32_t before, uint8_t after, uint16_t pc);
+    void name(uint16_t addr, const DisassemblySymbols *symbols, char *out, size_t size) const;
+};
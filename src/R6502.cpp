@@ -2,32 +2,36 @@
 
 #include "Bus.h"
 #include "R6502.h"
+#include "Breakpoints.h"
+#include "InstructionTrace.h"
+#include "Profiler.h"
+
+#include <cstring>
+
+// The 6502 translation table, assembled at compile time
+#define R6502_LOOKUP_ENTRY(code, name, op, mode, cyc) \
+    { (uint8_t)R6502::OPERATION::op, R6502::can_cross_page(R6502::OPERATION::op, R6502::ADDRMODE::mode), (uint8_t)R6502::ADDRMODE::mode, cyc },
+constexpr R6502::INSTRUCTION R6502::lookup[256] = { R6502_OPCODE_TABLE(R6502_LOOKUP_ENTRY) };
+#undef R6502_LOOKUP_ENTRY
+
+#define R6502_MNEMONIC_ENTRY(code, name, op, mode, cyc) name,
+constexpr char R6502::mnemonic[256][4] = { R6502_OPCODE_TABLE(R6502_MNEMONIC_ENTRY) };
+#undef R6502_MNEMONIC_ENTRY
+
+static_assert(sizeof(R6502::INSTRUCTION) == 2, "opcode table entries should stay packed");
+
+// Implementations of the addressing modes and operations, indexed by their ids
+#define R6502_MEMBER_ENTRY(name) &R6502::name,
+static constexpr uint8_t (R6502::*addrmode_impl[])(void) = { R6502_ADDRMODE_LIST(R6502_MEMBER_ENTRY) };
+static constexpr uint8_t (R6502::*operate_impl[])(void) = { R6502_OPERATION_LIST(R6502_MEMBER_ENTRY) };
+#undef R6502_MEMBER_ENTRY
 
 /**
- * @brief Construct a new R6502::R6502 object
+ * @brief Construct a new R6502::R6502 object. The translation table is static
+ * and built at compile time, so there is nothing to assemble here
  */
 R6502::R6502()
 {
-    // Assembles the 6502 translation table 
-    using a = R6502;
-	lookup = {
-		{ "BRK", &a::BRK, &a::IMM, 7 },{ "ORA", &a::ORA, &a::IZX, 6 },{ "???", &a::XXX, &a::IMP, 2 },{ "???", &a::XXX, &a::IMP, 8 },{ "???", &a::NOP, &a::IMP, 3 },{ "ORA", &a::ORA, &a::ZP0, 3 },{ "ASL", &a::ASL, &a::ZP0, 5 },{ "???", &a::XXX, &a::IMP, 5 },{ "PHP", &a::PHP, &a::IMP, 3 },{ "ORA", &a::ORA, &a::IMM, 2 },{ "ASL", &a::ASL, &a::IMP, 2 },{ "???", &a::XXX, &a::IMP, 2 },{ "???", &a::NOP, &a::IMP, 4 },{ "ORA", &a::ORA, &a::ABS, 4 },{ "ASL", &a::ASL, &a::ABS, 6 },{ "???", &a::XXX, &a::IMP, 6 },
-		{ "BPL", &a::BPL, &a::REL, 2 },{ "ORA", &a::ORA, &a::IZY, 5 },{ "???", &a::XXX, &a::IMP, 2 },{ "???", &a::XXX, &a::IMP, 8 },{ "???", &a::NOP, &a::IMP, 4 },{ "ORA", &a::ORA, &a::ZPX, 4 },{ "ASL", &a::ASL, &a::ZPX, 6 },{ "???", &a::XXX, &a::IMP, 6 },{ "CLC", &a::CLC, &a::IMP, 2 },{ "ORA", &a::ORA, &a::ABY, 4 },{ "???", &a::NOP, &a::IMP, 2 },{ "???", &a::XXX, &a::IMP, 7 },{ "???", &a::NOP, &a::IMP, 4 },{ "ORA", &a::ORA, &a::ABX, 4 },{ "ASL", &a::ASL, &a::ABX, 7 },{ "???", &a::XXX, &a::IMP, 7 },
-		{ "JSR", &a::JSR, &a::ABS, 6 },{ "AND", &a::AND, &a::IZX, 6 },{ "???", &a::XXX, &a::IMP, 2 },{ "???", &a::XXX, &a::IMP, 8 },{ "BIT", &a::BIT, &a::ZP0, 3 },{ "AND", &a::AND, &a::ZP0, 3 },{ "ROL", &a::ROL, &a::ZP0, 5 },{ "???", &a::XXX, &a::IMP, 5 },{ "PLP", &a::PLP, &a::IMP, 4 },{ "AND", &a::AND, &a::IMM, 2 },{ "ROL", &a::ROL, &a::IMP, 2 },{ "???", &a::XXX, &a::IMP, 2 },{ "BIT", &a::BIT, &a::ABS, 4 },{ "AND", &a::AND, &a::ABS, 4 },{ "ROL", &a::ROL, &a::ABS, 6 },{ "???", &a::XXX, &a::IMP, 6 },
-		{ "BMI", &a::BMI, &a::REL, 2 },{ "AND", &a::AND, &a::IZY, 5 },{ "???", &a::XXX, &a::IMP, 2 },{ "???", &a::XXX, &a::IMP, 8 },{ "???", &a::NOP, &a::IMP, 4 },{ "AND", &a::AND, &a::ZPX, 4 },{ "ROL", &a::ROL, &a::ZPX, 6 },{ "???", &a::XXX, &a::IMP, 6 },{ "SEC", &a::SEC, &a::IMP, 2 },{ "AND", &a::AND, &a::ABY, 4 },{ "???", &a::NOP, &a::IMP, 2 },{ "???", &a::XXX, &a::IMP, 7 },{ "???", &a::NOP, &a::IMP, 4 },{ "AND", &a::AND, &a::ABX, 4 },{ "ROL", &a::ROL, &a::ABX, 7 },{ "???", &a::XXX, &a::IMP, 7 },
-		{ "RTI", &a::RTI, &a::IMP, 6 },{ "EOR", &a::EOR, &a::IZX, 6 },{ "???", &a::XXX, &a::IMP, 2 },{ "???", &a::XXX, &a::IMP, 8 },{ "???", &a::NOP, &a::IMP, 3 },{ "EOR", &a::EOR, &a::ZP0, 3 },{ "LSR", &a::LSR, &a::ZP0, 5 },{ "???", &a::XXX, &a::IMP, 5 },{ "PHA", &a::PHA, &a::IMP, 3 },{ "EOR", &a::EOR, &a::IMM, 2 },{ "LSR", &a::LSR, &a::IMP, 2 },{ "???", &a::XXX, &a::IMP, 2 },{ "JMP", &a::JMP, &a::ABS, 3 },{ "EOR", &a::EOR, &a::ABS, 4 },{ "LSR", &a::LSR, &a::ABS, 6 },{ "???", &a::XXX, &a::IMP, 6 },
-		{ "BVC", &a::BVC, &a::REL, 2 },{ "EOR", &a::EOR, &a::IZY, 5 },{ "???", &a::XXX, &a::IMP, 2 },{ "???", &a::XXX, &a::IMP, 8 },{ "???", &a::NOP, &a::IMP, 4 },{ "EOR", &a::EOR, &a::ZPX, 4 },{ "LSR", &a::LSR, &a::ZPX, 6 },{ "???", &a::XXX, &a::IMP, 6 },{ "CLI", &a::CLI, &a::IMP, 2 },{ "EOR", &a::EOR, &a::ABY, 4 },{ "???", &a::NOP, &a::IMP, 2 },{ "???", &a::XXX, &a::IMP, 7 },{ "???", &a::NOP, &a::IMP, 4 },{ "EOR", &a::EOR, &a::ABX, 4 },{ "LSR", &a::LSR, &a::ABX, 7 },{ "???", &a::XXX, &a::IMP, 7 },
-		{ "RTS", &a::RTS, &a::IMP, 6 },{ "ADC", &a::ADC, &a::IZX, 6 },{ "???", &a::XXX, &a::IMP, 2 },{ "???", &a::XXX, &a::IMP, 8 },{ "???", &a::NOP, &a::IMP, 3 },{ "ADC", &a::ADC, &a::ZP0, 3 },{ "ROR", &a::ROR, &a::ZP0, 5 },{ "???", &a::XXX, &a::IMP, 5 },{ "PLA", &a::PLA, &a::IMP, 4 },{ "ADC", &a::ADC, &a::IMM, 2 },{ "ROR", &a::ROR, &a::IMP, 2 },{ "???", &a::XXX, &a::IMP, 2 },{ "JMP", &a::JMP, &a::IND, 5 },{ "ADC", &a::ADC, &a::ABS, 4 },{ "ROR", &a::ROR, &a::ABS, 6 },{ "???", &a::XXX, &a::IMP, 6 },
-		{ "BVS", &a::BVS, &a::REL, 2 },{ "ADC", &a::ADC, &a::IZY, 5 },{ "???", &a::XXX, &a::IMP, 2 },{ "???", &a::XXX, &a::IMP, 8 },{ "???", &a::NOP, &a::IMP, 4 },{ "ADC", &a::ADC, &a::ZPX, 4 },{ "ROR", &a::ROR, &a::ZPX, 6 },{ "???", &a::XXX, &a::IMP, 6 },{ "SEI", &a::SEI, &a::IMP, 2 },{ "ADC", &a::ADC, &a::ABY, 4 },{ "???", &a::NOP, &a::IMP, 2 },{ "???", &a::XXX, &a::IMP, 7 },{ "???", &a::NOP, &a::IMP, 4 },{ "ADC", &a::ADC, &a::ABX, 4 },{ "ROR", &a::ROR, &a::ABX, 7 },{ "???", &a::XXX, &a::IMP, 7 },
-		{ "???", &a::NOP, &a::IMP, 2 },{ "STA", &a::STA, &a::IZX, 6 },{ "???", &a::NOP, &a::IMP, 2 },{ "???", &a::XXX, &a::IMP, 6 },{ "STY", &a::STY, &a::ZP0, 3 },{ "STA", &a::STA, &a::ZP0, 3 },{ "STX", &a::STX, &a::ZP0, 3 },{ "???", &a::XXX, &a::IMP, 3 },{ "DEY", &a::DEY, &a::IMP, 2 },{ "???", &a::NOP, &a::IMP, 2 },{ "TXA", &a::TXA, &a::IMP, 2 },{ "???", &a::XXX, &a::IMP, 2 },{ "STY", &a::STY, &a::ABS, 4 },{ "STA", &a::STA, &a::ABS, 4 },{ "STX", &a::STX, &a::ABS, 4 },{ "???", &a::XXX, &a::IMP, 4 },
-		{ "BCC", &a::BCC, &a::REL, 2 },{ "STA", &a::STA, &a::IZY, 6 },{ "???", &a::XXX, &a::IMP, 2 },{ "???", &a::XXX, &a::IMP, 6 },{ "STY", &a::STY, &a::ZPX, 4 },{ "STA", &a::STA, &a::ZPX, 4 },{ "STX", &a::STX, &a::ZPY, 4 },{ "???", &a::XXX, &a::IMP, 4 },{ "TYA", &a::TYA, &a::IMP, 2 },{ "STA", &a::STA, &a::ABY, 5 },{ "TXS", &a::TXS, &a::IMP, 2 },{ "???", &a::XXX, &a::IMP, 5 },{ "???", &a::NOP, &a::IMP, 5 },{ "STA", &a::STA, &a::ABX, 5 },{ "???", &a::XXX, &a::IMP, 5 },{ "???", &a::XXX, &a::IMP, 5 },
-		{ "LDY", &a::LDY, &a::IMM, 2 },{ "LDA", &a::LDA, &a::IZX, 6 },{ "LDX", &a::LDX, &a::IMM, 2 },{ "???", &a::XXX, &a::IMP, 6 },{ "LDY", &a::LDY, &a::ZP0, 3 },{ "LDA", &a::LDA, &a::ZP0, 3 },{ "LDX", &a::LDX, &a::ZP0, 3 },{ "???", &a::XXX, &a::IMP, 3 },{ "TAY", &a::TAY, &a::IMP, 2 },{ "LDA", &a::LDA, &a::IMM, 2 },{ "TAX", &a::TAX, &a::IMP, 2 },{ "???", &a::XXX, &a::IMP, 2 },{ "LDY", &a::LDY, &a::ABS, 4 },{ "LDA", &a::LDA, &a::ABS, 4 },{ "LDX", &a::LDX, &a::ABS, 4 },{ "???", &a::XXX, &a::IMP, 4 },
-		{ "BCS", &a::BCS, &a::REL, 2 },{ "LDA", &a::LDA, &a::IZY, 5 },{ "???", &a::XXX, &a::IMP, 2 },{ "???", &a::XXX, &a::IMP, 5 },{ "LDY", &a::LDY, &a::ZPX, 4 },{ "LDA", &a::LDA, &a::ZPX, 4 },{ "LDX", &a::LDX, &a::ZPY, 4 },{ "???", &a::XXX, &a::IMP, 4 },{ "CLV", &a::CLV, &a::IMP, 2 },{ "LDA", &a::LDA, &a::ABY, 4 },{ "TSX", &a::TSX, &a::IMP, 2 },{ "???", &a::XXX, &a::IMP, 4 },{ "LDY", &a::LDY, &a::ABX, 4 },{ "LDA", &a::LDA, &a::ABX, 4 },{ "LDX", &a::LDX, &a::ABY, 4 },{ "???", &a::XXX, &a::IMP, 4 },
-		{ "CPY", &a::CPY, &a::IMM, 2 },{ "CMP", &a::CMP, &a::IZX, 6 },{ "???", &a::NOP, &a::IMP, 2 },{ "???", &a::XXX, &a::IMP, 8 },{ "CPY", &a::CPY, &a::ZP0, 3 },{ "CMP", &a::CMP, &a::ZP0, 3 },{ "DEC", &a::DEC, &a::ZP0, 5 },{ "???", &a::XXX, &a::IMP, 5 },{ "INY", &a::INY, &a::IMP, 2 },{ "CMP", &a::CMP, &a::IMM, 2 },{ "DEX", &a::DEX, &a::IMP, 2 },{ "???", &a::XXX, &a::IMP, 2 },{ "CPY", &a::CPY, &a::ABS, 4 },{ "CMP", &a::CMP, &a::ABS, 4 },{ "DEC", &a::DEC, &a::ABS, 6 },{ "???", &a::XXX, &a::IMP, 6 },
-		{ "BNE", &a::BNE, &a::REL, 2 },{ "CMP", &a::CMP, &a::IZY, 5 },{ "???", &a::XXX, &a::IMP, 2 },{ "???", &a::XXX, &a::IMP, 8 },{ "???", &a::NOP, &a::IMP, 4 },{ "CMP", &a::CMP, &a::ZPX, 4 },{ "DEC", &a::DEC, &a::ZPX, 6 },{ "???", &a::XXX, &a::IMP, 6 },{ "CLD", &a::CLD, &a::IMP, 2 },{ "CMP", &a::CMP, &a::ABY, 4 },{ "NOP", &a::NOP, &a::IMP, 2 },{ "???", &a::XXX, &a::IMP, 7 },{ "???", &a::NOP, &a::IMP, 4 },{ "CMP", &a::CMP, &a::ABX, 4 },{ "DEC", &a::DEC, &a::ABX, 7 },{ "???", &a::XXX, &a::IMP, 7 },
-		{ "CPX", &a::CPX, &a::IMM, 2 },{ "SBC", &a::SBC, &a::IZX, 6 },{ "???", &a::NOP, &a::IMP, 2 },{ "???", &a::XXX, &a::IMP, 8 },{ "CPX", &a::CPX, &a::ZP0, 3 },{ "SBC", &a::SBC, &a::ZP0, 3 },{ "INC", &a::INC, &a::ZP0, 5 },{ "???", &a::XXX, &a::IMP, 5 },{ "INX", &a::INX, &a::IMP, 2 },{ "SBC", &a::SBC, &a::IMM, 2 },{ "NOP", &a::NOP, &a::IMP, 2 },{ "???", &a::SBC, &a::IMP, 2 },{ "CPX", &a::CPX, &a::ABS, 4 },{ "SBC", &a::SBC, &a::ABS, 4 },{ "INC", &a::INC, &a::ABS, 6 },{ "???", &a::XXX, &a::IMP, 6 },
-		{ "BEQ", &a::BEQ, &a::REL, 2 },{ "SBC", &a::SBC, &a::IZY, 5 },{ "???", &a::XXX, &a::IMP, 2 },{ "???", &a::XXX, &a::IMP, 8 },{ "???", &a::NOP, &a::IMP, 4 },{ "SBC", &a::SBC, &a::ZPX, 4 },{ "INC", &a::INC, &a::ZPX, 6 },{ "???", &a::XXX, &a::IMP, 6 },{ "SED", &a::SED, &a::IMP, 2 },{ "SBC", &a::SBC, &a::ABY, 4 },{ "NOP", &a::NOP, &a::IMP, 2 },{ "???", &a::XXX, &a::IMP, 7 },{ "???", &a::NOP, &a::IMP, 4 },{ "SBC", &a::SBC, &a::ABX, 4 },{ "INC", &a::INC, &a::ABX, 7 },{ "???", &a::XXX, &a::IMP, 7 },
-	};
 }
 
 /**
@@ -35,6 +39,7 @@ R6502::R6502()
  */
 R6502::~R6502()
 {
+    release_jit();
 }
 
 
@@ -73,7 +78,15 @@ void R6502::write(uint16_t addr, uint8_t data)
  */
 uint8_t R6502::GetFlag(FLAGS6502 f)
 {
-    return ((status & f) > 0) ? 1 : 0;
+    switch (f)
+    {
+    case C: return status.c;
+    case Z: return status.zero();
+    case V: return status.v;
+    case N: return status.negative();
+    case U: return 1;
+    default: return ((status.other & f) > 0) ? 1 : 0;
+    }
 }
 
 /**
@@ -84,10 +97,22 @@ uint8_t R6502::GetFlag(FLAGS6502 f)
  */
 void R6502::SetFlag(FLAGS6502 f, bool v)
 {
-    if (v)
-        status |= f;
-    else
-        status &= ~f;
+    // N, Z, C and V are single stores into the lazy form and U always reads
+    // as 1, see R6502::STATUS
+    switch (f)
+    {
+    case C: status.c = v; break;
+    case Z: status.set_nz(status.negative(), v); break;
+    case V: status.v = v; break;
+    case N: status.set_nz(v, status.zero()); break;
+    case U: break;
+    default:
+        if (v)
+            status.other |= f;
+        else
+            status.other &= ~f;
+        break;
+    }
 }
 
 
@@ -102,36 +127,157 @@ void R6502::clock()
     // the entire clock computation is performed in one go.
     if (cycles == 0)
     {
-        opcode = read(pc);
+        if (bus->instruction_trace)
+            bus->instruction_trace->record(*bus, clock_count);
 
-    #ifdef LOG_MODE
-        uint16_t log_pc = pc;
+    #ifdef R6502_TRACE
+        if (bus->trace)
+            bus->trace->cycle = clock_count;
     #endif
 
-        // set the unused status flag bit to 1
-        SetFlag(U, 1);
+        // The CACHED engine only pays off over runs of instructions, single
+        // instructions go through the plain interpreter
+        uint16_t start_pc = pc;
+        uint8_t start_sp = stkp;
+        cycles = (engine == LOOKUP) ? execute_lookup() : execute();
+        instruction_count++;
+        if (bus->profiler)
+            bus->profiler->instruction(start_pc, start_sp, cycles, *this);
+    }
 
-        // Increment the program counter
-        pc++;
+    // Increment global clock count
+    clock_count++;
 
-        // get starting number of clock cycles
-        cycles = lookup[opcode].cycles;
+    // Decrement number of cycles remaining
+    cycles--;
+}
 
-        uint8_t add_cycle1 = (this->*lookup[opcode].addrmode)();
-        uint8_t add_cycle2 = (this->*lookup[opcode].operate)();
+/**
+ * @brief Executes whole instructions until at least "budget" clock cycles have
+ * been used. Cycles still outstanding from the current instruction (or from a
+ * reset or interrupt) are charged first. Instead of being ticked off one clock()
+ * call at a time, the cycles of each instruction are added to clock_count in bulk,
+ * so on return the CPU is always on an instruction boundary.
+ * 
+ * @param budget number of clock cycles to run for
+ * @return uint32_t number of cycles used, which can exceed the budget by up to
+ * the length of the last instruction
+ */
+uint32_t R6502::run(uint32_t budget)
+{
+    uint32_t used = cycles;
+    cycles = 0;
 
-        cycles += (add_cycle1 & add_cycle2);
+#ifdef R6502_TRACE
+    bool traced = bus->trace != nullptr;
+#else
+    constexpr bool traced = false;
+#endif
 
-        SetFlag(U, 1);
+    if (used < budget)
+    {
+        // CACHED and JIT do not fetch their instructions through the bus, so a
+        // cycle exact build, or a traced bus, runs them as SWITCH. Armed
+        // breakpoints, instruction tracing and profiling send every engine
+        // through the checks of run_checked
+        if ((bus->breakpoints && bus->breakpoints->armed()) || bus->instruction_trace || bus->profiler)
+            used += run_checked(budget - used, clock_count + used);
+        else if (engine == SWITCH || ((ACCURACY::cycle_exact || traced) && engine != LOOKUP))
+            used += run_switch(budget - used);
+        else if (engine == CACHED)
+            used += run_cached(budget - used);
+        else if (engine == JIT)
+            used += run_jit(budget - used);
+        else
+        {
+            while (used < budget)
+            {
+            #ifdef R6502_TRACE
+                if (traced)
+                    bus->trace->cycle = clock_count + used;
+            #endif
+                used += execute_lookup();
+                instruction_count++;
+            }
+            cycles = 0;
+        }
+    }
 
+    clock_count += used;
+    return used;
+}
 
-    }
+/**
+ * @brief Completes the current instruction. If the CPU is already on an
+ * instruction boundary the next instruction is executed as a whole.
+ * This is the instruction granular equivalent of calling clock() until complete()
+ * 
+ * @return uint8_t number of clock cycles used
+ */
+uint8_t R6502::step_instruction()
+{
+    if (cycles != 0)
+        return (uint8_t)run(0);
+    return (uint8_t)run(1);
+}
 
-    // Increment global clock count
-    clock_count++;
+/**
+ * @brief Decodes and executes the instruction at pc through the opcode
+ * translation table (the LOOKUP engine)
+ * 
+ * @return uint8_t number of clock cycles the instruction takes
+ */
+uint8_t R6502::execute_lookup()
+{
+    opcode = bus->fetch(pc);
 
-    // Decrement number of cycles remaining
-    cycles--;
+    // set the unused status flag bit to 1
+    SetFlag(U, 1);
+
+    // Increment the program counter
+    pc++;
+
+    // get starting number of clock cycles
+    cycles = lookup[opcode].cycles;
+
+    uint8_t add_cycle1 = (this->*addrmode_impl[lookup[opcode].addrmode])();
+    uint8_t add_cycle2 = (this->*operate_impl[lookup[opcode].operate])();
+
+    cycles += (add_cycle1 & add_cycle2);
+
+    SetFlag(U, 1);
+
+    return cycles;
+}
+
+/**
+ * @brief Copies out the registers and the state of the current instruction
+ */
+R6502::REGISTERS R6502::registers() const
+{
+    return {a, x, y, stkp, pc, status, fetched, opcode, cycles, temp, addr_abs, addr_rel,
+            clock_count, instruction_count};
+}
+
+/**
+ * @brief Puts back registers taken with registers()
+ */
+void R6502::set_registers(const REGISTERS &r)
+{
+    a = r.a;
+    x = r.x;
+    y = r.y;
+    stkp = r.stkp;
+    pc = r.pc;
+    status = r.status;
+    fetched = r.fetched;
+    opcode = r.opcode;
+    cycles = r.cycles;
+    temp = r.temp;
+    addr_abs = r.addr_abs;
+    addr_rel = r.addr_rel;
+    clock_count = r.clock_count;
+    instruction_count = r.instruction_count;
 }
 
 /**
@@ -150,7 +296,10 @@ void R6502::reset()
 
     // set program counter
     pc = (hi << 8) | lo;
+#ifndef R6502_HEADLESS
+    // Headless hosts reset whole batches of instances
     printf("Reset Requested. PC = %X\n", pc);
+#endif
 
     // reset core registers
     a = 0;
@@ -194,12 +343,13 @@ void R6502::irq()
         write(0x0100 + stkp, pc & 0x00FF);
         stkp--;
 
-        // Then Push the status register to the stack
+        // Then Push the status register to the stack. I is set after the push,
+        // so RTI enables interrupts again
         SetFlag(B, 0);
         SetFlag(U, 1);
-        SetFlag(I, 1);
         write(0x0100 + stkp, status);
         stkp--;
+        SetFlag(I, 1);
 
         // Read new program counter location from fixed address
         addr_abs = IRQB;
@@ -226,9 +376,9 @@ void R6502::nmi()
 
     SetFlag(B, 0);
     SetFlag(U, 1);
-    SetFlag(I, 1);
     write(0x0100 + stkp, status);
     stkp--;
+    SetFlag(I, 1);
 
     // set address to NMIB
     addr_abs = NMIB;
@@ -473,7 +623,7 @@ uint8_t R6502::IZY()
  */
 uint8_t R6502::fetch()
 {
-    if (!(lookup[opcode].addrmode == &R6502::IMP))
+    if (!(lookup[opcode].addrmode == (uint8_t)ADDRMODE::IMP))
         fetched = read(addr_abs);
     return fetched;
 }
@@ -511,7 +661,7 @@ uint8_t R6502::ASL()
     SetFlag(C, (temp & 0xFF00) > 0);
     SetFlag(Z, (temp & 0x00FF) == 0x00);
     SetFlag(N, temp & 0x80);
-    if (lookup[opcode].addrmode == &R6502::IMP)
+    if (lookup[opcode].addrmode == (uint8_t)ADDRMODE::IMP)
         a = temp & 0x00FF;
     else
         write(addr_abs, temp & 0x00FF);
@@ -925,7 +1075,7 @@ uint8_t R6502::LSR()
     temp = fetched >> 1;
     SetFlag(Z, (temp & 0x00FF) == 0x0000);
     SetFlag(N, temp & 0x0080);
-    if (lookup[opcode].addrmode == &R6502::IMP)
+    if (lookup[opcode].addrmode == (uint8_t)ADDRMODE::IMP)
         a = temp & 0x00FF;
     else
         write(addr_abs, temp & 0x00FF);
@@ -1014,7 +1164,7 @@ uint8_t R6502::ROL()
     SetFlag(C, temp & 0xFF00);
     SetFlag(Z, (temp & 0x00FF) == 0x0000);
     SetFlag(N, temp & 0x0080);
-    if (lookup[opcode].addrmode == &R6502::IMP)
+    if (lookup[opcode].addrmode == (uint8_t)ADDRMODE::IMP)
         a = temp & 0x00FF;
     else
         write(addr_abs, temp & 0x00FF);
@@ -1028,7 +1178,7 @@ uint8_t R6502::ROR()
     SetFlag(C, fetched & 0x01);
     SetFlag(Z, (temp & 0x00FF) == 0x00);
     SetFlag(N, temp & 0x0080);
-    if (lookup[opcode].addrmode == &R6502::IMP)
+    if (lookup[opcode].addrmode == (uint8_t)ADDRMODE::IMP)
         a = temp & 0x00FF;
     else
         write(addr_abs, temp & 0x00FF);
@@ -1243,6 +1393,13 @@ uint8_t R6502::ADC()
     // Grab the data that we are adding to the accumulator
     fetch();
 
+    // Decimal mode is table driven, see R6502Decimal.cpp
+    if (status.other & D)
+    {
+        cycles += decimal_arithmetic(fetched, false);
+        return 1;
+    }
+
     // Add is performed in 16-bit domain for emulation to capture any
     // carry bit, which will exist in bit 8 of the 16-bit word
     temp = (uint16_t)a + (uint16_t)fetched + (uint16_t)GetFlag(C);
@@ -1296,6 +1453,12 @@ uint8_t R6502::SBC()
 {
     fetch();
 
+    if (status.other & D)
+    {
+        cycles += decimal_arithmetic(fetched, true);
+        return 1;
+    }
+
     // Operating in 16-bit domain to capture carry out
 
     // We can invert the bottom 8 bits with bitwise xor
@@ -1325,142 +1488,287 @@ bool R6502::complete()
     return cycles == 0;
 }
 
+// The layout of an instruction's operand for each addressing mode, in the order
+// of ADDRMODE: what goes before the number, its size and what goes after
+enum OPERAND : uint8_t
+{
+    NO_OPERAND,
+    BYTE_VALUE,   // #$12
+    BYTE_ADDRESS, // $12, a zero page address
+    WORD_ADDRESS, // $1234
+    BRANCH,       // $12 [$1234], the offset and where it goes
+};
+
+struct OPERAND_FORMAT
+{
+    const char *open;
+    OPERAND operand;
+    const char *close;
+};
+
+static constexpr OPERAND_FORMAT operand_format[] = {
+    {"", NO_OPERAND, " {IMP}"},        // IMP
+    {"#", BYTE_VALUE, " {IMM}"},       // IMM
+    {"", BYTE_ADDRESS, " {ZP0}"},      // ZP0
+    {"", BYTE_ADDRESS, ", X {ZPX}"},   // ZPX
+    {"", BYTE_ADDRESS, ", Y {ZPY}"},   // ZPY
+    {"", BRANCH, "] {REL}"},           // REL
+    {"", WORD_ADDRESS, " {ABS}"},      // ABS
+    {"", WORD_ADDRESS, ", X {ABX}"},   // ABX
+    {"", WORD_ADDRESS, ", Y {ABY}"},   // ABY
+    {"(", WORD_ADDRESS, ") {IND}"},    // IND
+    {"(", BYTE_ADDRESS, ", X) {IZX}"}, // IZX
+    {"(", BYTE_ADDRESS, "), Y {IZY}"}, // IZY
+};
+static_assert(sizeof(operand_format) / sizeof(operand_format[0]) == 12, "an operand format per addressing mode");
+
+// Appends to a line, dropping what does not fit
+struct LINE_WRITER
+{
+    char *at;
+    char *end; // Leaves room for the 0
+
+    void put(char c)
+    {
+        if (at < end)
+            *at++ = c;
+    }
+
+    void put(const char *s)
+    {
+        while (*s && at < end)
+            *at++ = *s++;
+    }
+
+    void hex(uint32_t n, uint32_t digits)
+    {
+        while (digits-- > 0)
+            put("0123456789ABCDEF"[n >> (digits * 4) & 0xF]);
+    }
+
+    void address(uint16_t addr, uint32_t digits, const DisassemblySymbols *symbols)
+    {
+        const char *name = symbols ? symbols->name(addr) : nullptr;
+        if (name)
+            put(name);
+        else
+        {
+            put('$');
+            hex(addr, digits);
+        }
+    }
+};
+
+// Tables for the fast path of format_instruction, built at compile time: the
+// digits of every byte, the start of every opcode's line up to its operand
+// ("LDA #") and the end of every addressing mode's, each padded so it is
+// copied with a single fixed size store. Per addressing mode, masks pick the
+// operand's address out of the word, branch target and byte candidates
+struct FORMAT_TABLES
+{
+    char hex[256][2];
+    struct { char text[8]; uint8_t length; } head[256];
+    struct
+    {
+        char close[16];
+        uint8_t close_length;
+        uint8_t operand_length; // Characters of the operand, "$12 [$1234" at most
+        uint8_t high_shift;     // 8 if the first two digits are a word's high byte
+        uint16_t word, branch, byte;
+    } mode[12];
+    uint8_t instruction_length[256];
+};
+
+static constexpr FORMAT_TABLES make_format_tables()
+{
+    FORMAT_TABLES t{};
+    for (uint32_t n = 0; n < 256; n++)
+    {
+        t.hex[n][0] = "0123456789ABCDEF"[n >> 4];
+        t.hex[n][1] = "0123456789ABCDEF"[n & 0xF];
+
+        uint8_t length = 0;
+        for (const char *c = R6502::mnemonic[n]; *c; c++)
+            t.head[n].text[length++] = *c;
+        t.head[n].text[length++] = ' ';
+        for (const char *c = operand_format[R6502::lookup[n].addrmode].open; *c; c++)
+            t.head[n].text[length++] = *c;
+        t.head[n].length = length;
+
+        OPERAND operand = operand_format[R6502::lookup[n].addrmode].operand;
+        t.instruction_length[n] = operand == NO_OPERAND ? 1 : operand == WORD_ADDRESS ? 3 : 2;
+    }
+    for (uint32_t mode = 0; mode < 12; mode++)
+    {
+        uint8_t length = 0;
+        for (const char *c = operand_format[mode].close; *c; c++)
+            t.mode[mode].close[length++] = *c;
+        t.mode[mode].close_length = length;
+
+        OPERAND operand = operand_format[mode].operand;
+        t.mode[mode].operand_length = operand == NO_OPERAND ? 0 : operand == WORD_ADDRESS ? 5 : operand == BRANCH ? 10 : 3;
+        t.mode[mode].high_shift = operand == WORD_ADDRESS ? 8 : 0;
+        t.mode[mode].word = operand == WORD_ADDRESS ? 0xFFFF : 0;
+        t.mode[mode].branch = operand == BRANCH ? 0xFFFF : 0;
+        t.mode[mode].byte = operand == WORD_ADDRESS || operand == BRANCH ? 0 : 0xFFFF;
+    }
+    return t;
+}
+
+static constexpr FORMAT_TABLES format_tables = make_format_tables();
+
+// Room the fast path needs: the padding of the tables can be written past the
+// end of the text
+static_assert(R6502::LINE_SIZE >= 7 + 5 + 10 + 16 + 1, "the fast path overwrites up to 38 bytes");
+
+static inline char *put_hex2(char *at, uint8_t n)
+{
+    std::memcpy(at, format_tables.hex[n], 2);
+    return at + 2;
+}
+
+// format_instruction for lines with names or too little room, which checks
+// every character against the end. Kept apart so the fast path stays small
+__attribute__((noinline)) static uint32_t format_checked(uint16_t addr, const uint8_t *bytes, uint16_t target, char *out,
+                                                         uint32_t size, const DisassemblySymbols *symbols)
+{
+    uint8_t opcode = bytes[0];
+    const OPERAND_FORMAT &format = operand_format[R6502::lookup[opcode].addrmode];
+    LINE_WRITER line{out, out + size - 1};
+
+    // Prefix line with instruction address
+    line.put('$');
+    line.hex(addr, 4);
+    line.put(": ");
+    line.put(R6502::mnemonic[opcode]);
+    line.put(' ');
+    line.put(format.open);
+    switch (format.operand)
+    {
+    case NO_OPERAND:
+        break;
+    case BYTE_VALUE:
+        line.put('$');
+        line.hex(bytes[1], 2);
+        break;
+    case BYTE_ADDRESS:
+        line.address(target, 2, symbols);
+        break;
+    case WORD_ADDRESS:
+        line.address(target, 4, symbols);
+        break;
+    case BRANCH:
+        // The offset is signed and counts from the next instruction
+        line.put('$');
+        line.hex(bytes[1], 2);
+        line.put(" [");
+        line.address(target, 4, symbols);
+        break;
+    }
+    line.put(format.close);
+
+    *line.at = '\0';
+    return (uint32_t)(line.at - out);
+}
+
+uint32_t R6502::instruction_length(uint8_t opcode)
+{
+    return format_tables.instruction_length[opcode];
+}
+
+uint32_t R6502::instruction_cycles(uint8_t opcode)
+{
+    return lookup[opcode].cycles;
+}
+
+/**
+ * @brief Formats an instruction into a caller's buffer. Its workings are not
+ * required for emulation, it is merely a convenience to turn the binary
+ * instruction code into human readable form
+ *
+ * @param addr where the instruction is, for the line's address and branch targets
+ * @param bytes the opcode and the two bytes after it, read whatever the length
+ * @param out receives the text and a terminating 0
+ * @param size room in out
+ * @param symbols names for addresses, or nullptr
+ * @return the length of the text written
+ */
+uint32_t R6502::format_instruction(uint16_t addr, const uint8_t *bytes, char *out, uint32_t size,
+                                   const DisassemblySymbols *symbols)
+{
+    if (size == 0)
+        return 0;
+
+    uint8_t opcode = bytes[0];
+    uint8_t mode = lookup[opcode].addrmode;
+    const OPERAND_FORMAT &format = operand_format[mode];
+    const auto &select = format_tables.mode[mode];
+    uint16_t word = (uint16_t)(bytes[2] << 8 | bytes[1]);
+    uint16_t branch = (uint16_t)(addr + 2 + (int8_t)bytes[1]);
+    uint16_t target = (word & select.word) | (branch & select.branch) | (bytes[1] & select.byte);
+    bool named = symbols && format.operand >= BYTE_ADDRESS && symbols->name(target);
+
+    // The fast path, for lines that are numbers only: every part is a fixed
+    // size copy out of the tables. The operand is written the same way for
+    // every addressing mode, as "$1234 [$5678" with the first two digits the
+    // high byte of a word and the second two its low byte or " [", and cut to
+    // the length the mode has. Without branches on the mode, which would
+    // mispredict on every other line of a listing
+    if (size >= LINE_SIZE && !named)
+    {
+        char *at = out;
+        *at++ = '$';
+        at = put_hex2(at, (uint8_t)(addr >> 8));
+        at = put_hex2(at, (uint8_t)addr);
+        std::memcpy(at, ": ", 2);
+        at += 2;
+        std::memcpy(at, format_tables.head[opcode].text, 8);
+        at += format_tables.head[opcode].length;
+
+        uint16_t digits, bracket;
+        std::memcpy(&digits, format_tables.hex[bytes[1]], 2);
+        std::memcpy(&bracket, " [", 2);
+        uint16_t second = (uint16_t)((digits & select.word) | (bracket & ~select.word));
+        at[0] = '$';
+        put_hex2(at + 1, (uint8_t)(word >> select.high_shift));
+        std::memcpy(at + 3, &second, 2);
+        at[5] = '$';
+        put_hex2(at + 6, (uint8_t)(target >> 8));
+        put_hex2(at + 8, (uint8_t)target);
+        at += select.operand_length;
+
+        std::memcpy(at, select.close, 16);
+        at += select.close_length;
+        *at = '\0';
+        return (uint32_t)(at - out);
+    }
+
+    return format_checked(addr, bytes, target, out, size, symbols);
+}
+
 // This is the disassembly function. Its workings are not required for emulation.
 // It is merely a convenience function to turn the binary instruction code into
-// human readable form. Its included as part of the emulator because it can take
-// advantage of many of the CPUs internal operations to do this.
+// human readable form, a line per instruction from nStart on
 std::map<uint16_t, std::string> R6502::disassemble(uint16_t nStart, uint16_t nStop)
 {
-    uint32_t addr = nStart;
-    uint8_t value = 0x00, lo = 0x00, hi = 0x00;
     std::map<uint16_t, std::string> mapLines;
-    uint16_t line_addr = 0;
 
-    // A convenient utility to convert variables into
-    // hex strings because "modern C++"'s method with
-    // streams is atrocious
-    auto hex = [](uint32_t n, uint8_t d)
-    {
-        std::string s(d, '0');
-        for (int i = d - 1; i >= 0; i--, n >>= 4)
-            s[i] = "0123456789ABCDEF"[n & 0xF];
-        return s;
-    };
-
-    // Starting at the specified address we read an instruction
-    // byte, which in turn yields information from the lookup table
-    // as to how many additional bytes we need to read and what the
-    // addressing mode is. I need this info to assemble human readable
-    // syntax, which is different depending upon the addressing mode
-
-    // As the instruction is decoded, a std::string is assembled
-    // with the readable output
-    while (addr <= (uint32_t)nStop)
+    // Take the whole range (plus the operands of an instruction starting at
+    // nStop) in one go, straight from memory wherever possible
+    std::vector<uint8_t> bytes(nStart <= nStop ? nStop - nStart + 3 : 0);
+    bus->peek_range(nStart, (uint32_t)bytes.size(), bytes.data());
+
+    // Add each line to a std::map, using the instruction's address as the
+    // key. This makes it convenient to look for later as the instructions
+    // are variable in length, so a straight up incremental index is not
+    // sufficient.
+    char line[LINE_SIZE];
+    for (uint32_t addr = nStart; addr <= (uint32_t)nStop;)
     {
-        line_addr = addr;
-
-        // Prefix line with instruction address
-        std::string sInst = "$" + hex(addr, 4) + ": ";
-
-        // Read instruction, and get its readable name
-        uint8_t opcode = bus->read(addr, true);
-        addr++;
-        sInst += lookup[opcode].name + " ";
-
-        // Get operands from desired locations, and form the
-        // instruction based upon its addressing mode. These
-        // routines mimmick the actual fetch routine of the
-        // 6502 in order to get accurate data as part of the
-        // instruction
-        if (lookup[opcode].addrmode == &R6502::IMP)
-        {
-            sInst += " {IMP}";
-        }
-        else if (lookup[opcode].addrmode == &R6502::IMM)
-        {
-            value = bus->read(addr, true);
-            addr++;
-            sInst += "#$" + hex(value, 2) + " {IMM}";
-        }
-        else if (lookup[opcode].addrmode == &R6502::ZP0)
-        {
-            lo = bus->read(addr, true);
-            addr++;
-            hi = 0x00;
-            sInst += "$" + hex(lo, 2) + " {ZP0}";
-        }
-        else if (lookup[opcode].addrmode == &R6502::ZPX)
-        {
-            lo = bus->read(addr, true);
-            addr++;
-            hi = 0x00;
-            sInst += "$" + hex(lo, 2) + ", X {ZPX}";
-        }
-        else if (lookup[opcode].addrmode == &R6502::ZPY)
-        {
-            lo = bus->read(addr, true);
-            addr++;
-            hi = 0x00;
-            sInst += "$" + hex(lo, 2) + ", Y {ZPY}";
-        }
-        else if (lookup[opcode].addrmode == &R6502::IZX)
-        {
-            lo = bus->read(addr, true);
-            addr++;
-            hi = 0x00;
-            sInst += "($" + hex(lo, 2) + ", X) {IZX}";
-        }
-        else if (lookup[opcode].addrmode == &R6502::IZY)
-        {
-            lo = bus->read(addr, true);
-            addr++;
-            hi = 0x00;
-            sInst += "($" + hex(lo, 2) + "), Y {IZY}";
-        }
-        else if (lookup[opcode].addrmode == &R6502::ABS)
-        {
-            lo = bus->read(addr, true);
-            addr++;
-            hi = bus->read(addr, true);
-            addr++;
-            sInst += "$" + hex((uint16_t)(hi << 8) | lo, 4) + " {ABS}";
-        }
-        else if (lookup[opcode].addrmode == &R6502::ABX)
-        {
-            lo = bus->read(addr, true);
-            addr++;
-            hi = bus->read(addr, true);
-            addr++;
-            sInst += "$" + hex((uint16_t)(hi << 8) | lo, 4) + ", X {ABX}";
-        }
-        else if (lookup[opcode].addrmode == &R6502::ABY)
-        {
-            lo = bus->read(addr, true);
-            addr++;
-            hi = bus->read(addr, true);
-            addr++;
-            sInst += "$" + hex((uint16_t)(hi << 8) | lo, 4) + ", Y {ABY}";
-        }
-        else if (lookup[opcode].addrmode == &R6502::IND)
-        {
-            lo = bus->read(addr, true);
-            addr++;
-            hi = bus->read(addr, true);
-            addr++;
-            sInst += "($" + hex((uint16_t)(hi << 8) | lo, 4) + ") {IND}";
-        }
-        else if (lookup[opcode].addrmode == &R6502::REL)
-        {
-            value = bus->read(addr, true);
-            addr++;
-            sInst += "$" + hex(value, 2) + " [$" + hex(addr + value, 4) + "] {REL}";
-        }
-
-        // Add the formed string to a std::map, using the instruction's
-        // address as the key. This makes it convenient to look for later
-        // as the instructions are variable in length, so a straight up
-        // incremental index is not sufficient.
-        mapLines[line_addr] = sInst;
+        const uint8_t *instruction = &bytes[addr - nStart];
+        uint32_t length = format_instruction((uint16_t)addr, instruction, line, sizeof(line));
+        mapLines.emplace_hint(mapLines.end(), (uint16_t)addr, std::string(line, length));
+        addr += instruction_length(instruction[0]);
     }
 
     return mapLines;
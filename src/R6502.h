@@ -2,6 +2,7 @@
 
 #include "config.h"
 #include "Bus.h"
+#include "R6502Opcodes.h"
 
 #include <cstdint>
 #include <string>
@@ -11,6 +12,17 @@
 
 class Bus;
 
+// Names for addresses, which the disassembler shows in place of the numbers
+// of operands that are addresses (see R6502::format_instruction)
+class DisassemblySymbols
+{
+public:
+    virtual ~DisassemblySymbols() = default;
+
+    // The name of addr, or nullptr to show it as a number
+    virtual const char *name(uint16_t addr) const = 0;
+};
+
 class R6502
 {
 public:
@@ -18,13 +30,60 @@ public:
     ~R6502();
 
 public:
+    /**
+     * @brief The status register. Instead of updating the flag byte bit by bit,
+     * instructions store N and Z as the result they were derived from, and C and
+     * V as plain booleans. The flag byte is only put together when the register
+     * is read (branches test the stored values directly), so to everything
+     * outside the CPU it behaves exactly like a uint8_t. U is not stored at
+     * all: it reads as 1, as on the real chip.
+     */
+    class STATUS
+    {
+    public:
+        operator uint8_t() const
+        {
+            return other | U | c | (zero() ? Z : 0) | (v << 6) | (negative() ? N : 0);
+        }
+
+        STATUS &operator=(uint8_t value)
+        {
+            other = value & (I | D | B);
+            set_nz(value & N, value & Z);
+            c = value & C;
+            v = (value & V) >> 6;
+            return *this;
+        }
+
+        STATUS &operator|=(uint8_t f) { return *this = *this | f; }
+        STATUS &operator&=(uint8_t f) { return *this = *this & f; }
+
+    private:
+        friend class R6502;
+
+        bool zero() const { return (nz & 0x00FF) == 0; }
+        bool negative() const { return (nz & 0x8080) != 0; }
+        void set_nz(bool negative, bool zero)
+        {
+            nz = (negative ? 0x8000 : 0x0000) | (zero ? 0x0000 : 0x0001);
+        }
+
+        // N and Z from a single store: Z is set when the low byte is 0, N when
+        // bit 7 of either byte is. Most instructions store their 8 bit result,
+        // BIT puts its N (bit 7 of the operand) in the high byte.
+        uint16_t nz = 0x0000;
+        uint8_t c = 0;        // C, 0 or 1
+        uint8_t v = 0;        // V, 0 or 1
+        uint8_t other = 0x00; // I, D and B at their positions in the flag byte
+    };
+
     // R6502 Core registers
     uint8_t a       = 0x00;   // Accumulator Register
     uint8_t x       = 0x00;   // X Register
     uint8_t y       = 0x00;   // Y Register
     uint8_t stkp    = 0x00;   // Stack Pointer (points to location on bus)
-    uint8_t status  = 0x00;   // Status Register
     uint16_t pc     = 0x0000; // Program Counter
+    STATUS status;            // Status Register
 
     // Assistive variables to facilitate emulation
     uint8_t fetched = 0x00;     // Represents the working input value to the ALU
@@ -34,6 +93,7 @@ public:
     uint16_t addr_abs = 0x0000; // All used memory addresses end up in here
     uint16_t addr_rel = 0x00;   // Represents absolute address following a branch
     uint32_t clock_count = 0;   // A global accumulation of the number of clocks
+    uint32_t instruction_count = 0; // A global accumulation of the number of instructions executed
 
     // The read location of data can come from two sources, a memory address, or
     // its immediately available as part of the instruction. This function decides
@@ -46,6 +106,84 @@ public:
     void nmi();   // Non-Maskable Interrupt Request - As above, but cannot be disabled
     void clock(); // Perform one clock cycle's worth of update
 
+    // Instruction granular execution. Whole instructions are executed in a tight
+    // loop and their cycles charged to clock_count in bulk, returning the cycles used.
+    // Breakpoints (Breakpoints.h) can stop them early, clock() ignores them
+    uint32_t run(uint32_t budget);   // Run until at least budget cycles are used
+    uint8_t step_instruction();      // Finish the current instruction or execute the next one
+
+    // Execution engine used by clock(). LOOKUP dispatches every instruction through
+    // the opcode translation table, SWITCH runs the inlined interpreter in R6502Switch.cpp
+    // and CACHED runs the same interpreter from pre-decoded basic blocks (R6502Cache.cpp).
+    // JIT additionally compiles hot blocks to native x86-64 code (R6502Jit.cpp) and
+    // behaves like CACHED on other hosts. All produce identical register, flag, memory
+    // and cycle results.
+    enum ENGINE
+    {
+        LOOKUP,
+        SWITCH,
+        CACHED,
+        JIT,
+    };
+    ENGINE engine = SWITCH;
+
+    // Behaviour of ADC and SBC while the D flag is set. NMOS is the original 6502
+    // (Z from the binary sum, N and V from an intermediate result, SBC flags as in
+    // binary mode), CMOS the 65C02 (valid N and Z, one extra cycle) and OFF ignores
+    // D like the NES's 2A03. The same for every engine.
+    enum DECIMAL
+    {
+        DECIMAL_NMOS,
+        DECIMAL_CMOS,
+        DECIMAL_OFF,
+    };
+    DECIMAL decimal = DECIMAL_NMOS;
+
+    // Bus accuracy of the SWITCH engine, fixed at build time by R6502_ACCURACY in
+    // config.h so a build only carries the model it chose. ACCURACY_FAST does the
+    // accesses that affect the result. ACCURACY_CYCLE does exactly one access per
+    // cycle in the chip's order: the dummy reads of implied, indexed, stack and
+    // branch instructions and the write of the unmodified value by read-modify-write
+    // instructions, so devices with read or write side effects see what the real
+    // bus would. CACHED and JIT skip the opcode fetches and run as SWITCH in such
+    // a build; LOOKUP stays the fast reference.
+    struct ACCURACY_FAST { static constexpr bool cycle_exact = false; };
+    struct ACCURACY_CYCLE { static constexpr bool cycle_exact = true; };
+    using ACCURACY = R6502_ACCURACY;
+
+    // The registers and the state of the instruction in progress, which is what
+    // it takes to put the CPU back where it was. The engine, the decimal mode
+    // and decoded code are not part of it
+    struct REGISTERS
+    {
+        uint8_t a, x, y, stkp;
+        uint16_t pc;
+        STATUS status;
+        uint8_t fetched, opcode, cycles;
+        uint16_t temp, addr_abs, addr_rel;
+        uint32_t clock_count, instruction_count;
+    };
+    REGISTERS registers() const;
+    void set_registers(const REGISTERS &r);
+
+    // The CACHED engine watches bus writes to the code it has decoded. Hosts that
+    // change memory behind the bus's back (writing Bus::ram directly) must flush it
+    void flush_code_cache();
+
+    // Called by Bus::write for every store, drops decoded blocks covering addr
+    inline void notify_write(uint16_t addr)
+    {
+        if (code_pages[addr >> 8])
+            invalidate_code(addr);
+    }
+
+    // Called by Bus when a page is mapped to something else, drops decoded blocks touching it
+    inline void notify_remap(uint8_t page)
+    {
+        if (code_pages[page])
+            invalidate_page(page);
+    }
+
     // Indicates the current instruction has completed by returning true.
     // For step-by-step execution
     bool complete();
@@ -54,6 +192,23 @@ public:
     // in memory, for the specified address range
     std::map<uint16_t, std::string> disassemble(uint16_t nStart, uint16_t nStop);
 
+    // Bytes of the instruction starting with opcode, 1 to 3
+    static uint32_t instruction_length(uint8_t opcode);
+
+    // Base clock cycles of the instruction, without page crossing and branch penalties
+    static uint32_t instruction_cycles(uint8_t opcode);
+
+    // Write the text of the instruction at addr, whose opcode and operands are
+    // bytes[0] on (all three bytes are read, whatever the length of the
+    // instruction), into out as "$0400: LDA #$00 {IMM}". At most size - 1
+    // characters and a 0 are written, and nothing is allocated. Returns the
+    // length of the text. Without symbols a line always fits in LINE_SIZE, and
+    // with at least that much room it is written with a few fixed size copies.
+    // With symbols, operands that are addresses are shown by name where there is one
+    static constexpr uint32_t LINE_SIZE = 40;
+    static uint32_t format_instruction(uint16_t addr, const uint8_t *bytes, char *out, uint32_t size,
+                                       const DisassemblySymbols *symbols = nullptr);
+
     // Link this CPU to a communications bus
     void ConnectBus(Bus *n) { bus = n; }
 
@@ -73,7 +228,7 @@ public:
          */
         I = (1 << 2),
         /**
-         * @brief Decimal Mode (unused in this implementation)
+         * @brief Decimal Mode, see R6502::decimal
          */
         D = (1 << 3),
         /**
@@ -94,6 +249,48 @@ public:
         N = (1 << 7),
     };
 
+    // Identifiers for the addressing modes and operations, in the order of R6502Opcodes.h
+    #define R6502_ENUM_ENTRY(name) name,
+    enum class ADDRMODE : uint8_t { R6502_ADDRMODE_LIST(R6502_ENUM_ENTRY) };
+    enum class OPERATION : uint8_t { R6502_OPERATION_LIST(R6502_ENUM_ENTRY) };
+    #undef R6502_ENUM_ENTRY
+
+    // An indexed read (the operations whose implementation returns 1) costs an
+    // additional cycle when its addressing mode (ABX, ABY or IZY) crosses a page
+    static constexpr bool can_cross_page(OPERATION op, ADDRMODE mode)
+    {
+        using O = OPERATION;
+        using M = ADDRMODE;
+        bool reads = op == O::ADC || op == O::AND || op == O::CMP || op == O::EOR || op == O::LDA ||
+                     op == O::LDX || op == O::LDY || op == O::ORA || op == O::SBC;
+        return reads && (mode == M::ABX || mode == M::ABY || mode == M::IZY);
+    }
+
+    /**
+     * @brief This structure and the following table are used to store the opcode
+     * translation table. The 6502 can effectively have 256 different instructions.
+     * Each of these are stored in a table in numerical order so they can be looked
+     * up easily, with no decoding required. The table is built at compile time from
+     * R6502Opcodes.h and shared by every CPU instance. Each 2 byte entry holds:
+     *      Operation : OPERATION id of the implementation of the opcode
+     *      Page Cross : set if crossing a page while addressing costs an extra cycle
+     *      Address Mode : ADDRMODE id of the addressing mechanism used by the instruction
+     *      Cycle Count : the base number of clock cycles the CPU requires to perform
+     *                    the instruction
+     * The mnemonics are only needed by the disassembler, so they live in a separate
+     * cold table.
+     */
+    struct INSTRUCTION
+    {
+        uint8_t operate : 7;
+        uint8_t page_cross : 1;
+        uint8_t addrmode : 4;
+        uint8_t cycles : 4;
+    };
+
+    static const INSTRUCTION lookup[256];
+    static const char mnemonic[256][4];
+
     // 12 Addressing Modes. These functions
     // may adjust the number of cycles required depending upon where
     // and how the memory is accessed, so they return the required
@@ -136,28 +333,86 @@ private:
     uint8_t GetFlag(FLAGS6502 f);
     void SetFlag(FLAGS6502 f, bool value);
 
-    /**
-     * @brief This structure and the following vector are used to compile and store
-     * the opcode translation table. The 6502 can effectively have 256
-     * different instructions. Each of these are stored in a table in numerical
-     * order so they can be looked up easily, with no decoding required.
-     * Each table entry holds:
-     *      Pneumonic : A textual representation of the instruction (used for disassembly)
-     *  	Opcode Function: A function pointer to the implementation of the opcode
-     *  	Opcode Address Mode : A function pointer to the implementation of the 
-     *  						  addressing mechanism used by the instruction
-     *  	Cycle Count : An integer that represents the base number of clock cycles the
-     *  				  CPU requires to perform the instruction 
-     */
-    struct INSTRUCTION
+    // ADC (subtract false) or SBC of m with D set, returns the additional cycles (R6502Decimal.cpp)
+    uint8_t decimal_arithmetic(uint8_t m, bool subtract);
+
+    // Execute a whole instruction with the SWITCH or LOOKUP engine, return its cycle count
+    uint8_t execute();
+    uint8_t execute_lookup();
+
+    // Executes SWITCH engine instructions until budget cycles are used
+    uint32_t run_switch(uint32_t budget);
+
+    // The same, with the LOOKUP engine as well, stopping at breakpoints,
+    // recording the instruction trace and counting instructions in the
+    // profiler. clock is clock_count with the cycles run() has charged so far
+    uint32_t run_checked(uint32_t budget, uint32_t clock);
+
+    // The interpreter shared by SWITCH and CACHED (R6502Execute.h), parameterised
+    // on the bus accuracy and on where the opcode and operand bytes come from
+    struct BusOperands;
+    struct DecodedOperands;
+    template <class Accuracy, class Operands>
+    uint8_t interpret(Operands &src);
+
+    // The interpreter's code for each opcode: one instantiation per addressing
+    // mode and operation pair of R6502Opcodes.h, with the operand kept local
+    template <class Accuracy, ADDRMODE M, bool Penalty, class Operands>
+    uint16_t address(Operands &src, uint8_t &cyc);
+    template <class Accuracy, OPERATION O, ADDRMODE M, class Operands>
+    void kernel(Operands &src, uint8_t &cyc);
+
+    // Basic block cache for the CACHED engine. A block is a straight run of decoded
+    // instructions ending at the first control flow instruction. Blocks live in a
+    // direct mapped table indexed by their start address; code_pages counts the
+    // blocks touching each 256 byte page so stores elsewhere cost a single test.
+    struct DECODED
     {
-        std::string name;
-        uint8_t (R6502::*operate)(void) = nullptr;
-        uint8_t (R6502::*addrmode)(void) = nullptr;
-        uint8_t cycles = 0;
+        uint8_t opcode;
+        uint16_t operand;
+        uint16_t next_pc;
     };
 
-    std::vector<INSTRUCTION> lookup;
+    struct BLOCK
+    {
+        static constexpr uint8_t MAX_OPS = 16;
+        static constexpr uint8_t MAX_BYTES = MAX_OPS * 3;
+
+        uint16_t start = 0;
+        uint16_t end = 0; // Address of the last byte covered by the block
+        uint8_t count = 0;
+        bool valid = false;
+        DECODED ops[MAX_OPS];
+
+        // JIT engine: native code compiled from the block once it has run hits
+        // times, and the worst case cycles of all but its last compiled instruction
+        const uint8_t *native = nullptr;
+        uint16_t native_max = 0;
+        uint8_t hits = 0;
+    };
+
+    // Invalidation probes the slots of every start address up to MAX_BYTES below
+    // a written address, which needs each of those to have its own slot
+    static constexpr uint16_t BLOCK_SLOTS = 1024;
+    static_assert(BLOCK_SLOTS > BLOCK::MAX_BYTES, "block slots must outnumber block bytes");
+    std::vector<BLOCK> blocks;
+    uint16_t code_pages[256] = {};
+    bool code_written = false; // Set when a store hits decoded code, ends the running block
+
+    BLOCK &decode_block(uint16_t addr);
+    void invalidate_code(uint16_t addr);
+    void invalidate_page(uint8_t page);
+    void release_block(BLOCK &block);
+    uint32_t run_cached(uint32_t budget);
+
+    // Native code buffer of the JIT engine, allocated on first use
+    struct JIT_BUFFER;
+    JIT_BUFFER *jit = nullptr;
+
+    bool compile_block(BLOCK &block);
+    void release_jit();
+    void release_code();
+    uint32_t run_jit(uint32_t budget);
 };
 
 
@@ -0,0 +1,217 @@
+#include "config.h"
+
+#include "R6502Execute.h"
+
+// The CACHED execution engine: the inlined interpreter (R6502Execute.h) fed from
+// pre-decoded basic blocks. Decoding an instruction (reading the opcode and its
+// operand bytes and working out where the next one starts) is done once per block,
+// after that every pass through the block only dispatches on the stored opcode.
+//
+// Blocks are invalidated by stores through Bus::write (see R6502::notify_write),
+// so self-modifying code and programs loaded by the CPU itself behave exactly as
+// with the other engines.
+//
+// Replaying a block skips the opcode and operand fetches, so the engine always
+// runs the fast accuracy model. Builds with ACCURACY_CYCLE run SWITCH instead
+// (see R6502::run).
+
+/**
+ * @brief Number of operand bytes following the opcode for an addressing mode
+ */
+static constexpr uint8_t operand_length(uint8_t mode)
+{
+    using M = R6502::ADDRMODE;
+    switch ((M)mode)
+    {
+    case M::IMP:
+        return 0;
+    case M::ABS: case M::ABX: case M::ABY: case M::IND:
+        return 2;
+    default:
+        return 1;
+    }
+}
+
+/**
+ * @brief Returns true if the operation can continue anywhere other than the
+ * next instruction, which ends the basic block
+ */
+static constexpr bool ends_block(uint8_t operate)
+{
+    using O = R6502::OPERATION;
+    switch ((O)operate)
+    {
+    case O::BCC: case O::BCS: case O::BEQ: case O::BMI:
+    case O::BNE: case O::BPL: case O::BVC: case O::BVS:
+    case O::JMP: case O::JSR: case O::RTS: case O::RTI:
+    case O::BRK:
+        return true;
+    default:
+        return false;
+    }
+}
+
+/**
+ * @brief Drops every decoded block, for use after memory has been changed
+ * without going through the bus
+ */
+void R6502::flush_code_cache()
+{
+    for (auto &block : blocks)
+        block.valid = false;
+    for (auto &page : code_pages)
+        page = 0;
+    code_written = true;
+}
+
+/**
+ * @brief Marks a block as invalid and removes it from the page counts
+ */
+void R6502::release_block(BLOCK &block)
+{
+    block.valid = false;
+    for (uint16_t page = block.start >> 8; page <= (block.end >> 8); page++)
+        code_pages[page]--;
+}
+
+/**
+ * @brief Drops the decoded blocks covering an address that has just been
+ * written. Only called for pages holding decoded code.
+ *
+ * @param addr address written to
+ */
+void R6502::invalidate_code(uint16_t addr)
+{
+    for (uint16_t back = 0; back < BLOCK::MAX_BYTES && back <= addr; back++)
+    {
+        uint16_t start = addr - back;
+        BLOCK &block = blocks[start % BLOCK_SLOTS];
+        if (block.valid && block.start == start && block.end >= addr)
+        {
+            release_block(block);
+            code_written = true;
+        }
+    }
+}
+
+/**
+ * @brief Drops the decoded blocks touching a page whose memory has been
+ * mapped to something else. Only called for pages holding decoded code.
+ *
+ * @param page the remapped page
+ */
+void R6502::invalidate_page(uint8_t page)
+{
+    for (auto &block : blocks)
+    {
+        if (block.valid && (block.start >> 8) <= page && (block.end >> 8) >= page)
+        {
+            release_block(block);
+            code_written = true;
+        }
+    }
+}
+
+/**
+ * @brief Decodes the basic block starting at addr into its slot, replacing
+ * whatever block was cached there. Memory is read with Bus::peek_range, so
+ * decoding has no side effects on the bus.
+ *
+ * @param addr start address of the block
+ * @return BLOCK& the decoded block. Its count is 0 if the first instruction
+ * wraps around the top of the address space, which is left to the uncached path.
+ */
+R6502::BLOCK &R6502::decode_block(uint16_t addr)
+{
+    BLOCK &block = blocks[addr % BLOCK_SLOTS];
+    if (block.valid)
+        release_block(block);
+
+    block.start = addr;
+    block.count = 0;
+    block.native = nullptr;
+    block.hits = 0;
+
+    // Every byte the block can cover, taken in one go
+    uint8_t bytes[BLOCK::MAX_BYTES];
+    bus->peek_range(addr, sizeof(bytes), bytes);
+
+    uint32_t at = addr;
+    while (block.count < BLOCK::MAX_OPS)
+    {
+        uint8_t op = bytes[at - addr];
+        uint8_t length = operand_length(lookup[op].addrmode);
+
+        // Keep instructions that wrap from $FFFF to $0000 out of the cache,
+        // a block always covers one contiguous range
+        if (at + length > 0xFFFF)
+            break;
+
+        DECODED &d = block.ops[block.count++];
+        d.opcode = op;
+        d.operand = 0;
+        if (length >= 1)
+            d.operand = bytes[at + 1 - addr];
+        if (length == 2)
+            d.operand |= (uint16_t)bytes[at + 2 - addr] << 8;
+
+        block.end = (uint16_t)(at + length);
+        at += length + 1;
+        d.next_pc = (uint16_t)at;
+
+        if (ends_block(lookup[op].operate))
+            break;
+    }
+
+    block.valid = block.count != 0;
+    if (block.valid)
+        for (uint16_t page = block.start >> 8; page <= (block.end >> 8); page++)
+            code_pages[page]++;
+    return block;
+}
+
+/**
+ * @brief Executes instructions from the block cache until at least "budget"
+ * cycles have been used. The budget is checked after every instruction, so a
+ * block can be left part way through; execution then continues from a block
+ * starting at that instruction. A store into decoded code ends the current
+ * block straight after the storing instruction.
+ *
+ * @param budget number of clock cycles to run for
+ * @return uint32_t number of cycles used
+ */
+#if defined(__GNUC__)
+__attribute__((flatten))
+#endif
+uint32_t R6502::run_cached(uint32_t budget)
+{
+    if (blocks.empty())
+        blocks.resize(BLOCK_SLOTS);
+
+    uint32_t used = 0;
+    while (used < budget)
+    {
+        BLOCK *block = &blocks[pc % BLOCK_SLOTS];
+        if (!block->valid || block->start != pc)
+            block = &decode_block(pc);
+
+        if (block->count == 0)
+        {
+            BusOperands src{*this};
+            used += interpret<ACCURACY_FAST>(src);
+            instruction_count++;
+            continue;
+        }
+
+        code_written = false;
+        for (uint8_t i = 0; i < block->count && used < budget; i++)
+        {
+            DecodedOperands src{*this, block->ops[i]};
+            used += interpret<ACCURACY_FAST>(src);
+            instruction_count++;
+            if (code_written)
+                break;
+        }
+    }
+    return used;
+}
@@ -0,0 +1,152 @@
+#include "config.h"
+
+#include <vector>
+
+#include "Bus.h"
+#include "R6502.h"
+
+// Decimal mode ADC and SBC. Rather than adjusting the result nibble by nibble
+// on every instruction, the result and flags of every combination of carry,
+// accumulator and operand are worked out once, on first use, into a 128K entry
+// table per operation and flag behaviour. Each entry holds the result in its
+// low byte and the C, Z, V and N flags at their status register positions in
+// its high byte.
+//
+// The flag behaviour follows Bruce Clark's "Decimal Mode in NMOS 6500 series"
+// tutorial: the NMOS 6502 takes Z from the binary sum and N and V from an
+// intermediate result of the decimal adjustment, and its SBC sets all flags as
+// in binary mode. The 65C02 takes N and Z from the decimal result.
+
+/**
+ * @brief Decimal addition of m and the carry to a
+ */
+static uint16_t decimal_adc_entry(uint8_t a, uint8_t m, uint8_t c, bool cmos)
+{
+    int al = (a & 0x0F) + (m & 0x0F) + c;
+    if (al >= 0x0A)
+        al = ((al + 0x06) & 0x0F) + 0x10;
+    int sum = (a & 0xF0) + (m & 0xF0) + al;
+
+    // N and V from the intermediate sum, with the high nibbles signed
+    int sum_signed = (int8_t)(a & 0xF0) + (int8_t)(m & 0xF0) + al;
+    bool n = sum & 0x80;
+    bool v = sum_signed < -128 || sum_signed > 127;
+
+    if (sum >= 0xA0)
+        sum += 0x60;
+    uint8_t result = sum & 0xFF;
+    bool carry = sum >= 0x100;
+
+    bool z = ((a + m + c) & 0xFF) == 0;
+    if (cmos)
+    {
+        n = result & 0x80;
+        z = result == 0;
+    }
+
+    return result | (uint16_t)((carry ? R6502::C : 0) | (z ? R6502::Z : 0) |
+                               (v ? R6502::V : 0) | (n ? R6502::N : 0)) << 8;
+}
+
+/**
+ * @brief Decimal subtraction of m and the borrow (inverted carry) from a
+ */
+static uint16_t decimal_sbc_entry(uint8_t a, uint8_t m, uint8_t c, bool cmos)
+{
+    // C, V, and for the NMOS 6502 also N and Z, are those of the binary subtraction
+    uint16_t value = m ^ 0x00FF;
+    uint16_t binary = a + value + c;
+    bool carry = binary & 0xFF00;
+    bool v = (binary ^ a) & (binary ^ value) & 0x0080;
+    bool n = binary & 0x80;
+    bool z = (binary & 0xFF) == 0;
+
+    int al = (a & 0x0F) - (m & 0x0F) + c - 1;
+    int diff;
+    if (cmos)
+    {
+        diff = a - m + c - 1;
+        if (diff < 0)
+            diff -= 0x60;
+        if (al < 0)
+            diff -= 0x06;
+    }
+    else
+    {
+        if (al < 0)
+            al = ((al - 0x06) & 0x0F) - 0x10;
+        diff = (a & 0xF0) - (m & 0xF0) + al;
+        if (diff < 0)
+            diff -= 0x60;
+    }
+    uint8_t result = diff & 0xFF;
+
+    if (cmos)
+    {
+        n = result & 0x80;
+        z = result == 0;
+    }
+
+    return result | (uint16_t)((carry ? R6502::C : 0) | (z ? R6502::Z : 0) |
+                               (v ? R6502::V : 0) | (n ? R6502::N : 0)) << 8;
+}
+
+/**
+ * @brief The table of one operation and flag behaviour, indexed by
+ * carry << 16 | a << 8 | m. Built on first use.
+ */
+template <bool Subtract, bool Cmos>
+static const uint16_t *decimal_table()
+{
+    static const std::vector<uint16_t> table = []
+    {
+        std::vector<uint16_t> t(0x20000);
+        for (uint32_t i = 0; i < t.size(); i++)
+        {
+            uint8_t c = i >> 16, a = (i >> 8) & 0xFF, m = i & 0xFF;
+            t[i] = Subtract ? decimal_sbc_entry(a, m, c, Cmos) : decimal_adc_entry(a, m, c, Cmos);
+        }
+        return t;
+    }();
+    return table.data();
+}
+
+/**
+ * @brief ADC or SBC of m with the D flag set. Falls back to binary arithmetic
+ * when decimal mode is off (DECIMAL_OFF, the NES's 2A03).
+ *
+ * @param m operand
+ * @param subtract true for SBC
+ * @return uint8_t additional cycles, 1 on the 65C02
+ */
+uint8_t R6502::decimal_arithmetic(uint8_t m, bool subtract)
+{
+    const uint16_t *table;
+    switch (decimal)
+    {
+    case DECIMAL_NMOS:
+        table = subtract ? decimal_table<true, false>() : decimal_table<false, false>();
+        break;
+    case DECIMAL_CMOS:
+        table = subtract ? decimal_table<true, true>() : decimal_table<false, true>();
+        break;
+    default:
+    {
+        uint16_t value = subtract ? m ^ 0x00FF : m;
+        uint16_t t = (uint16_t)a + value + (uint16_t)status.c;
+        status.c = (t & 0xFF00) != 0;
+        status.v = ((t ^ (uint16_t)a) & (t ^ value) & 0x0080) != 0;
+        a = t & 0x00FF;
+        status.nz = a;
+        return 0;
+    }
+    }
+
+    uint16_t entry = table[(uint32_t)status.c << 16 | (uint32_t)a << 8 | m];
+    uint8_t flags = entry >> 8;
+    a = entry & 0x00FF;
+    status.c = flags & C;
+    status.v = (flags & V) >> 6;
+    status.set_nz(flags & N, flags & Z);
+    return decimal == DECIMAL_CMOS ? 1 : 0;
+}
@@ -0,0 +1,487 @@
+#pragma once
+
+#include "config.h"
+
+#include "Bus.h"
+#include "R6502.h"
+
+// The inlined interpreter behind the SWITCH and CACHED execution engines. This
+// header is private to the engine translation units (R6502Switch.cpp and
+// R6502Cache.cpp) so the interpreter can be inlined into their run loops.
+//
+// It produces exactly the same register, flag, memory and cycle results as the
+// lookup table engine in R6502.cpp, but instead of two calls through member
+// function pointers per instruction it has a single dispatch point: a switch
+// generated from the opcode table whose cases are template kernels, one per
+// addressing mode and operation pair, so each opcode compiles to straight line
+// code with no mode tests and no operand state kept in members.
+//
+// Built with ACCURACY_CYCLE (config.h) the kernels also perform the accesses
+// the real chip makes without using their result, following the per cycle bus
+// listings of "6502 Microprocessor Instruction Set" (64doc): every instruction
+// then makes exactly as many bus accesses as it takes cycles, in that order.
+// The results are the same either way, only the extra accesses differ.
+//
+// The engine deliberately mirrors the quirks of the table driven implementation
+// (BRK pushing pc + 2, unofficial NOPs being implied single byte instructions,
+// PHP clearing B and U afterwards, ...) so the two can be run in lockstep and
+// compared. Any behavioural change has to be made in both places.
+
+/**
+ * @brief Operand source that fetches the opcode and its operand bytes from the
+ * bus at pc, advancing pc as it goes (the SWITCH engine)
+ */
+struct R6502::BusOperands
+{
+    R6502 &cpu;
+
+    uint8_t opcode() { return cpu.bus->fetch(cpu.pc++); }
+    uint8_t byte() { return cpu.bus->read(cpu.pc++); }
+    uint16_t word()
+    {
+        uint16_t lo = cpu.bus->read(cpu.pc++);
+        uint16_t hi = cpu.bus->read(cpu.pc++);
+        return (hi << 8) | lo;
+    }
+};
+
+/**
+ * @brief Operand source replaying an instruction from the block cache. pc is
+ * moved past the whole instruction up front, no memory is touched
+ */
+struct R6502::DecodedOperands
+{
+    R6502 &cpu;
+    const DECODED &op;
+
+    uint8_t opcode()
+    {
+        cpu.pc = op.next_pc;
+        return op.opcode;
+    }
+    uint8_t byte() { return (uint8_t)op.operand; }
+    uint16_t word() { return op.operand; }
+};
+
+/**
+ * @brief Addressing mode kernel: works out the effective address of the
+ * current instruction from its operand bytes. The indexed modes add the page
+ * crossing penalty to cyc when "Penalty" is set, which is the case for the
+ * instructions whose legacy implementation returns 1 (the read operations).
+ * IND is only used by JMP and returns the jump target.
+ *
+ * With ACCURACY_CYCLE the indexed modes also make the read the chip does
+ * while adding the index: from the zero page base for ZPX, ZPY and IZX, and
+ * from the address with an unfixed high byte for ABX, ABY and IZY. Reads only
+ * spend that cycle when the page is crossed, writes always do.
+ *
+ * @param src operand source, BusOperands or DecodedOperands
+ * @param cyc cycle count of the instruction
+ * @return uint16_t the effective address
+ */
+template <class Accuracy, R6502::ADDRMODE M, bool Penalty, class Operands>
+inline uint16_t R6502::address(Operands &src, uint8_t &cyc)
+{
+    using AM = ADDRMODE;
+
+    auto indexed = [&](uint16_t base, uint8_t index) -> uint16_t
+    {
+        uint16_t ea = base + index;
+        bool crossed = (ea ^ base) & 0xFF00;
+        if (Penalty && crossed)
+            cyc++;
+        if constexpr (Accuracy::cycle_exact)
+            if (!Penalty || crossed)
+                bus->read((base & 0xFF00) | (ea & 0x00FF));
+        return ea;
+    };
+    auto zp_indexed = [&](uint8_t index) -> uint16_t
+    {
+        uint8_t base = src.byte();
+        if constexpr (Accuracy::cycle_exact)
+            bus->read(base);
+        return (base + index) & 0x00FF;
+    };
+
+    if constexpr (M == AM::ZP0)
+        return src.byte();
+    else if constexpr (M == AM::ZPX)
+        return zp_indexed(x);
+    else if constexpr (M == AM::ZPY)
+        return zp_indexed(y);
+    else if constexpr (M == AM::ABS)
+        return src.word();
+    else if constexpr (M == AM::ABX)
+        return indexed(src.word(), x);
+    else if constexpr (M == AM::ABY)
+        return indexed(src.word(), y);
+    else if constexpr (M == AM::IND)
+    {
+        uint16_t ptr = src.word();
+
+        // Simulate page boundary hardware bug
+        if ((ptr & 0x00FF) == 0x00FF)
+            return (bus->read(ptr & 0xFF00) << 8) | bus->read(ptr + 0);
+        return (bus->read(ptr + 1) << 8) | bus->read(ptr + 0);
+    }
+    else if constexpr (M == AM::IZX)
+    {
+        uint16_t t = src.byte();
+        if constexpr (Accuracy::cycle_exact)
+            bus->read(t);
+        uint16_t lo = bus->read((uint16_t)(t + (uint16_t)x) & 0x00FF);
+        uint16_t hi = bus->read((uint16_t)(t + (uint16_t)x + 1) & 0x00FF);
+        return (hi << 8) | lo;
+    }
+    else // IZY. IMP, IMM and REL have no effective address and never get here
+    {
+        uint16_t t = src.byte();
+        uint16_t lo = bus->read(t & 0x00FF);
+        uint16_t hi = bus->read((t + 1) & 0x00FF);
+        return indexed((hi << 8) | lo, y);
+    }
+}
+
+/**
+ * @brief Operation kernel: executes the current instruction once its opcode
+ * has been fetched. Every opcode of R6502Opcodes.h gets its own instantiation,
+ * so the addressing mode, the page crossing penalty and the operand source are
+ * all resolved at compile time and the operand never leaves a local.
+ *
+ * With ACCURACY_CYCLE the instructions that spend a cycle without a useful
+ * access read the byte at pc (implied, stack and taken branches) or the top of
+ * the stack, and read-modify-write instructions write the unmodified value
+ * back before the result.
+ *
+ * @param src operand source, BusOperands or DecodedOperands
+ * @param cyc cycle count of the instruction, holding its base cycles on entry
+ */
+template <class Accuracy, R6502::OPERATION O, R6502::ADDRMODE M, class Operands>
+inline void R6502::kernel(Operands &src, uint8_t &cyc)
+{
+    using OP = OPERATION;
+    using AM = ADDRMODE;
+
+    // The accesses made only by ACCURACY_CYCLE: the byte after the opcode, which
+    // implied instructions read and ignore, and the top of the stack
+    auto idle = [&]()
+    {
+        if constexpr (Accuracy::cycle_exact)
+            bus->read(pc);
+    };
+    auto idle_stack = [&]()
+    {
+        if constexpr (Accuracy::cycle_exact)
+            bus->read(0x0100 + stkp);
+    };
+
+    // The operand of a read: the accumulator in implied mode (0xEB, the legacy
+    // decoding of the unofficial SBC), the byte itself for IMM, else memory.
+    // last is the address of the last byte read for it, which the 65C02 reads
+    // again in its extra decimal mode cycle
+    auto load_from = [&](uint16_t &last) -> uint8_t
+    {
+        if constexpr (M == AM::IMP)
+        {
+            last = pc;
+            idle();
+            return a;
+        }
+        else if constexpr (M == AM::IMM)
+        {
+            uint8_t m = src.byte();
+            last = pc - 1;
+            return m;
+        }
+        else
+        {
+            last = address<Accuracy, M, can_cross_page(O, M)>(src, cyc);
+            return bus->read(last);
+        }
+    };
+    auto load = [&]() -> uint8_t
+    {
+        uint16_t last;
+        return load_from(last);
+    };
+    auto decimal = [&](uint8_t m, bool subtract, uint16_t last)
+    {
+        uint8_t extra = decimal_arithmetic(m, subtract);
+        if constexpr (Accuracy::cycle_exact)
+            if (extra)
+                bus->read(last);
+        cyc += extra;
+    };
+    auto store = [&](uint8_t v)
+    {
+        bus->write(address<Accuracy, M, false>(src, cyc), v);
+    };
+
+    // Read-modify-write: on the accumulator in implied mode, else on memory
+    auto modify = [&](auto op)
+    {
+        if constexpr (M == AM::IMP)
+        {
+            idle();
+            a = op(a);
+        }
+        else
+        {
+            uint16_t ea = address<Accuracy, M, false>(src, cyc);
+            uint8_t m = bus->read(ea);
+            if constexpr (Accuracy::cycle_exact)
+                bus->write(ea, m);
+            bus->write(ea, op(m));
+        }
+    };
+
+    // N, Z, C and V are only stored here, see R6502::STATUS
+    auto set_nz = [&](uint8_t v)
+    {
+        status.nz = v;
+    };
+    auto push = [&](uint8_t v)
+    {
+        bus->write(0x0100 + stkp, v);
+        stkp--;
+    };
+    auto pop = [&]() -> uint8_t
+    {
+        stkp++;
+        return bus->read(0x0100 + stkp);
+    };
+    auto cmp = [&](uint8_t r, uint8_t m)
+    {
+        status.c = r >= m;
+        set_nz((uint8_t)(r - m));
+    };
+    auto branch = [&](bool taken)
+    {
+        uint16_t rel = src.byte();
+        if (rel & 0x80)
+            rel |= 0xFF00;
+        if (taken)
+        {
+            cyc++;
+            idle();
+            uint16_t target = pc + rel;
+            if ((target & 0xFF00) != (pc & 0xFF00))
+            {
+                cyc++;
+                if constexpr (Accuracy::cycle_exact)
+                    bus->read((pc & 0xFF00) | (target & 0x00FF));
+            }
+            pc = target;
+        }
+    };
+
+    // Arithmetic and logic. ADC and SBC test D each time rather than have
+    // decimal kernels of their own: the branch is all but always predicted,
+    // and costs nothing measurable even in a loop of nothing else
+    if constexpr (O == OP::ADC)
+    {
+        uint16_t last;
+        uint8_t m = load_from(last);
+        if (status.other & D)
+        {
+            decimal(m, false, last);
+            return;
+        }
+        uint16_t t = (uint16_t)a + (uint16_t)m + (uint16_t)status.c;
+        status.c = t > 255;
+        status.v = ((~((uint16_t)a ^ (uint16_t)m) & ((uint16_t)a ^ t)) & 0x0080) != 0;
+        a = t & 0x00FF;
+        set_nz(a);
+    }
+    else if constexpr (O == OP::SBC)
+    {
+        uint16_t last;
+        uint8_t m = load_from(last);
+        if (status.other & D)
+        {
+            decimal(m, true, last);
+            return;
+        }
+        uint16_t value = ((uint16_t)m) ^ 0x00FF;
+        uint16_t t = (uint16_t)a + value + (uint16_t)status.c;
+        status.c = (t & 0xFF00) != 0;
+        status.v = ((t ^ (uint16_t)a) & (t ^ value) & 0x0080) != 0;
+        a = t & 0x00FF;
+        set_nz(a);
+    }
+    else if constexpr (O == OP::AND) { a &= load(); set_nz(a); }
+    else if constexpr (O == OP::EOR) { a ^= load(); set_nz(a); }
+    else if constexpr (O == OP::ORA) { a |= load(); set_nz(a); }
+    else if constexpr (O == OP::CMP) cmp(a, load());
+    else if constexpr (O == OP::CPX) cmp(x, load());
+    else if constexpr (O == OP::CPY) cmp(y, load());
+    else if constexpr (O == OP::BIT)
+    {
+        uint8_t m = load();
+        status.nz = (a & m) | ((m & N) << 8);
+        status.v = (m >> 6) & 0x01;
+    }
+
+    // Shifts, rotates, increments and decrements
+    else if constexpr (O == OP::ASL)
+        modify([&](uint8_t m) -> uint8_t { status.c = m >> 7; m <<= 1; set_nz(m); return m; });
+    else if constexpr (O == OP::LSR)
+        modify([&](uint8_t m) -> uint8_t { status.c = m & 0x01; m >>= 1; set_nz(m); return m; });
+    else if constexpr (O == OP::ROL)
+        modify([&](uint8_t m) -> uint8_t
+        {
+            uint8_t r = (uint8_t)(m << 1) | status.c;
+            status.c = m >> 7;
+            set_nz(r);
+            return r;
+        });
+    else if constexpr (O == OP::ROR)
+        modify([&](uint8_t m) -> uint8_t
+        {
+            uint8_t r = (uint8_t)(status.c << 7) | (m >> 1);
+            status.c = m & 0x01;
+            set_nz(r);
+            return r;
+        });
+    else if constexpr (O == OP::INC)
+        modify([&](uint8_t m) -> uint8_t { m++; set_nz(m); return m; });
+    else if constexpr (O == OP::DEC)
+        modify([&](uint8_t m) -> uint8_t { m--; set_nz(m); return m; });
+    else if constexpr (O == OP::INX) { idle(); x++; set_nz(x); }
+    else if constexpr (O == OP::INY) { idle(); y++; set_nz(y); }
+    else if constexpr (O == OP::DEX) { idle(); x--; set_nz(x); }
+    else if constexpr (O == OP::DEY) { idle(); y--; set_nz(y); }
+
+    // Loads, stores and transfers
+    else if constexpr (O == OP::LDA) { a = load(); set_nz(a); }
+    else if constexpr (O == OP::LDX) { x = load(); set_nz(x); }
+    else if constexpr (O == OP::LDY) { y = load(); set_nz(y); }
+    else if constexpr (O == OP::STA) store(a);
+    else if constexpr (O == OP::STX) store(x);
+    else if constexpr (O == OP::STY) store(y);
+    else if constexpr (O == OP::TAX) { idle(); x = a; set_nz(x); }
+    else if constexpr (O == OP::TAY) { idle(); y = a; set_nz(y); }
+    else if constexpr (O == OP::TSX) { idle(); x = stkp; set_nz(x); }
+    else if constexpr (O == OP::TXA) { idle(); a = x; set_nz(a); }
+    else if constexpr (O == OP::TXS) { idle(); stkp = x; }
+    else if constexpr (O == OP::TYA) { idle(); a = y; set_nz(a); }
+
+    // Branches
+    else if constexpr (O == OP::BCC) branch(!status.c);
+    else if constexpr (O == OP::BCS) branch(status.c);
+    else if constexpr (O == OP::BEQ) branch(status.zero());
+    else if constexpr (O == OP::BMI) branch(status.negative());
+    else if constexpr (O == OP::BNE) branch(!status.zero());
+    else if constexpr (O == OP::BPL) branch(!status.negative());
+    else if constexpr (O == OP::BVC) branch(!status.v);
+    else if constexpr (O == OP::BVS) branch(status.v);
+
+    // Flag instructions
+    else if constexpr (O == OP::CLC) { idle(); status.c = 0; }
+    else if constexpr (O == OP::CLD) { idle(); status.other &= ~D; }
+    else if constexpr (O == OP::CLI) { idle(); status.other &= ~I; }
+    else if constexpr (O == OP::CLV) { idle(); status.v = 0; }
+    else if constexpr (O == OP::SEC) { idle(); status.c = 1; }
+    else if constexpr (O == OP::SED) { idle(); status.other |= D; }
+    else if constexpr (O == OP::SEI) { idle(); status.other |= I; }
+
+    // Stack
+    else if constexpr (O == OP::PHA) { idle(); push(a); }
+    else if constexpr (O == OP::PHP) { idle(); push(status | B | U); status.other &= ~B; }
+    else if constexpr (O == OP::PLA) { idle(); idle_stack(); a = pop(); set_nz(a); }
+    else if constexpr (O == OP::PLP) { idle(); idle_stack(); status = pop(); }
+
+    // Jumps, calls and interrupts
+    else if constexpr (O == OP::JMP) pc = address<Accuracy, M, false>(src, cyc);
+    else if constexpr (O == OP::JSR)
+    {
+        if constexpr (Accuracy::cycle_exact)
+        {
+            // The return address is pushed between fetching the two bytes of
+            // the target, after a read of the top of the stack
+            uint16_t lo = src.byte();
+            idle_stack();
+            push((pc >> 8) & 0x00FF);
+            push(pc & 0x00FF);
+            pc = ((uint16_t)src.byte() << 8) | lo;
+        }
+        else
+        {
+            uint16_t ea = address<Accuracy, M, false>(src, cyc);
+            pc--;
+            push((pc >> 8) & 0x00FF);
+            push(pc & 0x00FF);
+            pc = ea;
+        }
+    }
+    else if constexpr (O == OP::RTS)
+    {
+        idle();
+        idle_stack();
+        pc = (uint16_t)pop();
+        pc |= (uint16_t)pop() << 8;
+        idle();
+        pc++;
+    }
+    else if constexpr (O == OP::RTI)
+    {
+        idle();
+        idle_stack();
+        status = pop() & ~B;
+        pc = (uint16_t)pop();
+        pc |= (uint16_t)pop() << 8;
+    }
+    else if constexpr (O == OP::BRK)
+    {
+        // The legacy engine decodes it as immediate and then skips another byte
+        src.byte();
+        pc++;
+        status.other |= I;
+        push((pc >> 8) & 0x00FF);
+        push(pc & 0x00FF);
+        push(status | B);
+        status.other &= ~B;
+        pc = (uint16_t)bus->read(0xFFFE) | ((uint16_t)bus->read(0xFFFF) << 8);
+    }
+
+    // NOP and every other unofficial opcode. The lookup table decodes these as
+    // single byte implied instructions, so only their cycle count matters.
+    else
+    {
+        static_assert(O == OP::NOP || O == OP::XXX, "operation without a kernel");
+        if constexpr (Accuracy::cycle_exact)
+            for (uint8_t i = 1; i < cyc; i++)
+                idle();
+    }
+}
+
+/**
+ * @brief Execute one complete instruction using the inlined interpreter. The
+ * opcode and its operand bytes come from "src", everything else (indirect
+ * pointers, data, the stack) is accessed through the bus.
+ *
+ * @param src operand source, BusOperands or DecodedOperands
+ * @return uint8_t number of clock cycles the instruction takes, including
+ * page crossing and branch penalties
+ */
+template <class Accuracy, class Operands>
+inline uint8_t R6502::interpret(Operands &src)
+{
+    uint8_t cyc = 0;
+
+    opcode = src.opcode();
+
+    // One case per opcode, generated from the opcode table: the base cycles
+    // followed by the kernel instantiated for its operation and addressing mode
+    switch (opcode)
+    {
+    #define R6502_KERNEL_CASE(code, name, op, mode, base) \
+        case code: cyc = base; kernel<Accuracy, OPERATION::op, ADDRMODE::mode>(src, cyc); break;
+    R6502_OPCODE_TABLE(R6502_KERNEL_CASE)
+    #undef R6502_KERNEL_CASE
+    }
+
+    // U always reads as 1 (see R6502::STATUS), so unlike the lookup engine
+    // there is no need to set it again here
+    return cyc;
+}
@@ -0,0 +1,1233 @@
+#include "config.h"
+
+#include "R6502Execute.h"
+
+#include <cstddef>
+#include <cstring>
+#include <vector>
+
+// The JIT execution engine: the CACHED engine, plus a dynamic recompiler that
+// translates blocks which have run JIT_THRESHOLD times into native x86-64 code.
+//
+// Compiled code keeps A, X, Y and P in host registers and accesses RAM directly
+// through Bus::ram.data(). Anything it cannot do on its own is left to the
+// interpreter:
+//   - BRK and RTI, and accesses to pages the bus does not map to the same page
+//     of Bus::ram (ROM, I/O, banked memory), end the compiled part of a block.
+//     For addresses only known at run time the code checks the page and exits
+//     before the instruction instead. Compiled code is dropped when a change to
+//     the memory map changes which pages those are.
+//   - A store into a page holding decoded code exits right after the storing
+//     instruction, so the cache can drop the blocks it hit (R6502::notify_write).
+//   - Interrupts are only ever raised by the host between run() calls, which
+//     always return on an instruction boundary.
+//   - ADC and SBC are compiled as binary arithmetic. Compiled code is only
+//     entered with the D flag clear (or decimal mode off), and SED and PLP,
+//     which could set it, end the compiled part of a block like BRK and RTI.
+// After an exit the interpreter carries on with the rest of the block from the
+// instruction the native code stopped at. When a block runs to its end the code
+// jumps straight into the compiled code of the next block if there is one.
+//
+// A compiled block is only entered if all of its instructions but the last are
+// guaranteed to start within the cycle budget, so run() stops on exactly the
+// same instruction as with the interpreters. A block ending in a branch back to
+// its own start loops inside the native code while that still holds.
+//
+// On hosts other than x86-64 Linux the engine runs as CACHED.
+
+#if defined(__x86_64__) && defined(__linux__)
+#define R6502_JIT_NATIVE 1
+#include <sys/mman.h>
+#include <unistd.h>
+#else
+#define R6502_JIT_NATIVE 0
+#endif
+
+#if R6502_JIT_NATIVE
+
+// Number of times a block is interpreted before it is compiled
+static constexpr uint8_t JIT_THRESHOLD = 8;
+
+// Size of the native code buffer. When it is full all compiled code is dropped
+static constexpr size_t JIT_BUFFER_SIZE = 4 << 20;
+
+// The buffer is never writable and executable at once: it is executable only,
+// and compile_block makes the pages it copies code into writable for the copy
+static bool jit_protect(uint8_t *code, size_t from, size_t to, int prot)
+{
+    static const size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    from &= ~(page - 1);
+    to = (to + page - 1) & ~(page - 1);
+    return mprotect(code + from, to - from, prot) == 0;
+}
+
+struct R6502::JIT_BUFFER
+{
+    uint8_t *code = nullptr;
+    size_t used = 0;
+
+    // Non zero for pages the compiled code must leave to the bus, as of
+    // Bus::map_version map_version
+    uint8_t io_pages[256] = {};
+    bool any_io_page = false;
+    uint32_t map_version = 0;
+
+    // Dirty tracking the code was compiled for, its stores mark the bitmaps too
+    Bus::DIRTY dirty = Bus::DIRTY_OFF;
+};
+
+// State passed between the run loop and the compiled code
+struct JIT_CONTEXT
+{
+    uint8_t *ram;
+    const uint16_t *code_pages;
+    const uint8_t *io_pages;
+    uint64_t *dirty_pages; // Bus::dirty_pages and dirty_lines
+    uint64_t *dirty_lines;
+    const uint8_t *blocks; // R6502::blocks.data(), for chaining
+    uint32_t limit;   // Blocks are entered while cycles + native_max stays below this
+    uint32_t cycles;  // Cycles used
+    uint32_t retired; // Instructions executed
+    uint32_t written; // 0x10000 | address of a store into decoded code, or 0
+    uint16_t pc;
+    uint16_t start;   // Start of the block the code left part way through
+    uint8_t index;    // Its index of the next instruction, or JIT_BLOCK_DONE
+    uint8_t a, x, y, stkp, status;
+};
+
+// Index left in the context when the code ran to the end of a block
+static constexpr uint8_t JIT_BLOCK_DONE = 0xFF;
+
+typedef void (*JIT_FUNCTION)(JIT_CONTEXT *ctx);
+
+
+//////////////////////////////// X86-64 EMITTER ////////////////////////////////
+
+enum REG { RAX, RCX, RDX, RBX, RSP, RBP, RSI, RDI, R8, R9, R10, R11, R12, R13, R14, R15 };
+
+// Condition codes for jcc/setcc
+enum CC { CC_B = 0x2, CC_AE = 0x3, CC_E = 0x4, CC_NE = 0x5 };
+
+// Opcode extensions of the group 1 (83/81), shift (C1) and unary (F7) instructions
+enum EXT { X_ADD = 0, X_OR = 1, X_AND = 4, X_SUB = 5, X_XOR = 6, X_CMP = 7, X_ROL = 0, X_ROR = 1, X_SHL = 4, X_SHR = 5, X_NOT = 2 };
+
+// Register to register opcodes (op r/m32, r32)
+enum RR { ADD_RR = 0x01, OR_RR = 0x09, AND_RR = 0x21, SUB_RR = 0x29, XOR_RR = 0x31, CMP_RR = 0x39, TEST_RR = 0x85, MOV_RR = 0x89 };
+
+struct EMITTER
+{
+    std::vector<uint8_t> code;
+
+    size_t size() const { return code.size(); }
+    void byte(uint8_t b) { code.push_back(b); }
+    void dword(uint32_t d)
+    {
+        for (int i = 0; i < 4; i++)
+            byte((uint8_t)(d >> (i * 8)));
+    }
+
+    void rex(bool w, int r, int x, int b, bool force = false)
+    {
+        uint8_t v = 0x40 | (w ? 8 : 0) | ((r & 8) ? 4 : 0) | ((x & 8) ? 2 : 0) | ((b & 8) ? 1 : 0);
+        if (v != 0x40 || force)
+            byte(v);
+    }
+
+    // op dst, src (32 bit)
+    void rr(uint8_t op, int dst, int src)
+    {
+        rex(false, src, 0, dst);
+        byte(op);
+        byte(0xC0 | (src & 7) << 3 | (dst & 7));
+    }
+
+    // Group 1 operation with an immediate: op dst, imm (32 bit)
+    void ri(uint8_t ext, int dst, int32_t imm)
+    {
+        rex(false, 0, 0, dst);
+        bool imm8 = imm >= -128 && imm <= 127;
+        byte(imm8 ? 0x83 : 0x81);
+        byte(0xC0 | ext << 3 | (dst & 7));
+        if (imm8)
+            byte((uint8_t)imm);
+        else
+            dword((uint32_t)imm);
+    }
+
+    void mov64(int dst, int src)
+    {
+        rex(true, src, 0, dst);
+        byte(0x89);
+        byte(0xC0 | (src & 7) << 3 | (dst & 7));
+    }
+
+    void mov_ri(int dst, uint32_t imm)
+    {
+        rex(false, 0, 0, dst);
+        byte(0xB8 | (dst & 7));
+        dword(imm);
+    }
+
+    void test_ri(int dst, uint32_t imm)
+    {
+        rex(false, 0, 0, dst);
+        byte(0xF7);
+        byte(0xC0 | (dst & 7));
+        dword(imm);
+    }
+
+    void shift(uint8_t ext, int dst, uint8_t n)
+    {
+        rex(false, 0, 0, dst);
+        byte(0xC1);
+        byte(0xC0 | ext << 3 | (dst & 7));
+        byte(n);
+    }
+
+    // bts dst, bit (64 bit, bit taken modulo 64)
+    void bts64(int dst, int bit)
+    {
+        rex(true, bit, 0, dst);
+        byte(0x0F);
+        byte(0xAB);
+        byte(0xC0 | (bit & 7) << 3 | (dst & 7));
+    }
+
+    void unary(uint8_t ext, int dst)
+    {
+        rex(false, 0, 0, dst);
+        byte(0xF7);
+        byte(0xC0 | ext << 3 | (dst & 7));
+    }
+
+    // movzx dst, src8 / src16
+    void movzx8(int dst, int src)
+    {
+        rex(false, dst, 0, src, src >= RSP && src <= RDI);
+        byte(0x0F);
+        byte(0xB6);
+        byte(0xC0 | (dst & 7) << 3 | (src & 7));
+    }
+
+    void movzx16(int dst, int src)
+    {
+        rex(false, dst, 0, src);
+        byte(0x0F);
+        byte(0xB7);
+        byte(0xC0 | (dst & 7) << 3 | (src & 7));
+    }
+
+    // setcc dst8, only used with RAX..RBX
+    void setcc(uint8_t cc, int dst)
+    {
+        byte(0x0F);
+        byte(0x90 | cc);
+        byte(0xC0 | (dst & 7));
+    }
+
+    // An instruction with a register (or opcode extension) and a
+    // [base + index * (1 << scale) + disp] memory operand
+    void mem(uint8_t prefix, uint16_t opcode, int reg, int base, int index, uint8_t scale, int32_t disp,
+             bool w = false, bool byte_reg = false)
+    {
+        if (prefix)
+            byte(prefix);
+        rex(w, reg, index < 0 ? 0 : index, base, byte_reg && reg >= RSP && reg <= RDI);
+        if (opcode > 0xFF)
+            byte(opcode >> 8);
+        byte(opcode & 0xFF);
+
+        uint8_t mod = (disp == 0 && (base & 7) != RBP) ? 0 : (disp >= -128 && disp <= 127) ? 1 : 2;
+        if (index < 0 && (base & 7) != RSP)
+            byte(mod << 6 | (reg & 7) << 3 | (base & 7));
+        else
+        {
+            byte(mod << 6 | (reg & 7) << 3 | 4);
+            byte(scale << 6 | ((index < 0 ? RSP : index) & 7) << 3 | (base & 7));
+        }
+        if (mod == 1)
+            byte((uint8_t)disp);
+        else if (mod == 2)
+            dword((uint32_t)disp);
+    }
+
+    void push(int r)
+    {
+        rex(false, 0, 0, r);
+        byte(0x50 | (r & 7));
+    }
+
+    void pop(int r)
+    {
+        rex(false, 0, 0, r);
+        byte(0x58 | (r & 7));
+    }
+
+    // Forward jumps return the position to patch with bind()
+    size_t jcc(uint8_t cc)
+    {
+        byte(0x0F);
+        byte(0x80 | cc);
+        dword(0);
+        return size();
+    }
+
+    size_t jmp()
+    {
+        byte(0xE9);
+        dword(0);
+        return size();
+    }
+
+    void bind(size_t fixup, size_t target)
+    {
+        int32_t rel = (int32_t)(target - fixup);
+        std::memcpy(&code[fixup - 4], &rel, 4);
+    }
+
+    void jcc_back(uint8_t cc, size_t target)
+    {
+        bind(jcc(cc), target);
+    }
+};
+
+// Register assignment of the compiled code
+static constexpr int CTX = RBX;    // JIT_CONTEXT *
+static constexpr int RAM = R12;    // Bus::ram.data()
+static constexpr int PAGES = R11;  // code_pages
+static constexpr int IO = RSI;     // io_pages
+static constexpr int REG_A = R13;
+static constexpr int REG_X = R14;
+static constexpr int REG_Y = R15;
+static constexpr int REG_P = RBP;
+static constexpr int CYCLES = R10; // Cycles used, those of the current block are added on leaving it
+static constexpr int RETIRED = R9; // Instructions executed, counted the same way
+
+#define CTX_FIELD(field) ((int32_t)offsetof(JIT_CONTEXT, field))
+
+
+/**
+ * @brief Returns true if the compiled code can execute the instruction itself,
+ * i.e. it is not BRK or RTI and every page it is known to touch at compile time
+ * is plain RAM
+ */
+static bool jit_supported(uint8_t opcode, uint16_t operand, const uint8_t *io_pages)
+{
+    auto direct_page = [&](uint8_t page) { return !io_pages[page]; };
+
+    using M = R6502::ADDRMODE;
+    using O = R6502::OPERATION;
+    O op = (O)R6502::lookup[opcode].operate;
+    M mode = (M)R6502::lookup[opcode].addrmode;
+
+    // Compiled ADC and SBC are binary only. Native code is only entered with D
+    // clear, so the instructions that can set it are left to the interpreter
+    if (op == O::BRK || op == O::RTI || op == O::SED || op == O::PLP)
+        return false;
+
+    switch (op)
+    {
+    case O::PHA: case O::PHP: case O::PLA: case O::PLP:
+    case O::JSR: case O::RTS:
+        if (!direct_page(0x01))
+            return false;
+        break;
+    default:
+        break;
+    }
+
+    switch (mode)
+    {
+    case M::ZP0: case M::ZPX: case M::ZPY: case M::IZX: case M::IZY:
+        return direct_page(0x00);
+    case M::ABS:
+        return op == O::JMP || op == O::JSR || direct_page(operand >> 8);
+    case M::IND:
+        return direct_page(operand >> 8);
+    default:
+        return true;
+    }
+}
+
+/**
+ * @brief Translates the longest supported prefix of a block to native code
+ *
+ * @param block decoded block to compile
+ * @return true if native code was produced
+ */
+#if defined(__GNUC__)
+__attribute__((noinline)) // Keeps the compiler out of the flattened run loop
+#endif
+bool R6502::compile_block(BLOCK &block)
+{
+    if (!jit->code)
+        return false;
+    uint8_t n = 0;
+    while (n < block.count && jit_supported(block.ops[n].opcode, block.ops[n].operand, jit->io_pages))
+        n++;
+    if (n == 0)
+        return false;
+
+    // Static cycle count of the first i instructions, and the worst case
+    // cycles of all but the last compiled instruction
+    uint16_t static_cycles[BLOCK::MAX_OPS + 1] = {0};
+    uint16_t native_max = 0;
+    for (uint8_t i = 0; i < n; i++)
+    {
+        const INSTRUCTION &ins = lookup[block.ops[i].opcode];
+        static_cycles[i + 1] = static_cycles[i] + ins.cycles;
+        if (i + 1 < n)
+            native_max += ins.cycles + ins.page_cross;
+    }
+
+    EMITTER e;
+
+    // Exits taken from the middle of the code are emitted after the last instruction
+    struct EXIT
+    {
+        size_t fixup;
+        uint16_t pc;
+        uint8_t index;
+        uint16_t cycles;
+        uint8_t retired;
+        int32_t written; // -1: none, -2: address in ecx, else the constant address
+    };
+    std::vector<EXIT> exits;
+    std::vector<size_t> to_epilogue;
+    std::vector<size_t> to_chain;
+
+    auto store16 = [&](int32_t field, uint16_t value)
+    {
+        e.mem(0x66, 0xC7, 0, CTX, -1, 0, field);
+        e.byte(value & 0xFF);
+        e.byte(value >> 8);
+    };
+
+    // Leaves part way through the block, the interpreter resumes at instruction index
+    auto exit_stub = [&](uint16_t pc, uint8_t index, uint16_t cycles, uint8_t retired, int32_t written)
+    {
+        store16(CTX_FIELD(pc), pc);
+        store16(CTX_FIELD(start), block.start);
+        e.mem(0, 0xC6, 0, CTX, -1, 0, CTX_FIELD(index));
+        e.byte(index);
+        if (written == -2)
+        {
+            e.ri(X_OR, RCX, 0x10000);
+            e.mem(0, 0x89, RCX, CTX, -1, 0, CTX_FIELD(written));
+        }
+        else if (written >= 0)
+        {
+            e.mem(0, 0xC7, 0, CTX, -1, 0, CTX_FIELD(written));
+            e.dword(0x10000 | (uint32_t)written);
+        }
+        if (cycles)
+            e.ri(X_ADD, CYCLES, cycles);
+        if (retired)
+            e.ri(X_ADD, RETIRED, retired);
+        to_epilogue.push_back(e.jmp());
+    };
+
+    // Ends the block and continues at the program counter held in ecx
+    auto exit_dynamic = [&](uint16_t cycles, uint8_t retired)
+    {
+        if (cycles)
+            e.ri(X_ADD, CYCLES, cycles);
+        if (retired)
+            e.ri(X_ADD, RETIRED, retired);
+        to_chain.push_back(e.jmp());
+    };
+
+    auto exit_to = [&](uint16_t pc, uint16_t cycles, uint8_t retired)
+    {
+        e.mov_ri(RCX, pc);
+        exit_dynamic(cycles, retired);
+    };
+
+    ////////////////////////////////// PROLOGUE //////////////////////////////////
+
+    e.push(RBX); e.push(RBP); e.push(R12); e.push(R13); e.push(R14); e.push(R15);
+    e.mov64(CTX, RDI);
+    e.mem(0, 0x8B, RAM, CTX, -1, 0, CTX_FIELD(ram), true);
+    e.mem(0, 0x8B, PAGES, CTX, -1, 0, CTX_FIELD(code_pages), true);
+    e.mem(0, 0x8B, IO, CTX, -1, 0, CTX_FIELD(io_pages), true);
+    e.mem(0, 0x0FB6, REG_A, CTX, -1, 0, CTX_FIELD(a));
+    e.mem(0, 0x0FB6, REG_X, CTX, -1, 0, CTX_FIELD(x));
+    e.mem(0, 0x0FB6, REG_Y, CTX, -1, 0, CTX_FIELD(y));
+    e.mem(0, 0x0FB6, REG_P, CTX, -1, 0, CTX_FIELD(status));
+    e.ri(X_OR, REG_P, U);
+    e.rr(XOR_RR, CYCLES, CYCLES);
+    e.rr(XOR_RR, RETIRED, RETIRED);
+    // Chained blocks are entered here. The prologue is the same for every block,
+    // so this is at the same offset in all of them
+    size_t top = e.size();
+
+    ////////////////////////////////// HELPERS ///////////////////////////////////
+
+    // Address of instruction i
+    auto op_pc = [&](uint8_t i) -> uint16_t { return i ? block.ops[i - 1].next_pc : block.start; };
+
+    // N and Z from the 8 bit value in reg, r8 is clobbered
+    auto set_nz = [&](int reg)
+    {
+        e.ri(X_AND, REG_P, (uint8_t)~(N | Z));
+        e.rr(MOV_RR, R8, reg);
+        e.ri(X_AND, R8, N);
+        e.rr(OR_RR, REG_P, R8);
+        e.rr(TEST_RR, reg, reg);
+        e.byte(0x75); e.byte(0x03);                        // jnz over the next 3 bytes
+        e.ri(X_OR, REG_P, Z);
+    };
+
+    struct ADDRESS
+    {
+        bool constant;
+        uint16_t value;
+    };
+
+    // Leaves before instruction i if the address in ecx is on an I/O page
+    auto io_check = [&](uint8_t i)
+    {
+        if (!jit->any_io_page)
+            return;
+        e.rr(MOV_RR, RDX, RCX);
+        e.shift(X_SHR, RDX, 8);
+        e.mem(0, 0x80, X_CMP, IO, RDX, 0, 0);
+        e.byte(0);
+        exits.push_back({e.jcc(CC_NE), op_pc(i), i, static_cycles[i], i, -1});
+    };
+
+    // Effective address of instruction i. A dynamic address is left in ecx and
+    // checked against I/O pages; for indexed reads the page crossing penalty is
+    // added to the cycle count.
+    auto address = [&](uint8_t i, bool read) -> ADDRESS
+    {
+        const DECODED &d = block.ops[i];
+        const INSTRUCTION &ins = lookup[d.opcode];
+        bool penalty = read && ins.page_cross;
+        switch ((ADDRMODE)ins.addrmode)
+        {
+        case ADDRMODE::ZP0:
+            return {true, (uint16_t)(d.operand & 0xFF)};
+        case ADDRMODE::ABS:
+            return {true, d.operand};
+        case ADDRMODE::ZPX:
+        case ADDRMODE::ZPY:
+            e.mem(0, 0x8D, RCX, ins.addrmode == (uint8_t)ADDRMODE::ZPX ? REG_X : REG_Y, -1, 0, d.operand & 0xFF);
+            e.movzx8(RCX, RCX);
+            break;
+        case ADDRMODE::ABX:
+        case ADDRMODE::ABY:
+        {
+            int index = ins.addrmode == (uint8_t)ADDRMODE::ABX ? REG_X : REG_Y;
+            e.mem(0, 0x8D, RCX, index, -1, 0, d.operand);
+            e.movzx16(RCX, RCX);
+            if (penalty)
+            {
+                e.mem(0, 0x8D, R8, index, -1, 0, d.operand & 0xFF);
+                e.shift(X_SHR, R8, 8);
+            }
+            break;
+        }
+        case ADDRMODE::IZX:
+            e.mem(0, 0x8D, RDX, REG_X, -1, 0, d.operand & 0xFF);
+            e.movzx8(RDX, RDX);
+            e.mem(0, 0x0FB6, RCX, RAM, RDX, 0, 0);
+            e.ri(X_ADD, RDX, 1);
+            e.movzx8(RDX, RDX);
+            e.mem(0, 0x0FB6, RDX, RAM, RDX, 0, 0);
+            e.shift(X_SHL, RDX, 8);
+            e.rr(OR_RR, RCX, RDX);
+            break;
+        case ADDRMODE::IZY:
+            e.mem(0, 0x0FB6, RCX, RAM, -1, 0, d.operand & 0xFF);
+            e.mem(0, 0x0FB6, RDX, RAM, -1, 0, (d.operand + 1) & 0xFF);
+            e.shift(X_SHL, RDX, 8);
+            e.rr(OR_RR, RCX, RDX);
+            if (penalty)
+            {
+                e.movzx8(R8, RCX);
+                e.rr(ADD_RR, R8, REG_Y);
+                e.shift(X_SHR, R8, 8);
+            }
+            e.rr(ADD_RR, RCX, REG_Y);
+            e.movzx16(RCX, RCX);
+            break;
+        default:
+            break;
+        }
+        io_check(i);
+        if (penalty)
+            e.rr(ADD_RR, CYCLES, R8);
+        return {false, 0};
+    };
+
+    auto load = [&](int dst, ADDRESS ea)
+    {
+        if (ea.constant)
+            e.mem(0, 0x0FB6, dst, RAM, -1, 0, ea.value);
+        else
+            e.mem(0, 0x0FB6, dst, RAM, RCX, 0, 0);
+    };
+
+    // Sets the dirty bit of a constant address, or of the address in ecx (edx
+    // for the stack). Uses r8 and edx
+    auto mark_dirty = [&](ADDRESS ea, bool stack = false)
+    {
+        if (jit->dirty == Bus::DIRTY_OFF)
+            return;
+        for (int lines = 0; lines <= (jit->dirty == Bus::DIRTY_LINES); lines++)
+        {
+            uint8_t shift = lines ? 6 : 8;
+            e.mem(0, 0x8B, R8, CTX, -1, 0, lines ? CTX_FIELD(dirty_lines) : CTX_FIELD(dirty_pages), true);
+            if (ea.constant)
+            {
+                uint16_t bit = ea.value >> shift;
+                e.mem(0, 0x80, X_OR, R8, -1, 0, bit >> 3);   // or byte [r8 + bit / 8], imm
+                e.byte(1 << (bit & 7));
+                continue;
+            }
+            if (stack)
+            {
+                // Rare enough for bts with a memory operand, slow as it is
+                e.ri(X_ADD, RDX, 0x100);
+                e.shift(X_SHR, RDX, shift);
+                e.mem(0, 0x0FAB, RDX, R8, -1, 0, 0);   // bts [r8], edx
+                e.mem(0, 0x0FB6, RDX, CTX, -1, 0, CTX_FIELD(stkp));
+                continue;
+            }
+            // Set the bit in a register: ecx is rotated so its low 6 bits are
+            // the bit within the word, and rotated back
+            e.rr(MOV_RR, RDX, RCX);
+            e.shift(X_SHR, RDX, shift + 6);
+            e.mem(0, 0x8D, R8, R8, RDX, 3, 0, true);   // lea r8, [r8 + rdx * 8]
+            e.mem(0, 0x8B, RDX, R8, -1, 0, 0, true);
+            e.shift(X_ROR, RCX, shift);
+            e.bts64(RDX, RCX);
+            e.shift(X_ROL, RCX, shift);
+            e.mem(0, 0x89, RDX, R8, -1, 0, 0, true);
+        }
+    };
+
+    // Stores src and leaves after instruction i if the page holds decoded code
+    auto store = [&](int src, ADDRESS ea, uint8_t i)
+    {
+        const DECODED &d = block.ops[i];
+        mark_dirty(ea);
+        if (ea.constant)
+        {
+            e.mem(0, 0x88, src, RAM, -1, 0, ea.value, false, true);
+            e.mem(0x66, 0x83, X_CMP, PAGES, -1, 0, (ea.value >> 8) * 2);
+            e.byte(0);
+            exits.push_back({e.jcc(CC_NE), d.next_pc, (uint8_t)(i + 1), static_cycles[i + 1], (uint8_t)(i + 1), ea.value});
+        }
+        else
+        {
+            e.mem(0, 0x88, src, RAM, RCX, 0, 0, false, true);
+            e.rr(MOV_RR, RDX, RCX);
+            e.shift(X_SHR, RDX, 8);
+            e.mem(0x66, 0x83, X_CMP, PAGES, RDX, 1, 0);
+            e.byte(0);
+            exits.push_back({e.jcc(CC_NE), d.next_pc, (uint8_t)(i + 1), static_cycles[i + 1], (uint8_t)(i + 1), -2});
+        }
+    };
+
+    // The operand of a read instruction into eax
+    auto operand = [&](uint8_t i)
+    {
+        const DECODED &d = block.ops[i];
+        switch ((ADDRMODE)lookup[d.opcode].addrmode)
+        {
+        case ADDRMODE::IMP:
+            e.rr(MOV_RR, RAX, REG_A);
+            break;
+        case ADDRMODE::IMM:
+            e.mov_ri(RAX, d.operand & 0xFF);
+            break;
+        default:
+            load(RAX, address(i, true));
+            break;
+        }
+    };
+
+    // Stack pushes and pulls never leave page 1, leave before instruction i if
+    // it holds decoded code
+    auto stack_check = [&](uint8_t i)
+    {
+        e.mem(0x66, 0x83, X_CMP, PAGES, -1, 0, 0x01 * 2);
+        e.byte(0);
+        exits.push_back({e.jcc(CC_NE), op_pc(i), i, static_cycles[i], i, -1});
+    };
+
+    auto push = [&](int src)
+    {
+        e.mem(0, 0x0FB6, RDX, CTX, -1, 0, CTX_FIELD(stkp));
+        e.mem(0, 0x88, src, RAM, RDX, 0, 0x100, false, true);
+        if (jit->dirty == Bus::DIRTY_PAGES)
+            mark_dirty({true, 0x100});
+        else
+            mark_dirty({false, 0}, true);
+        e.mem(0, 0xFE, 1, CTX, -1, 0, CTX_FIELD(stkp));   // dec byte
+    };
+
+    auto pull = [&](int dst)
+    {
+        e.mem(0, 0xFE, 0, CTX, -1, 0, CTX_FIELD(stkp));   // inc byte
+        e.mem(0, 0x0FB6, RDX, CTX, -1, 0, CTX_FIELD(stkp));
+        e.mem(0, 0x0FB6, dst, RAM, RDX, 0, 0x100);
+    };
+
+    // Read-modify-write on A (implied) or memory
+    auto modify = [&](uint8_t i, auto &&op)
+    {
+        if (lookup[block.ops[i].opcode].addrmode == (uint8_t)ADDRMODE::IMP)
+        {
+            op(REG_A);
+            set_nz(REG_A);
+            return;
+        }
+        ADDRESS ea = address(i, false);
+        load(RAX, ea);
+        op(RAX);
+        set_nz(RAX);
+        store(RAX, ea, i);
+    };
+
+    auto adc = [&]()
+    {
+        e.rr(MOV_RR, RDX, REG_P);
+        e.ri(X_AND, RDX, C);
+        e.rr(ADD_RR, RDX, REG_A);
+        e.rr(ADD_RR, RDX, RAX);                             // edx = a + m + c
+        e.rr(MOV_RR, RCX, REG_A);
+        e.rr(XOR_RR, RCX, RAX);
+        e.unary(X_NOT, RCX);
+        e.rr(MOV_RR, R8, REG_A);
+        e.rr(XOR_RR, R8, RDX);
+        e.rr(AND_RR, RCX, R8);
+        e.ri(X_AND, RCX, 0x80);
+        e.shift(X_SHR, RCX, 1);                               // V
+        e.ri(X_AND, REG_P, (uint8_t)~(N | V | Z | C));
+        e.rr(OR_RR, REG_P, RCX);
+        e.rr(MOV_RR, RCX, RDX);
+        e.shift(X_SHR, RCX, 8);
+        e.rr(OR_RR, REG_P, RCX);                            // C
+        e.movzx8(REG_A, RDX);
+        set_nz(REG_A);
+    };
+
+    auto compare = [&](int reg)
+    {
+        e.rr(MOV_RR, RDX, reg);
+        e.rr(SUB_RR, RDX, RAX);
+        e.ri(X_AND, REG_P, (uint8_t)~(N | Z | C));
+        e.rr(XOR_RR, RCX, RCX);
+        e.rr(CMP_RR, reg, RAX);
+        e.setcc(CC_AE, RCX);
+        e.rr(OR_RR, REG_P, RCX);
+        e.movzx8(RDX, RDX);
+        set_nz(RDX);
+    };
+
+    auto flag = [&](uint8_t f, bool value)
+    {
+        if (value)
+            e.ri(X_OR, REG_P, f);
+        else
+            e.ri(X_AND, REG_P, (uint8_t)~f);
+    };
+
+    auto transfer = [&](int dst, int src)
+    {
+        e.rr(MOV_RR, dst, src);
+        set_nz(dst);
+    };
+
+    auto step = [&](int reg, uint8_t ext)
+    {
+        e.ri(ext, reg, 1);
+        e.movzx8(reg, reg);
+        set_nz(reg);
+    };
+
+    ///////////////////////////////// INSTRUCTIONS /////////////////////////////////
+
+    bool ended = false; // The last instruction already left the block
+    for (uint8_t i = 0; i < n; i++)
+    {
+        const DECODED &d = block.ops[i];
+        const INSTRUCTION &ins = lookup[d.opcode];
+        uint16_t end_cycles = static_cycles[i + 1];
+        uint8_t retired = i + 1;
+
+        switch ((OPERATION)ins.operate)
+        {
+        case OPERATION::LDA: operand(i); transfer(REG_A, RAX); break;
+        case OPERATION::LDX: operand(i); transfer(REG_X, RAX); break;
+        case OPERATION::LDY: operand(i); transfer(REG_Y, RAX); break;
+
+        case OPERATION::STA: { ADDRESS ea = address(i, false); store(REG_A, ea, i); break; }
+        case OPERATION::STX: { ADDRESS ea = address(i, false); store(REG_X, ea, i); break; }
+        case OPERATION::STY: { ADDRESS ea = address(i, false); store(REG_Y, ea, i); break; }
+
+        case OPERATION::ADC: operand(i); adc(); break;
+        case OPERATION::SBC: operand(i); e.ri(X_XOR, RAX, 0xFF); adc(); break;
+
+        case OPERATION::AND: operand(i); e.rr(AND_RR, REG_A, RAX); set_nz(REG_A); break;
+        case OPERATION::ORA: operand(i); e.rr(OR_RR, REG_A, RAX); set_nz(REG_A); break;
+        case OPERATION::EOR: operand(i); e.rr(XOR_RR, REG_A, RAX); set_nz(REG_A); break;
+
+        case OPERATION::CMP: operand(i); compare(REG_A); break;
+        case OPERATION::CPX: operand(i); compare(REG_X); break;
+        case OPERATION::CPY: operand(i); compare(REG_Y); break;
+
+        case OPERATION::BIT:
+            operand(i);
+            e.ri(X_AND, REG_P, (uint8_t)~(N | V | Z));
+            e.rr(MOV_RR, RDX, RAX);
+            e.ri(X_AND, RDX, N | V);
+            e.rr(OR_RR, REG_P, RDX);
+            e.rr(TEST_RR, REG_A, RAX);
+            e.byte(0x75); e.byte(0x03);
+            e.ri(X_OR, REG_P, Z);
+            break;
+
+        case OPERATION::INC: modify(i, [&](int r) { e.ri(X_ADD, r, 1); e.movzx8(r, r); }); break;
+        case OPERATION::DEC: modify(i, [&](int r) { e.ri(X_SUB, r, 1); e.movzx8(r, r); }); break;
+
+        case OPERATION::ASL:
+            modify(i, [&](int r) {
+                e.ri(X_AND, REG_P, (uint8_t)~(N | Z | C));
+                e.rr(MOV_RR, RDX, r);
+                e.shift(X_SHR, RDX, 7);
+                e.rr(OR_RR, REG_P, RDX);
+                e.shift(X_SHL, r, 1);
+                e.movzx8(r, r);
+            });
+            break;
+        case OPERATION::LSR:
+            modify(i, [&](int r) {
+                e.ri(X_AND, REG_P, (uint8_t)~(N | Z | C));
+                e.rr(MOV_RR, RDX, r);
+                e.ri(X_AND, RDX, 1);
+                e.rr(OR_RR, REG_P, RDX);
+                e.shift(X_SHR, r, 1);
+            });
+            break;
+        case OPERATION::ROL:
+            modify(i, [&](int r) {
+                e.rr(MOV_RR, RDX, REG_P);
+                e.ri(X_AND, RDX, C);
+                e.ri(X_AND, REG_P, (uint8_t)~(N | Z | C));
+                e.shift(X_SHL, r, 1);
+                e.rr(OR_RR, r, RDX);
+                e.rr(MOV_RR, RDX, r);
+                e.shift(X_SHR, RDX, 8);
+                e.rr(OR_RR, REG_P, RDX);
+                e.movzx8(r, r);
+            });
+            break;
+        case OPERATION::ROR:
+            modify(i, [&](int r) {
+                e.rr(MOV_RR, RDX, REG_P);
+                e.ri(X_AND, RDX, C);
+                e.shift(X_SHL, RDX, 7);
+                e.ri(X_AND, REG_P, (uint8_t)~(N | Z | C));
+                e.rr(MOV_RR, R8, r);
+                e.ri(X_AND, R8, 1);
+                e.rr(OR_RR, REG_P, R8);
+                e.shift(X_SHR, r, 1);
+                e.rr(OR_RR, r, RDX);
+            });
+            break;
+
+        case OPERATION::INX: step(REG_X, X_ADD); break;
+        case OPERATION::INY: step(REG_Y, X_ADD); break;
+        case OPERATION::DEX: step(REG_X, X_SUB); break;
+        case OPERATION::DEY: step(REG_Y, X_SUB); break;
+
+        case OPERATION::TAX: transfer(REG_X, REG_A); break;
+        case OPERATION::TAY: transfer(REG_Y, REG_A); break;
+        case OPERATION::TXA: transfer(REG_A, REG_X); break;
+        case OPERATION::TYA: transfer(REG_A, REG_Y); break;
+        case OPERATION::TSX:
+            e.mem(0, 0x0FB6, REG_X, CTX, -1, 0, CTX_FIELD(stkp));
+            set_nz(REG_X);
+            break;
+        case OPERATION::TXS:
+            e.mem(0, 0x88, REG_X, CTX, -1, 0, CTX_FIELD(stkp), false, true);
+            break;
+
+        case OPERATION::CLC: flag(C, false); break;
+        case OPERATION::SEC: flag(C, true);  break;
+        case OPERATION::CLI: flag(I, false); break;
+        case OPERATION::SEI: flag(I, true);  break;
+        case OPERATION::CLD: flag(D, false); break;
+        case OPERATION::CLV: flag(V, false); break;
+
+        case OPERATION::PHA:
+            stack_check(i);
+            push(REG_A);
+            break;
+        case OPERATION::PHP:
+            // Pushed with B and U set, B is clear afterwards (U is always set)
+            stack_check(i);
+            e.rr(MOV_RR, RAX, REG_P);
+            e.ri(X_OR, RAX, B | U);
+            push(RAX);
+            e.ri(X_AND, REG_P, (uint8_t)~B);
+            break;
+        case OPERATION::PLA:
+            pull(RAX);
+            transfer(REG_A, RAX);
+            break;
+
+        case OPERATION::JSR:
+        {
+            uint16_t ret = d.next_pc - 1;
+            stack_check(i);
+            e.mov_ri(RAX, ret >> 8);
+            push(RAX);
+            e.mov_ri(RAX, ret & 0xFF);
+            push(RAX);
+            exit_to(d.operand, end_cycles, retired);
+            ended = true;
+            break;
+        }
+        case OPERATION::RTS:
+            pull(RAX);
+            pull(RCX);
+            e.shift(X_SHL, RCX, 8);
+            e.rr(OR_RR, RCX, RAX);
+            e.ri(X_ADD, RCX, 1);
+            e.movzx16(RCX, RCX);
+            exit_dynamic(end_cycles, retired);
+            ended = true;
+            break;
+
+        case OPERATION::JMP:
+            if (ins.addrmode == (uint8_t)ADDRMODE::ABS)
+                exit_to(d.operand, end_cycles, retired);
+            else
+            {
+                // The page boundary bug: the high byte never comes from the next page
+                uint16_t lo = d.operand;
+                uint16_t hi = (d.operand & 0xFF00) | ((d.operand + 1) & 0x00FF);
+                e.mem(0, 0x0FB6, RCX, RAM, -1, 0, lo);
+                e.mem(0, 0x0FB6, RDX, RAM, -1, 0, hi);
+                e.shift(X_SHL, RDX, 8);
+                e.rr(OR_RR, RCX, RDX);
+                exit_dynamic(end_cycles, retired);
+            }
+            ended = true;
+            break;
+
+        case OPERATION::BCC: case OPERATION::BCS: case OPERATION::BEQ: case OPERATION::BNE:
+        case OPERATION::BMI: case OPERATION::BPL: case OPERATION::BVC: case OPERATION::BVS:
+        {
+            uint8_t mask = 0;
+            bool set = false;
+            switch ((OPERATION)ins.operate)
+            {
+            case OPERATION::BCC: mask = C; set = false; break;
+            case OPERATION::BCS: mask = C; set = true;  break;
+            case OPERATION::BEQ: mask = Z; set = true;  break;
+            case OPERATION::BNE: mask = Z; set = false; break;
+            case OPERATION::BMI: mask = N; set = true;  break;
+            case OPERATION::BPL: mask = N; set = false; break;
+            case OPERATION::BVC: mask = V; set = false; break;
+            default:             mask = V; set = true;  break;
+            }
+
+            uint16_t rel = d.operand & 0xFF;
+            if (rel & 0x80)
+                rel |= 0xFF00;
+            uint16_t target = d.next_pc + rel;
+            uint16_t taken_cycles = end_cycles + 1 + ((target & 0xFF00) != (d.next_pc & 0xFF00));
+
+            e.test_ri(REG_P, mask);
+            size_t taken = e.jcc(set ? CC_NE : CC_E);
+            exit_to(d.next_pc, end_cycles, retired);
+            e.bind(taken, e.size());
+
+            if (target == block.start && n == block.count)
+            {
+                // Loop while the next pass is sure to start within the budget
+                e.ri(X_ADD, CYCLES, taken_cycles);
+                e.ri(X_ADD, RETIRED, retired);
+                e.mem(0, 0x8D, RDX, CYCLES, -1, 0, native_max);
+                e.mem(0, 0x3B, RDX, CTX, -1, 0, CTX_FIELD(limit));
+                e.jcc_back(CC_B, top);
+                exit_to(block.start, 0, 0);
+            }
+            else
+                exit_to(target, taken_cycles, retired);
+            ended = true;
+            break;
+        }
+
+        default:
+            // NOP and the unofficial opcodes only take their cycles
+            break;
+        }
+    }
+
+    // The compiled prefix ended before the end of the block
+    if (!ended)
+        exit_stub(block.ops[n - 1].next_pc, n, static_cycles[n], n, -1);
+
+    for (const EXIT &x : exits)
+    {
+        e.bind(x.fixup, e.size());
+        exit_stub(x.pc, x.index, x.cycles, x.retired, x.written);
+    }
+
+    /////////////////////////////////// CHAINING ///////////////////////////////////
+
+    // With the next pc in ecx, enter the compiled code of the block starting
+    // there if it exists and is sure to start its last instruction within the budget
+    for (size_t fixup : to_chain)
+        e.bind(fixup, e.size());
+    std::vector<size_t> no_chain;
+    e.rr(MOV_RR, RDX, RCX);
+    e.ri(X_AND, RDX, BLOCK_SLOTS - 1);
+    e.byte(0x69); e.byte(0xD2); e.dword(sizeof(BLOCK)); // imul edx, edx, sizeof(BLOCK)
+    e.mem(0, 0x03, RDX, CTX, -1, 0, CTX_FIELD(blocks), true);
+    e.mem(0, 0x80, X_CMP, RDX, -1, 0, offsetof(BLOCK, valid));
+    e.byte(0);
+    no_chain.push_back(e.jcc(CC_E));
+    e.mem(0x66, 0x39, RCX, RDX, -1, 0, offsetof(BLOCK, start));
+    no_chain.push_back(e.jcc(CC_NE));
+    e.mem(0, 0x8B, RAX, RDX, -1, 0, offsetof(BLOCK, native), true);
+    e.rex(true, RAX, 0, RAX); e.byte(TEST_RR); e.byte(0xC0);  // test rax, rax
+    no_chain.push_back(e.jcc(CC_E));
+    e.mem(0, 0x0FB7, R8, RDX, -1, 0, offsetof(BLOCK, native_max));
+    e.rr(ADD_RR, R8, CYCLES);
+    e.mem(0, 0x3B, R8, CTX, -1, 0, CTX_FIELD(limit));
+    no_chain.push_back(e.jcc(CC_AE));
+    e.rex(true, 0, 0, RAX); e.byte(0x05); e.dword((uint32_t)top); // add rax, top
+    e.byte(0xFF); e.byte(0xE0);                                 // jmp rax
+
+    for (size_t fixup : no_chain)
+        e.bind(fixup, e.size());
+    e.mem(0x66, 0x89, RCX, CTX, -1, 0, CTX_FIELD(pc));
+    e.mem(0, 0xC6, 0, CTX, -1, 0, CTX_FIELD(index));
+    e.byte(JIT_BLOCK_DONE);
+
+    ////////////////////////////////// EPILOGUE //////////////////////////////////
+
+    for (size_t fixup : to_epilogue)
+        e.bind(fixup, e.size());
+    e.mem(0, 0x88, REG_A, CTX, -1, 0, CTX_FIELD(a), false, true);
+    e.mem(0, 0x88, REG_X, CTX, -1, 0, CTX_FIELD(x), false, true);
+    e.mem(0, 0x88, REG_Y, CTX, -1, 0, CTX_FIELD(y), false, true);
+    e.mem(0, 0x88, REG_P, CTX, -1, 0, CTX_FIELD(status), false, true);
+    e.mem(0, 0x89, CYCLES, CTX, -1, 0, CTX_FIELD(cycles));
+    e.mem(0, 0x89, RETIRED, CTX, -1, 0, CTX_FIELD(retired));
+    e.pop(R15); e.pop(R14); e.pop(R13); e.pop(R12); e.pop(RBP); e.pop(RBX);
+    e.byte(0xC3);
+
+    // Start over with an empty buffer when it is full
+    size_t at = (jit->used + 15) & ~(size_t)15;
+    if (at + e.size() > JIT_BUFFER_SIZE)
+    {
+        for (auto &b : blocks)
+            b.native = nullptr;
+        at = 0;
+    }
+    // Without either protection change there is no compiled code at all,
+    // run_jit then runs as CACHED
+    if (!jit_protect(jit->code, at, at + e.size(), PROT_READ | PROT_WRITE))
+    {
+        release_code();
+        return false;
+    }
+    std::memcpy(jit->code + at, e.code.data(), e.size());
+    if (!jit_protect(jit->code, at, at + e.size(), PROT_READ | PROT_EXEC))
+    {
+        release_code();
+        return false;
+    }
+    jit->used = at + e.size();
+
+    block.native = jit->code + at;
+    block.native_max = native_max;
+    return true;
+}
+
+/**
+ * @brief Frees the native code buffer
+ */
+void R6502::release_jit()
+{
+    if (!jit)
+        return;
+    release_code();
+    delete jit;
+    jit = nullptr;
+}
+
+/**
+ * @brief Drops all compiled code and unmaps the buffer, leaving the JIT to run
+ * as CACHED
+ */
+void R6502::release_code()
+{
+    for (auto &b : blocks)
+        b.native = nullptr;
+    if (jit->code)
+        munmap(jit->code, JIT_BUFFER_SIZE);
+    jit->code = nullptr;
+}
+
+/**
+ * @brief Executes instructions until at least "budget" cycles have been used,
+ * running compiled code for hot blocks and the block cache interpreter for the
+ * rest. Falls back to the CACHED engine if no executable memory is available,
+ * e.g. where the system refuses to make memory executable after writing it.
+ *
+ * @param budget number of clock cycles to run for
+ * @return uint32_t number of cycles used
+ */
+#if defined(__GNUC__)
+__attribute__((flatten))
+#endif
+uint32_t R6502::run_jit(uint32_t budget)
+{
+    if (!jit)
+    {
+        jit = new JIT_BUFFER;
+        void *code = mmap(nullptr, JIT_BUFFER_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        jit->code = code == MAP_FAILED ? nullptr : (uint8_t *)code;
+        if (jit->code && !jit_protect(jit->code, 0, JIT_BUFFER_SIZE, PROT_READ | PROT_EXEC))
+            release_code();
+        jit->map_version = bus->map_version - 1;
+    }
+    if (!jit->code)
+        return run_cached(budget);
+
+    // Compiled code accesses the pages mapped to the same page of Bus::ram
+    // directly, whenever that set or the dirty tracking changes it has to be
+    // compiled again
+    if (jit->map_version != bus->map_version)
+    {
+        bool changed = jit->dirty != bus->dirty_tracking();
+        jit->dirty = bus->dirty_tracking();
+        jit->any_io_page = false;
+        for (uint16_t page = 0; page < 256; page++)
+        {
+            uint8_t io = !bus->ram_page((uint8_t)page);
+            changed |= io != jit->io_pages[page];
+            jit->io_pages[page] = io;
+            jit->any_io_page |= io != 0;
+        }
+        if (changed)
+        {
+            for (auto &b : blocks)
+            {
+                b.native = nullptr;
+                b.hits = 0;
+            }
+            jit->used = 0;
+        }
+        jit->map_version = bus->map_version;
+    }
+
+    if (blocks.empty())
+        blocks.resize(BLOCK_SLOTS);
+
+    uint32_t used = 0;
+    while (used < budget)
+    {
+        BLOCK *block = &blocks[pc % BLOCK_SLOTS];
+        if (!block->valid || block->start != pc)
+            block = &decode_block(pc);
+
+        if (block->count == 0)
+        {
+            BusOperands src{*this};
+            used += interpret<ACCURACY_FAST>(src);
+            instruction_count++;
+            continue;
+        }
+
+        if (!block->native && block->hits < JIT_THRESHOLD && ++block->hits == JIT_THRESHOLD)
+            compile_block(*block);
+
+        code_written = false;
+        uint8_t i = 0;
+        bool binary = !(status.other & D) || decimal == DECIMAL_OFF;
+        if (block->native && binary && used + block->native_max < budget)
+        {
+            JIT_CONTEXT ctx;
+            ctx.ram = bus->ram.data();
+            ctx.code_pages = code_pages;
+            ctx.io_pages = jit->io_pages;
+            ctx.dirty_pages = bus->dirty_pages.data();
+            ctx.dirty_lines = bus->dirty_lines.data();
+            ctx.blocks = (const uint8_t *)blocks.data();
+            ctx.limit = budget - used;
+            ctx.cycles = 0;
+            ctx.retired = 0;
+            ctx.written = 0;
+            ctx.pc = pc;
+            ctx.start = pc;
+            ctx.index = JIT_BLOCK_DONE;
+            ctx.a = a;
+            ctx.x = x;
+            ctx.y = y;
+            ctx.stkp = stkp;
+            ctx.status = status;
+
+            ((JIT_FUNCTION)block->native)(&ctx);
+
+            a = ctx.a;
+            x = ctx.x;
+            y = ctx.y;
+            stkp = ctx.stkp;
+            status = ctx.status;
+            pc = ctx.pc;
+            used += ctx.cycles;
+            instruction_count += ctx.retired;
+            if (ctx.written)
+                notify_write((uint16_t)ctx.written);
+
+            // Interpret whatever the compiled code left of the block it ended in
+            if (code_written || ctx.index == JIT_BLOCK_DONE)
+                continue;
+            block = &blocks[ctx.start % BLOCK_SLOTS];
+            i = ctx.index;
+        }
+
+        for (; i < block->count && used < budget; i++)
+        {
+            DecodedOperands src{*this, block->ops[i]};
+            used += interpret<ACCURACY_FAST>(src);
+            instruction_count++;
+            if (code_written)
+                break;
+        }
+    }
+    return used;
+}
+
+#else
+
+bool R6502::compile_block(BLOCK &)
+{
+    return false;
+}
+
+void R6502::release_jit()
+{
+}
+
+void R6502::release_code()
+{
+}
+
+uint32_t R6502::run_jit(uint32_t budget)
+{
+    return run_cached(budget);
+}
+
+#endif
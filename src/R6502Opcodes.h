@@ -0,0 +1,90 @@
+#pragma once
+
+// The 6502 instruction set as X-macro lists. Everything that needs to know
+// about opcodes (the compile time translation table, the disassembler and the
+// execution engines) is generated from these, so they can never disagree.
+
+// The 12 addressing modes
+#define R6502_ADDRMODE_LIST(MODE) \
+    MODE(IMP) MODE(IMM) MODE(ZP0) MODE(ZPX) MODE(ZPY) MODE(REL) \
+    MODE(ABS) MODE(ABX) MODE(ABY) MODE(IND) MODE(IZX) MODE(IZY)
+
+// The 56 legal operations, plus XXX which captures illegal opcodes
+#define R6502_OPERATION_LIST(OP) \
+    OP(ADC) OP(AND) OP(ASL) OP(BCC) OP(BCS) OP(BEQ) OP(BIT) OP(BMI) \
+    OP(BNE) OP(BPL) OP(BRK) OP(BVC) OP(BVS) OP(CLC) OP(CLD) OP(CLI) \
+    OP(CLV) OP(CMP) OP(CPX) OP(CPY) OP(DEC) OP(DEX) OP(DEY) OP(EOR) \
+    OP(INC) OP(INX) OP(INY) OP(JMP) OP(JSR) OP(LDA) OP(LDX) OP(LDY) \
+    OP(LSR) OP(NOP) OP(ORA) OP(PHA) OP(PHP) OP(PLA) OP(PLP) OP(ROL) \
+    OP(ROR) OP(RTI) OP(RTS) OP(SBC) OP(SEC) OP(SED) OP(SEI) OP(STA) \
+    OP(STX) OP(STY) OP(TAX) OP(TAY) OP(TSX) OP(TXA) OP(TXS) OP(TYA) \
+    OP(XXX)
+
+// All 256 opcodes in numerical order:
+//   OPCODE(opcode, mnemonic, operation, addressing mode, base cycles)
+// Unofficial opcodes show as "???" and are executed as XXX or an implied NOP
+#define R6502_OPCODE_TABLE(OPCODE) \
+    OPCODE(0x00, "BRK", BRK, IMM, 7) OPCODE(0x01, "ORA", ORA, IZX, 6) OPCODE(0x02, "???", XXX, IMP, 2) OPCODE(0x03, "???", XXX, IMP, 8) \
+    OPCODE(0x04, "???", NOP, IMP, 3) OPCODE(0x05, "ORA", ORA, ZP0, 3) OPCODE(0x06, "ASL", ASL, ZP0, 5) OPCODE(0x07, "???", XXX, IMP, 5) \
+    OPCODE(0x08, "PHP", PHP, IMP, 3) OPCODE(0x09, "ORA", ORA, IMM, 2) OPCODE(0x0A, "ASL", ASL, IMP, 2) OPCODE(0x0B, "???", XXX, IMP, 2) \
+    OPCODE(0x0C, "???", NOP, IMP, 4) OPCODE(0x0D, "ORA", ORA, ABS, 4) OPCODE(0x0E, "ASL", ASL, ABS, 6) OPCODE(0x0F, "???", XXX, IMP, 6) \
+    OPCODE(0x10, "BPL", BPL, REL, 2) OPCODE(0x11, "ORA", ORA, IZY, 5) OPCODE(0x12, "???", XXX, IMP, 2) OPCODE(0x13, "???", XXX, IMP, 8) \
+    OPCODE(0x14, "???", NOP, IMP, 4) OPCODE(0x15, "ORA", ORA, ZPX, 4) OPCODE(0x16, "ASL", ASL, ZPX, 6) OPCODE(0x17, "???", XXX, IMP, 6) \
+    OPCODE(0x18, "CLC", CLC, IMP, 2) OPCODE(0x19, "ORA", ORA, ABY, 4) OPCODE(0x1A, "???", NOP, IMP, 2) OPCODE(0x1B, "???", XXX, IMP, 7) \
+    OPCODE(0x1C, "???", NOP, IMP, 4) OPCODE(0x1D, "ORA", ORA, ABX, 4) OPCODE(0x1E, "ASL", ASL, ABX, 7) OPCODE(0x1F, "???", XXX, IMP, 7) \
+    OPCODE(0x20, "JSR", JSR, ABS, 6) OPCODE(0x21, "AND", AND, IZX, 6) OPCODE(0x22, "???", XXX, IMP, 2) OPCODE(0x23, "???", XXX, IMP, 8) \
+    OPCODE(0x24, "BIT", BIT, ZP0, 3) OPCODE(0x25, "AND", AND, ZP0, 3) OPCODE(0x26, "ROL", ROL, ZP0, 5) OPCODE(0x27, "???", XXX, IMP, 5) \
+    OPCODE(0x28, "PLP", PLP, IMP, 4) OPCODE(0x29, "AND", AND, IMM, 2) OPCODE(0x2A, "ROL", ROL, IMP, 2) OPCODE(0x2B, "???", XXX, IMP, 2) \
+    OPCODE(0x2C, "BIT", BIT, ABS, 4) OPCODE(0x2D, "AND", AND, ABS, 4) OPCODE(0x2E, "ROL", ROL, ABS, 6) OPCODE(0x2F, "???", XXX, IMP, 6) \
+    OPCODE(0x30, "BMI", BMI, REL, 2) OPCODE(0x31, "AND", AND, IZY, 5) OPCODE(0x32, "???", XXX, IMP, 2) OPCODE(0x33, "???", XXX, IMP, 8) \
+    OPCODE(0x34, "???", NOP, IMP, 4) OPCODE(0x35, "AND", AND, ZPX, 4) OPCODE(0x36, "ROL", ROL, ZPX, 6) OPCODE(0x37, "???", XXX, IMP, 6) \
+    OPCODE(0x38, "SEC", SEC, IMP, 2) OPCODE(0x39, "AND", AND, ABY, 4) OPCODE(0x3A, "???", NOP, IMP, 2) OPCODE(0x3B, "???", XXX, IMP, 7) \
+    OPCODE(0x3C, "???", NOP, IMP, 4) OPCODE(0x3D, "AND", AND, ABX, 4) OPCODE(0x3E, "ROL", ROL, ABX, 7) OPCODE(0x3F, "???", XXX, IMP, 7) \
+    OPCODE(0x40, "RTI", RTI, IMP, 6) OPCODE(0x41, "EOR", EOR, IZX, 6) OPCODE(0x42, "???", XXX, IMP, 2) OPCODE(0x43, "???", XXX, IMP, 8) \
+    OPCODE(0x44, "???", NOP, IMP, 3) OPCODE(0x45, "EOR", EOR, ZP0, 3) OPCODE(0x46, "LSR", LSR, ZP0, 5) OPCODE(0x47, "???", XXX, IMP, 5) \
+    OPCODE(0x48, "PHA", PHA, IMP, 3) OPCODE(0x49, "EOR", EOR, IMM, 2) OPCODE(0x4A, "LSR", LSR, IMP, 2) OPCODE(0x4B, "???", XXX, IMP, 2) \
+    OPCODE(0x4C, "JMP", JMP, ABS, 3) OPCODE(0x4D, "EOR", EOR, ABS, 4) OPCODE(0x4E, "LSR", LSR, ABS, 6) OPCODE(0x4F, "???", XXX, IMP, 6) \
+    OPCODE(0x50, "BVC", BVC, REL, 2) OPCODE(0x51, "EOR", EOR, IZY, 5) OPCODE(0x52, "???", XXX, IMP, 2) OPCODE(0x53, "???", XXX, IMP, 8) \
+    OPCODE(0x54, "???", NOP, IMP, 4) OPCODE(0x55, "EOR", EOR, ZPX, 4) OPCODE(0x56, "LSR", LSR, ZPX, 6) OPCODE(0x57, "???", XXX, IMP, 6) \
+    OPCODE(0x58, "CLI", CLI, IMP, 2) OPCODE(0x59, "EOR", EOR, ABY, 4) OPCODE(0x5A, "???", NOP, IMP, 2) OPCODE(0x5B, "???", XXX, IMP, 7) \
+    OPCODE(0x5C, "???", NOP, IMP, 4) OPCODE(0x5D, "EOR", EOR, ABX, 4) OPCODE(0x5E, "LSR", LSR, ABX, 7) OPCODE(0x5F, "???", XXX, IMP, 7) \
+    OPCODE(0x60, "RTS", RTS, IMP, 6) OPCODE(0x61, "ADC", ADC, IZX, 6) OPCODE(0x62, "???", XXX, IMP, 2) OPCODE(0x63, "???", XXX, IMP, 8) \
+    OPCODE(0x64, "???", NOP, IMP, 3) OPCODE(0x65, "ADC", ADC, ZP0, 3) OPCODE(0x66, "ROR", ROR, ZP0, 5) OPCODE(0x67, "???", XXX, IMP, 5) \
+    OPCODE(0x68, "PLA", PLA, IMP, 4) OPCODE(0x69, "ADC", ADC, IMM, 2) OPCODE(0x6A, "ROR", ROR, IMP, 2) OPCODE(0x6B, "???", XXX, IMP, 2) \
+    OPCODE(0x6C, "JMP", JMP, IND, 5) OPCODE(0x6D, "ADC", ADC, ABS, 4) OPCODE(0x6E, "ROR", ROR, ABS, 6) OPCODE(0x6F, "???", XXX, IMP, 6) \
+    OPCODE(0x70, "BVS", BVS, REL, 2) OPCODE(0x71, "ADC", ADC, IZY, 5) OPCODE(0x72, "???", XXX, IMP, 2) OPCODE(0x73, "???", XXX, IMP, 8) \
+    OPCODE(0x74, "???", NOP, IMP, 4) OPCODE(0x75, "ADC", ADC, ZPX, 4) OPCODE(0x76, "ROR", ROR, ZPX, 6) OPCODE(0x77, "???", XXX, IMP, 6) \
+    OPCODE(0x78, "SEI", SEI, IMP, 2) OPCODE(0x79, "ADC", ADC, ABY, 4) OPCODE(0x7A, "???", NOP, IMP, 2) OPCODE(0x7B, "???", XXX, IMP, 7) \
+    OPCODE(0x7C, "???", NOP, IMP, 4) OPCODE(0x7D, "ADC", ADC, ABX, 4) OPCODE(0x7E, "ROR", ROR, ABX, 7) OPCODE(0x7F, "???", XXX, IMP, 7) \
+    OPCODE(0x80, "???", NOP, IMP, 2) OPCODE(0x81, "STA", STA, IZX, 6) OPCODE(0x82, "???", NOP, IMP, 2) OPCODE(0x83, "???", XXX, IMP, 6) \
+    OPCODE(0x84, "STY", STY, ZP0, 3) OPCODE(0x85, "STA", STA, ZP0, 3) OPCODE(0x86, "STX", STX, ZP0, 3) OPCODE(0x87, "???", XXX, IMP, 3) \
+    OPCODE(0x88, "DEY", DEY, IMP, 2) OPCODE(0x89, "???", NOP, IMP, 2) OPCODE(0x8A, "TXA", TXA, IMP, 2) OPCODE(0x8B, "???", XXX, IMP, 2) \
+    OPCODE(0x8C, "STY", STY, ABS, 4) OPCODE(0x8D, "STA", STA, ABS, 4) OPCODE(0x8E, "STX", STX, ABS, 4) OPCODE(0x8F, "???", XXX, IMP, 4) \
+    OPCODE(0x90, "BCC", BCC, REL, 2) OPCODE(0x91, "STA", STA, IZY, 6) OPCODE(0x92, "???", XXX, IMP, 2) OPCODE(0x93, "???", XXX, IMP, 6) \
+    OPCODE(0x94, "STY", STY, ZPX, 4) OPCODE(0x95, "STA", STA, ZPX, 4) OPCODE(0x96, "STX", STX, ZPY, 4) OPCODE(0x97, "???", XXX, IMP, 4) \
+    OPCODE(0x98, "TYA", TYA, IMP, 2) OPCODE(0x99, "STA", STA, ABY, 5) OPCODE(0x9A, "TXS", TXS, IMP, 2) OPCODE(0x9B, "???", XXX, IMP, 5) \
+    OPCODE(0x9C, "???", NOP, IMP, 5) OPCODE(0x9D, "STA", STA, ABX, 5) OPCODE(0x9E, "???", XXX, IMP, 5) OPCODE(0x9F, "???", XXX, IMP, 5) \
+    OPCODE(0xA0, "LDY", LDY, IMM, 2) OPCODE(0xA1, "LDA", LDA, IZX, 6) OPCODE(0xA2, "LDX", LDX, IMM, 2) OPCODE(0xA3, "???", XXX, IMP, 6) \
+    OPCODE(0xA4, "LDY", LDY, ZP0, 3) OPCODE(0xA5, "LDA", LDA, ZP0, 3) OPCODE(0xA6, "LDX", LDX, ZP0, 3) OPCODE(0xA7, "???", XXX, IMP, 3) \
+    OPCODE(0xA8, "TAY", TAY, IMP, 2) OPCODE(0xA9, "LDA", LDA, IMM, 2) OPCODE(0xAA, "TAX", TAX, IMP, 2) OPCODE(0xAB, "???", XXX, IMP, 2) \
+    OPCODE(0xAC, "LDY", LDY, ABS, 4) OPCODE(0xAD, "LDA", LDA, ABS, 4) OPCODE(0xAE, "LDX", LDX, ABS, 4) OPCODE(0xAF, "???", XXX, IMP, 4) \
+    OPCODE(0xB0, "BCS", BCS, REL, 2) OPCODE(0xB1, "LDA", LDA, IZY, 5) OPCODE(0xB2, "???", XXX, IMP, 2) OPCODE(0xB3, "???", XXX, IMP, 5) \
+    OPCODE(0xB4, "LDY", LDY, ZPX, 4) OPCODE(0xB5, "LDA", LDA, ZPX, 4) OPCODE(0xB6, "LDX", LDX, ZPY, 4) OPCODE(0xB7, "???", XXX, IMP, 4) \
+    OPCODE(0xB8, "CLV", CLV, IMP, 2) OPCODE(0xB9, "LDA", LDA, ABY, 4) OPCODE(0xBA, "TSX", TSX, IMP, 2) OPCODE(0xBB, "???", XXX, IMP, 4) \
+    OPCODE(0xBC, "LDY", LDY, ABX, 4) OPCODE(0xBD, "LDA", LDA, ABX, 4) OPCODE(0xBE, "LDX", LDX, ABY, 4) OPCODE(0xBF, "???", XXX, IMP, 4) \
+    OPCODE(0xC0, "CPY", CPY, IMM, 2) OPCODE(0xC1, "CMP", CMP, IZX, 6) OPCODE(0xC2, "???", NOP, IMP, 2) OPCODE(0xC3, "???", XXX, IMP, 8) \
+    OPCODE(0xC4, "CPY", CPY, ZP0, 3) OPCODE(0xC5, "CMP", CMP, ZP0, 3) OPCODE(0xC6, "DEC", DEC, ZP0, 5) OPCODE(0xC7, "???", XXX, IMP, 5) \
+    OPCODE(0xC8, "INY", INY, IMP, 2) OPCODE(0xC9, "CMP", CMP, IMM, 2) OPCODE(0xCA, "DEX", DEX, IMP, 2) OPCODE(0xCB, "???", XXX, IMP, 2) \
+    OPCODE(0xCC, "CPY", CPY, ABS, 4) OPCODE(0xCD, "CMP", CMP, ABS, 4) OPCODE(0xCE, "DEC", DEC, ABS, 6) OPCODE(0xCF, "???", XXX, IMP, 6) \
+    OPCODE(0xD0, "BNE", BNE, REL, 2) OPCODE(0xD1, "CMP", CMP, IZY, 5) OPCODE(0xD2, "???", XXX, IMP, 2) OPCODE(0xD3, "???", XXX, IMP, 8) \
+    OPCODE(0xD4, "???", NOP, IMP, 4) OPCODE(0xD5, "CMP", CMP, ZPX, 4) OPCODE(0xD6, "DEC", DEC, ZPX, 6) OPCODE(0xD7, "???", XXX, IMP, 6) \
+    OPCODE(0xD8, "CLD", CLD, IMP, 2) OPCODE(0xD9, "CMP", CMP, ABY, 4) OPCODE(0xDA, "NOP", NOP, IMP, 2) OPCODE(0xDB, "???", XXX, IMP, 7) \
+    OPCODE(0xDC, "???", NOP, IMP, 4) OPCODE(0xDD, "CMP", CMP, ABX, 4) OPCODE(0xDE, "DEC", DEC, ABX, 7) OPCODE(0xDF, "???", XXX, IMP, 7) \
+    OPCODE(0xE0, "CPX", CPX, IMM, 2) OPCODE(0xE1, "SBC", SBC, IZX, 6) OPCODE(0xE2, "???", NOP, IMP, 2) OPCODE(0xE3, "???", XXX, IMP, 8) \
+    OPCODE(0xE4, "CPX", CPX, ZP0, 3) OPCODE(0xE5, "SBC", SBC, ZP0, 3) OPCODE(0xE6, "INC", INC, ZP0, 5) OPCODE(0xE7, "???", XXX, IMP, 5) \
+    OPCODE(0xE8, "INX", INX, IMP, 2) OPCODE(0xE9, "SBC", SBC, IMM, 2) OPCODE(0xEA, "NOP", NOP, IMP, 2) OPCODE(0xEB, "???", SBC, IMP, 2) \
+    OPCODE(0xEC, "CPX", CPX, ABS, 4) OPCODE(0xED, "SBC", SBC, ABS, 4) OPCODE(0xEE, "INC", INC, ABS, 6) OPCODE(0xEF, "???", XXX, IMP, 6) \
+    OPCODE(0xF0, "BEQ", BEQ, REL, 2) OPCODE(0xF1, "SBC", SBC, IZY, 5) OPCODE(0xF2, "???", XXX, IMP, 2) OPCODE(0xF3, "???", XXX, IMP, 8) \
+    OPCODE(0xF4, "???", NOP, IMP, 4) OPCODE(0xF5, "SBC", SBC, ZPX, 4) OPCODE(0xF6, "INC", INC, ZPX, 6) OPCODE(0xF7, "???", XXX, IMP, 6) \
+    OPCODE(0xF8, "SED", SED, IMP, 2) OPCODE(0xF9, "SBC", SBC, ABY, 4) OPCODE(0xFA, "NOP", NOP, IMP, 2) OPCODE(0xFB, "???", XXX, IMP, 7) \
+    OPCODE(0xFC, "???", NOP, IMP, 4) OPCODE(0xFD, "SBC", SBC, ABX, 4) OPCODE(0xFE, "INC", INC, ABX, 7) OPCODE(0xFF, "???", XXX, IMP, 7)
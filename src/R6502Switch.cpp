@@ -0,0 +1,97 @@
+#include "config.h"
+
+#include "R6502Execute.h"
+#include "Breakpoints.h"
+#include "InstructionTrace.h"
+#include "Profiler.h"
+
+// The SWITCH execution engine: the inlined interpreter (R6502Execute.h) reading
+// its instruction bytes straight from the bus.
+
+/**
+ * @brief Execute one complete instruction at pc using the inlined interpreter
+ *
+ * @return uint8_t number of clock cycles the instruction takes, including
+ * page crossing and branch penalties
+ */
+uint8_t R6502::execute()
+{
+    BusOperands src{*this};
+    return interpret<ACCURACY>(src);
+}
+
+/**
+ * @brief Executes instructions back to back until at least "budget" cycles have
+ * been used. The whole interpreter is flattened into this loop, so there is no
+ * call per instruction, only the single switch dispatch.
+ *
+ * @param budget number of clock cycles to run for
+ * @return uint32_t number of cycles used
+ */
+#if defined(__GNUC__)
+__attribute__((flatten))
+#endif
+uint32_t R6502::run_switch(uint32_t budget)
+{
+    uint32_t used = 0;
+    while (used < budget)
+    {
+#ifdef R6502_TRACE
+        if (bus->trace)
+            bus->trace->cycle = clock_count + used;
+#endif
+        used += execute();
+        instruction_count++;
+    }
+    return used;
+}
+
+/**
+ * @brief run_switch, or the LOOKUP engine's loop, testing the breakpoint flags
+ * of the address of each instruction and recording it in the instruction
+ * trace first, and counting it in the profiler after. Stops before an
+ * instruction with an execute breakpoint, and after one that hit a watchpoint
+ *
+ * @param budget number of clock cycles to run for
+ * @param clock the clock the first instruction starts on
+ * @return uint32_t number of cycles used, less than budget if stopped
+ */
+#if defined(__GNUC__)
+__attribute__((flatten))
+#endif
+uint32_t R6502::run_checked(uint32_t budget, uint32_t clock)
+{
+    Breakpoints *breaks = bus->breakpoints && bus->breakpoints->armed() ? bus->breakpoints : nullptr;
+    InstructionTrace *trace = bus->instruction_trace;
+    Profiler *profile = bus->profiler;
+    bool resuming = breaks && breaks->resuming(pc);
+    uint32_t used = 0;
+    while (used < budget)
+    {
+        if (breaks)
+        {
+            if (breaks->stopped())
+                break;
+            if ((breaks->flags[pc] & Breakpoints::EXECUTE) && !resuming && breaks->execute(pc, bus->read(pc, true)))
+                break;
+            resuming = false;
+            breaks->instruction_pc = pc;
+        }
+        if (trace)
+            trace->record(*bus, clock + used);
+#ifdef R6502_TRACE
+        if (bus->trace)
+            bus->trace->cycle = clock + used;
+#endif
+        uint16_t start_pc = pc;
+        uint8_t start_sp = stkp;
+        uint32_t spent = (engine == LOOKUP) ? execute_lookup() : execute();
+        used += spent;
+        instruction_count++;
+        if (profile)
+            profile->instruction(start_pc, start_sp, spent, *this);
+    }
+    // execute_lookup leaves its cycles in cycles, which run() has charged
+    cycles = 0;
+    return used;
+}
@@ -0,0 +1,519 @@
+#include "config.h"
+#include "SaveState.h"
+#include "Bus.h"
+#include "Mapper.h"
+
+#include <algorithm>
+#include <cstring>
+
+static const uint8_t MAGIC[8] = {'R', '6', '5', '0', '2', 'S', 'S', 0};
+
+// Section tags, four characters read as a little endian word
+static constexpr uint32_t section_tag(const char (&name)[5])
+{
+    return (uint32_t)name[0] | (uint32_t)name[1] << 8 | (uint32_t)name[2] << 16 | (uint32_t)name[3] << 24;
+}
+static constexpr uint32_t TAG_CPU = section_tag("CPU ");
+static constexpr uint32_t TAG_RAM = section_tag("RAM ");
+static constexpr uint32_t TAG_BUS = section_tag("BUS ");
+static constexpr uint32_t TAG_DEVICES = section_tag("DEV ");
+static constexpr uint32_t TAG_MAPPER = section_tag("MAPR");
+
+static constexpr uint32_t CPU_SECTION_SIZE = 24;
+
+// Stored sizes of compressed blocks have the top bit set
+static constexpr uint32_t BLOCK_COMPRESSED = 0x80000000;
+
+///////////////////////////////// Compression //////////////////////////////////
+
+// LZ77 in LZ4's block layout: a token with the literal count in the high and
+// the match length - 4 in the low nibble (15 continues in bytes of 255 and
+// less), the literals, and a 16 bit offset back to the match. A block ends
+// with literals only. One hash probe per position and a step that grows over
+// incompressible data keep it at a few hundred MB/s.
+
+static inline uint32_t read32(const uint8_t *p)
+{
+    uint32_t v;
+    std::memcpy(&v, p, 4);
+    return v;
+}
+
+/**
+ * @brief Compresses src into dst
+ *
+ * @return the compressed size, or 0 if it does not fit in cap bytes
+ */
+static size_t lz_compress(const uint8_t *src, size_t n, uint8_t *dst, size_t cap)
+{
+    static constexpr uint32_t HASH_BITS = 12;
+    uint32_t table[1 << HASH_BITS] = {}; // Position + 1 of the last 4 bytes with each hash
+    size_t ip = 0, anchor = 0, op = 0;
+
+    auto length_bytes = [&](size_t length)
+    {
+        for (; length >= 255; length -= 255)
+            dst[op++] = 255;
+        dst[op++] = (uint8_t)length;
+    };
+    auto emit = [&](size_t literals, size_t offset, size_t match) -> bool
+    {
+        size_t need = 1 + literals + literals / 255 + 1 + (match ? 3 + match / 255 : 0);
+        if (op + need > cap)
+            return false;
+        size_t token = op++;
+        dst[token] = (uint8_t)(std::min<size_t>(literals, 15) << 4);
+        if (literals >= 15)
+            length_bytes(literals - 15);
+        std::memcpy(dst + op, src + anchor, literals);
+        op += literals;
+        if (match)
+        {
+            dst[op++] = (uint8_t)offset;
+            dst[op++] = (uint8_t)(offset >> 8);
+            dst[token] |= (uint8_t)std::min<size_t>(match - 4, 15);
+            if (match - 4 >= 15)
+                length_bytes(match - 4 - 15);
+        }
+        return true;
+    };
+
+    // Matches start at least 12 bytes and end 5 bytes before the end
+    size_t limit = n >= 12 ? n - 12 : 0;
+    uint32_t misses = 0;
+    while (ip < limit)
+    {
+        uint32_t seq = read32(src + ip);
+        uint32_t hash = (seq * 2654435761u) >> (32 - HASH_BITS);
+        size_t ref = table[hash];
+        table[hash] = (uint32_t)ip + 1;
+        if (ref == 0 || ip - (ref - 1) > 0xFFFF || read32(src + ref - 1) != seq)
+        {
+            ip += 1 + (misses++ >> 6);
+            continue;
+        }
+        misses = 0;
+
+        // Extend the match 8 bytes at a time, then byte by byte
+        size_t match = ref - 1, length = 4;
+        while (ip + length + 8 <= n - 5)
+        {
+            uint64_t x, y;
+            std::memcpy(&x, src + match + length, 8);
+            std::memcpy(&y, src + ip + length, 8);
+            if (x != y)
+                break;
+            length += 8;
+        }
+        while (ip + length < n - 5 && src[match + length] == src[ip + length])
+            length++;
+        if (!emit(ip - anchor, ip - match, length))
+            return 0;
+        ip += length;
+        anchor = ip;
+    }
+    return emit(n - anchor, 0, 0) ? op : 0;
+}
+
+/**
+ * @brief Decompresses exactly length bytes into dst, or only checks that the
+ * block would if dst is null
+ *
+ * @return false if the block is damaged or does not decompress to length bytes
+ */
+static bool lz_decompress(const uint8_t *src, size_t n, uint8_t *dst, size_t length)
+{
+    size_t ip = 0, op = 0;
+    auto more = [&](size_t &value) -> bool
+    {
+        uint8_t b;
+        do
+        {
+            if (ip >= n)
+                return false;
+            b = src[ip++];
+            value += b;
+        } while (b == 255);
+        return true;
+    };
+
+    while (ip < n)
+    {
+        uint8_t token = src[ip++];
+        size_t literals = token >> 4;
+        if (literals == 15 && !more(literals))
+            return false;
+        if (literals > n - ip || literals > length - op)
+            return false;
+        if (dst)
+            std::memcpy(dst + op, src + ip, literals);
+        ip += literals;
+        op += literals;
+        if (ip == n)
+            break;
+
+        if (n - ip < 2)
+            return false;
+        size_t offset = src[ip] | src[ip + 1] << 8;
+        ip += 2;
+        size_t match = token & 0x0F;
+        if (match == 15 && !more(match))
+            return false;
+        match += 4;
+        if (offset == 0 || offset > op || match > length - op)
+            return false;
+        if (dst)
+        {
+            // The match repeats the offset bytes before it. Copying from
+            // there in chunks that double keeps every memcpy free of overlap
+            uint8_t *d = dst + op;
+            for (size_t copied = 0; copied < match;)
+            {
+                size_t chunk = std::min(match - copied, copied + offset);
+                std::memcpy(d + copied, d - offset, chunk);
+                copied += chunk;
+            }
+        }
+        op += match;
+    }
+    return op == length;
+}
+
+/////////////////////////////// Writer and reader //////////////////////////////
+
+void StateWriter::put(const void *data, size_t length)
+{
+    if (length && at + length <= size)
+        std::memcpy(out + at, data, length);
+    at += length;
+}
+
+void StateWriter::u16(uint16_t v)
+{
+    uint8_t b[2] = {(uint8_t)v, (uint8_t)(v >> 8)};
+    put(b, 2);
+}
+
+void StateWriter::u32(uint32_t v)
+{
+    uint8_t b[4] = {(uint8_t)v, (uint8_t)(v >> 8), (uint8_t)(v >> 16), (uint8_t)(v >> 24)};
+    put(b, 4);
+}
+
+void StateWriter::u64(uint64_t v)
+{
+    u32((uint32_t)v);
+    u32((uint32_t)(v >> 32));
+}
+
+void StateWriter::patch_u32(size_t offset, uint32_t v)
+{
+    if (offset + 4 <= size)
+        for (int i = 0; i < 4; i++)
+            out[offset + i] = (uint8_t)(v >> (i * 8));
+}
+
+/**
+ * @brief Writes a block: its length, its stored size and the bytes. Compressed
+ * straight into the buffer when that is asked for and makes it smaller
+ */
+void StateWriter::block(const uint8_t *data, uint32_t length)
+{
+    u32(length);
+    size_t stored = at;
+    u32(length);
+    if (compress && at < size && length > 16)
+    {
+        size_t packed = lz_compress(data, length, out + at, std::min<size_t>(size - at, length - 1));
+        if (packed)
+        {
+            at += packed;
+            patch_u32(stored, (uint32_t)packed | BLOCK_COMPRESSED);
+            return;
+        }
+    }
+    put(data, length);
+}
+
+const uint8_t *StateReader::take(size_t length)
+{
+    if (bad || length > size - at)
+    {
+        bad = true;
+        return nullptr;
+    }
+    const uint8_t *p = in + at;
+    at += length;
+    return p;
+}
+
+uint8_t StateReader::u8()
+{
+    const uint8_t *p = take(1);
+    return p ? p[0] : 0;
+}
+
+uint16_t StateReader::u16()
+{
+    const uint8_t *p = take(2);
+    return p ? (uint16_t)(p[0] | p[1] << 8) : 0;
+}
+
+uint32_t StateReader::u32()
+{
+    const uint8_t *p = take(4);
+    return p ? (uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24 : 0;
+}
+
+uint64_t StateReader::u64()
+{
+    uint64_t lo = u32();
+    return lo | (uint64_t)u32() << 32;
+}
+
+void StateReader::block(uint8_t *data, uint32_t length)
+{
+    uint32_t raw = u32();
+    uint32_t stored = u32();
+    const uint8_t *p = take(stored & ~BLOCK_COMPRESSED);
+    if (!p || raw != length)
+        bad = true;
+    else if (stored & BLOCK_COMPRESSED)
+        bad = !lz_decompress(p, stored & ~BLOCK_COMPRESSED, data, length);
+    else if (stored != length)
+        bad = true;
+    else if (data && length)
+        std::memcpy(data, p, length);
+}
+
+StateReader StateReader::sub(size_t length)
+{
+    const uint8_t *p = take(length);
+    StateReader r(p, p ? length : 0);
+    r.bad = bad;
+    return r;
+}
+
+////////////////////////////////// Save states /////////////////////////////////
+
+// Sections are a tag, a 32 bit length and that many bytes
+static size_t begin_section(StateWriter &out, uint32_t tag)
+{
+    out.u32(tag);
+    size_t length_at = out.used();
+    out.u32(0);
+    return length_at;
+}
+
+static void end_section(StateWriter &out, size_t length_at)
+{
+    out.patch_u32(length_at, (uint32_t)(out.used() - length_at - 4));
+}
+
+static void save_machine(const Bus &bus, StateWriter &out, bool compress)
+{
+    for (uint8_t b : MAGIC)
+        out.u8(b);
+    out.u32(SaveState::VERSION);
+    out.u32(compress ? (uint32_t)SaveState::COMPRESSED : 0u);
+
+    R6502::REGISTERS r = bus.cpu.registers();
+    size_t section = begin_section(out, TAG_CPU);
+    out.u8(r.a);
+    out.u8(r.x);
+    out.u8(r.y);
+    out.u8(r.stkp);
+    out.u16(r.pc);
+    out.u8((uint8_t)r.status);
+    out.u8(r.fetched);
+    out.u8(r.opcode);
+    out.u8(r.cycles);
+    out.u16(r.temp);
+    out.u16(r.addr_abs);
+    out.u16(r.addr_rel);
+    out.u32(r.clock_count);
+    out.u32(r.instruction_count);
+    end_section(out, section);
+
+    section = begin_section(out, TAG_RAM);
+    out.block(bus.ram.data(), (uint32_t)bus.ram.size());
+    end_section(out, section);
+
+    section = begin_section(out, TAG_BUS);
+    out.u32(bus.irq_sources());
+    end_section(out, section);
+
+    BusDevice *devices[255];
+    uint32_t count = bus.devices(devices);
+    section = begin_section(out, TAG_DEVICES);
+    out.u32(count);
+    for (uint32_t i = 0; i < count; i++)
+    {
+        size_t length_at = out.used();
+        out.u32(0);
+        devices[i]->save_state(out);
+        end_section(out, length_at);
+    }
+    end_section(out, section);
+
+    if (bus.mapper)
+    {
+        section = begin_section(out, TAG_MAPPER);
+        bus.mapper->save_state(out);
+        end_section(out, section);
+    }
+}
+
+/**
+ * @brief Saves the state of a machine into a buffer
+ *
+ * @param buffer where to write it
+ * @param size the size of buffer, SaveState::size(bus) is always enough
+ * @param compress store RAM compressed
+ * @return size_t the bytes used, 0 if they did not fit
+ */
+size_t SaveState::save(const Bus &bus, uint8_t *buffer, size_t size, bool compress)
+{
+    StateWriter out(buffer, size, compress);
+    save_machine(bus, out, compress);
+    return out.overflow() ? 0 : out.used();
+}
+
+size_t SaveState::size(const Bus &bus)
+{
+    StateWriter out(nullptr, 0);
+    save_machine(bus, out, false);
+    return out.used();
+}
+
+/**
+ * @brief Loads a state saved with save() into a machine set up like the one
+ * it was saved from. The sections are read twice: first to check the header,
+ * the section lengths and the CPU, RAM and bus sections (decompressing RAM
+ * without storing it), then to apply them
+ */
+bool SaveState::load(Bus &bus, const uint8_t *data, size_t size, std::string *error)
+{
+    auto fail = [&](const char *why)
+    {
+        if (error)
+            *error = why;
+        return false;
+    };
+
+    StateReader in(data, size);
+    for (uint8_t b : MAGIC)
+        if (in.u8() != b)
+            return fail("not a save state");
+    uint32_t version = in.u32();
+    in.u32(); // Flags, compression is marked per block
+    if (in.failed())
+        return fail("not a save state");
+    if (version == 0 || version > VERSION)
+        return fail("save state version is not supported");
+
+    BusDevice *devices[255];
+    uint32_t device_count = bus.devices(devices);
+
+    for (bool apply : {false, true})
+    {
+        StateReader sections = in;
+        bool have_cpu = false, have_ram = false, have_mapper = false;
+        while (!sections.done())
+        {
+            uint32_t tag = sections.u32();
+            uint32_t length = sections.u32();
+            StateReader s = sections.sub(length);
+            if (sections.failed())
+                return fail("save state is truncated");
+
+            if (tag == TAG_CPU)
+            {
+                if (length != CPU_SECTION_SIZE)
+                    return fail("CPU section has the wrong size");
+                have_cpu = true;
+                R6502::REGISTERS r;
+                r.a = s.u8();
+                r.x = s.u8();
+                r.y = s.u8();
+                r.stkp = s.u8();
+                r.pc = s.u16();
+                r.status = s.u8();
+                r.fetched = s.u8();
+                r.opcode = s.u8();
+                r.cycles = s.u8();
+                r.temp = s.u16();
+                r.addr_abs = s.u16();
+                r.addr_rel = s.u16();
+                r.clock_count = s.u32();
+                r.instruction_count = s.u32();
+                if (apply)
+                    bus.cpu.set_registers(r);
+            }
+            else if (tag == TAG_RAM)
+            {
+                have_ram = true;
+                s.block(apply ? bus.ram.data() : nullptr, (uint32_t)bus.ram.size());
+                if (s.failed() || !s.done())
+                    return fail("RAM section is damaged");
+            }
+            else if (tag == TAG_BUS)
+            {
+                uint32_t irq = s.u32();
+                if (s.failed())
+                    return fail("BUS section is damaged");
+                if (apply)
+                {
+                    bus.set_irq(~0u, false);
+                    bus.set_irq(irq, true);
+                }
+            }
+            else if (tag == TAG_DEVICES)
+            {
+                if (s.u32() != device_count)
+                    return fail("save state has a different number of devices");
+                for (uint32_t i = 0; i < device_count; i++)
+                {
+                    StateReader d = s.sub(s.u32());
+                    if (apply)
+                        devices[i]->load_state(d);
+                    if (d.failed() || s.failed())
+                        return fail("device section is damaged");
+                }
+                if (!s.done())
+                    return fail("device section is damaged");
+            }
+            else if (tag == TAG_MAPPER)
+            {
+                if (!bus.mapper)
+                    return fail("save state is of a machine with a mapper");
+                StateReader number = s;
+                if (number.u16() != bus.mapper->number())
+                    return fail("save state is of a machine with another mapper");
+                have_mapper = true;
+                if (!apply && !bus.mapper->check_state(s))
+                    return fail("mapper section is damaged");
+                if (apply)
+                {
+                    bus.mapper->load_state(s);
+                    if (s.failed())
+                        return fail("mapper section is damaged");
+                }
+            }
+        }
+        if (!have_cpu || !have_ram)
+            return fail("save state has no CPU or RAM");
+        if (bus.mapper && !have_mapper)
+            return fail("save state is of a machine without a mapper");
+    }
+
+    // RAM changed behind the bus's back: drop decoded code and let dirty
+    // tracking (snapshots, screen updates) see every page
+    bus.cpu.flush_code_cache();
+    if (bus.dirty_tracking() != Bus::DIRTY_OFF)
+    {
+        bus.dirty_pages.fill(~0ull);
+        bus.dirty_lines.fill(~0ull);
+    }
+    return true;
+}
@@ -0,0 +1,111 @@
+#pragma once
+#include "config.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+class Bus;
+
+// Writes the fields of a save state into a caller's buffer, little endian
+// whatever the host. Past the end of the buffer nothing more is written and
+// overflow() is set, but used() keeps counting, so a writer without a buffer
+// measures a state. Large blocks (RAM) are compressed when asked for.
+class StateWriter
+{
+public:
+    StateWriter(uint8_t *buffer, size_t size, bool compress = false)
+        : out(buffer), size(buffer ? size : 0), compress(compress) {}
+
+    void u8(uint8_t v) { put(&v, 1); }
+    void u16(uint16_t v);
+    void u32(uint32_t v);
+    void u64(uint64_t v);
+
+    // A block of bytes, read back with StateReader::block into as many bytes
+    void block(const uint8_t *data, uint32_t length);
+
+    size_t used() const { return at; }
+    bool overflow() const { return at > size; }
+
+    // Patch a u32 written at offset, for lengths known afterwards
+    void patch_u32(size_t offset, uint32_t v);
+
+private:
+    uint8_t *out;
+    size_t size;
+    size_t at = 0;
+    bool compress;
+
+    void put(const void *data, size_t length);
+};
+
+// Reads the fields back out of a state in place. Reading past the end of the
+// data returns 0 and sets failed(), so devices can read without checking
+// every field and the loader checks once at the end
+class StateReader
+{
+public:
+    StateReader(const uint8_t *data, size_t size) : in(data), size(size) {}
+
+    uint8_t u8();
+    uint16_t u16();
+    uint32_t u32();
+    uint64_t u64();
+
+    // A block written by StateWriter::block, of exactly length bytes,
+    // decompressed straight into data. With data null it is only checked
+    void block(uint8_t *data, uint32_t length);
+
+    // Go on with the part of the data after the next length bytes
+    StateReader sub(size_t length);
+
+    bool failed() const { return bad; }
+    bool done() const { return at == size; }
+    void fail() { bad = true; }
+
+private:
+    const uint8_t *in;
+    size_t size;
+    size_t at = 0;
+    bool bad = false;
+
+    const uint8_t *take(size_t length);
+};
+
+// The save state of a machine: the CPU registers, Bus::ram, the IRQ lines,
+// the state of every attached device (BusDevice::save_state, in the order of
+// their slots) and of the cartridge's mapper. The layout is a 16 byte header
+// ("R6502SS", the version and flags) and sections with a tag and a length, so
+// a loader skips sections it does not know.
+//
+// A state is saved into a buffer the caller provides and loaded back from it
+// in place, without allocating. With compression RAM is stored as an LZ77
+// block in LZ4's layout, which mostly squeezes out runs of zeros at little
+// cost. The page mapping is not saved: the machine a state is loaded into
+// has to be set up the same way (same devices, same cartridge).
+class SaveState
+{
+public:
+    static constexpr uint32_t VERSION = 1;
+
+    enum FLAGS : uint32_t
+    {
+        COMPRESSED = 0x01,
+    };
+
+    // Save bus into buffer, returning the bytes used, or 0 if size was too small
+    static size_t save(const Bus &bus, uint8_t *buffer, size_t size, bool compress = false);
+
+    // The size of an uncompressed state of bus, which is enough for any
+    static size_t size(const Bus &bus);
+
+    // Load a state into bus. The header and the CPU, RAM and BUS sections, the
+    // framing of the device section and the base part of the mapper section
+    // are checked before anything is changed; on failure false is returned
+    // and error, if given, says why. What devices and mappers save themselves
+    // is only read as it is applied: if one of them turns out damaged, false
+    // is returned with the machine partly loaded, and it has to be reset or
+    // loaded again before it runs
+    static bool load(Bus &bus, const uint8_t *data, size_t size, std::string *error = nullptr);
+};
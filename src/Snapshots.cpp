@@ -0,0 +1,159 @@
+#include "config.h"
+#include "Snapshots.h"
+
+#include <cstring>
+
+Snapshots::Snapshots(Bus &bus) : bus(bus), previous_tracking(bus.dirty_tracking())
+{
+    base.fill(NO_PAGE);
+    if (bus.dirty_tracking() == Bus::DIRTY_OFF)
+        bus.track_dirty(Bus::DIRTY_PAGES);
+}
+
+Snapshots::~Snapshots()
+{
+    bus.track_dirty(previous_tracking);
+}
+
+/**
+ * @brief Takes the dirty bitmap and works out which pages of Bus::ram it
+ * covers. A bus page counts for the page of ram it writes to, so mirrors of
+ * RAM mapped elsewhere are followed
+ *
+ * @param written set for every page of Bus::ram that may have changed
+ */
+void Snapshots::written_pages(std::array<bool, 256> &written)
+{
+    uint64_t dirty[4];
+    bus.take_dirty(dirty);
+    written.fill(false);
+    for (uint32_t page = 0; page < 256; page++)
+    {
+        if ((dirty[page >> 6] >> (page & 63) & 1) == 0)
+            continue;
+        const uint8_t *memory = bus.page_memory((uint8_t)page);
+        if (memory >= bus.ram.data() && memory < bus.ram.data() + bus.ram.size())
+            written[(memory - bus.ram.data()) >> 8] = true;
+    }
+}
+
+/**
+ * @brief Copies a page of Bus::ram into a page of the pool
+ *
+ * @return the pool page, with one reference
+ */
+uint32_t Snapshots::copy_page(uint8_t page)
+{
+    uint32_t index;
+    if (!free_pages.empty())
+    {
+        index = free_pages.back();
+        free_pages.pop_back();
+    }
+    else
+    {
+        index = (uint32_t)pool.size();
+        pool.emplace_back();
+    }
+    std::memcpy(pool[index].data.data(), &bus.ram[page << 8], 256);
+    pool[index].refs = 1;
+    pages_copied++;
+    return index;
+}
+
+void Snapshots::release(uint32_t page)
+{
+    if (page != NO_PAGE && --pool[page].refs == 0)
+        free_pages.push_back(page);
+}
+
+/**
+ * @brief Snapshots RAM and the CPU. Pages not written since the previous
+ * snapshot are shared with it
+ *
+ * @return the id for restore() and drop()
+ */
+uint32_t Snapshots::take()
+{
+    std::array<bool, 256> written;
+    written_pages(written);
+
+    pages_copied = 0;
+    for (uint32_t page = 0; page < 256; page++)
+    {
+        if (base[page] == NO_PAGE || written[page])
+        {
+            release(base[page]);
+            base[page] = copy_page((uint8_t)page);
+        }
+    }
+
+    uint32_t id;
+    if (!free_snapshots.empty())
+    {
+        id = free_snapshots.back();
+        free_snapshots.pop_back();
+    }
+    else
+    {
+        id = (uint32_t)snapshots.size();
+        snapshots.emplace_back();
+    }
+
+    SNAPSHOT &s = snapshots[id];
+    s.pages = base;
+    for (uint32_t page : s.pages)
+        pool[page].refs++;
+    s.cpu = bus.cpu.registers();
+    s.valid = true;
+    held++;
+    return id;
+}
+
+/**
+ * @brief Puts RAM and the CPU back to a snapshot. A page is copied back if it
+ * was written since the last snapshot or restore, or if the snapshot holds a
+ * different copy of it
+ */
+bool Snapshots::restore(uint32_t id)
+{
+    if (id >= snapshots.size() || !snapshots[id].valid)
+        return false;
+    const SNAPSHOT &s = snapshots[id];
+
+    std::array<bool, 256> written;
+    written_pages(written);
+
+    pages_copied = 0;
+    for (uint32_t page = 0; page < 256; page++)
+    {
+        if (!written[page] && base[page] == s.pages[page])
+            continue;
+        std::memcpy(&bus.ram[page << 8], pool[s.pages[page]].data.data(), 256);
+        pages_copied++;
+
+        pool[s.pages[page]].refs++;
+        release(base[page]);
+        base[page] = s.pages[page];
+
+        // Drop code decoded from the bus pages showing this memory
+        for (uint32_t mapped = 0; mapped < 256; mapped++)
+            if (bus.page_memory((uint8_t)mapped) == &bus.ram[page << 8])
+                bus.cpu.notify_remap((uint8_t)mapped);
+    }
+
+    bus.cpu.set_registers(s.cpu);
+    return true;
+}
+
+void Snapshots::drop(uint32_t id)
+{
+    if (id >= snapshots.size() || !snapshots[id].valid)
+        return;
+    SNAPSHOT &s = snapshots[id];
+    for (uint32_t page : s.pages)
+        release(page);
+    s.valid = false;
+    free_snapshots.push_back(id);
+    held--;
+}
@@ -0,0 +1,80 @@
+#pragma once
+#include "config.h"
+
+#include <array>
+#include <cstdint>
+#include <deque>
+#include <vector>
+
+#include "Bus.h"
+
+// Copy-on-write snapshots of Bus::ram and the CPU registers. A snapshot is a
+// table of 256 references to page copies, and pages that did not change are
+// shared with the snapshot before and with the live machine. Taking one copies
+// only the pages written since the previous snapshot (or restore), as found by
+// the bus's dirty tracking, so a snapshot per frame costs a few pages and
+// hundreds of them fit in a few MB.
+//
+// The bus's dirty bitmaps belong to the snapshots while they exist: a host
+// calling take_dirty itself would take bits they need. As with the decoded
+// code, stores into Bus::ram that bypass the bus are not seen. Memory mapped
+// into the bus from elsewhere (a mapper's PRG RAM) and device state are up to
+// their owners.
+class Snapshots
+{
+public:
+    // Turns on dirty tracking on bus (until the snapshots go), which has to
+    // outlive them
+    explicit Snapshots(Bus &bus);
+    ~Snapshots();
+    Snapshots(const Snapshots &) = delete;
+    Snapshots &operator=(const Snapshots &) = delete;
+
+    // Snapshot the machine, returning its id
+    uint32_t take();
+
+    // Put RAM and the CPU back as they were at snapshot id. Only the pages that
+    // differ are copied. Returns false if there is no such snapshot
+    bool restore(uint32_t id);
+
+    // Forget a snapshot, freeing the pages nothing else shares
+    void drop(uint32_t id);
+
+    // Snapshots held, and the memory of the page copies they use
+    size_t count() const { return held; }
+    size_t memory() const { return (pool.size() - free_pages.size()) * sizeof(PAGE); }
+
+    // Pages copied by the last take() or restore()
+    uint32_t pages_copied = 0;
+
+private:
+    struct PAGE
+    {
+        std::array<uint8_t, 256> data;
+        uint32_t refs = 0;
+    };
+
+    static constexpr uint32_t NO_PAGE = ~0u;
+
+    struct SNAPSHOT
+    {
+        std::array<uint32_t, 256> pages; // Into pool, per page of Bus::ram
+        R6502::REGISTERS cpu;
+        bool valid = false;
+    };
+
+    Bus &bus;
+    Bus::DIRTY previous_tracking;
+    std::deque<PAGE> pool;
+    std::vector<uint32_t> free_pages;
+    std::vector<SNAPSHOT> snapshots;
+    std::vector<uint32_t> free_snapshots;
+    size_t held = 0;
+
+    // The page copies Bus::ram matches, but for the pages written since
+    std::array<uint32_t, 256> base;
+
+    void written_pages(std::array<bool, 256> &written);
+    uint32_t copy_page(uint8_t page);
+    void release(uint32_t page);
+};
@@ -4,7 +4,17 @@
 #define PROJECT_VERSION_TWEAK 0
 
 // CONFIGURATION DEFINITIONS
-#define LOG_MODE
+
+// CPU ACCURACY: ACCURACY_FAST performs only the bus accesses an instruction needs,
+// ACCURACY_CYCLE every access of the real chip in order, one per cycle (dummy
+// reads, the double write of read-modify-write instructions). See R6502::ACCURACY
+#ifndef R6502_ACCURACY
+#define R6502_ACCURACY ACCURACY_FAST
+#endif
+
+// BUS TRACE: define R6502_TRACE to build in the bus access tracer (BusTrace.h).
+// Without it the bus has no trace code at all
+// #define R6502_TRACE
 
 // VECTOR LOCATIONS (https://eater.net/datasheets/w65c02s.pdf)[Table 3-1 Vector Locations]
 #define IRQB    0xFFFE  // Interupt Vector
@@ -0,0 +1,1267 @@
+// r6502_bench - headless throughput harness for the R6502 core
+//
+// Loads a raw binary image into Bus::ram, runs the CPU for a fixed number of
+// cycles (or until the program counter reaches a trap address) and reports
+// emulated clock rate, instructions per second and host time per instruction.
+//
+// Usage: r6502_bench [options] [image.bin]
+//   -c, --cycles N    number of CPU cycles to run (default 100000000)
+//   -l, --load ADDR   address the image is loaded at (default 0x0000)
+//   -s, --start ADDR  initial program counter (default: reset vector)
+//   -t, --trap ADDR   stop as soon as an instruction starts at ADDR
+//   -e, --engine E    execution engine: lookup, switch, cached or jit (default switch)
+//   -d, --decimal D   decimal mode behaviour: nmos, cmos or off (default nmos)
+//   -m, --mode M      how the host drives the CPU: clock (one call per cycle),
+//                     step (one call per instruction) or run (default, bulk
+//                     run() calls; falls back to step when a trap is set)
+//   -r, --random SEED fill RAM with pseudo random bytes before loading
+//   -i, --io FIRST:LAST
+//                     route the address range through a device that passes
+//                     accesses on to RAM, and report the cost per device access
+//                     against a run without it
+//   --dirty page|line track dirty pages (or 64 byte lines) on the bus and take
+//                     the bitmaps once per 29781 cycle frame; reports the cost
+//                     against a run without tracking
+//   --snapshots N     take a copy-on-write snapshot every 29781 cycle frame and
+//                     keep the last N; reports the cost per snapshot and the
+//                     memory held, then rewinds to the oldest one, replays
+//                     and checks that the machine ends in the same state
+//   --states raw|lz   save a state every 29781 cycle frame (compressed with lz)
+//                     and load it straight back; reports the size and the time
+//                     of both and checks that the run ends as it does without
+//   --disasm N        keep a disassembly cache up to date every 29781 cycle
+//                     frame and fetch the N lines before and after PC, as a
+//                     debugger's view would; reports the cost per frame against
+//                     a full R6502::disassemble and checks the cached lines
+//                     match it
+//   --break KIND:ADDR[=VALUE]
+//                     stop at a breakpoint (KIND x) or watchpoint (KIND r, w
+//                     or both) on ADDR, hitting only on VALUE if given, and
+//                     resume; may be given more than once. Reports the stops
+//                     and the cost per instruction with the breakpoints armed
+//                     and disabled against a run without, and checks that the
+//                     run ends in the same state
+//   --listing FILE    after the run, write a listing of the whole address space
+//                     (swept from $0000) into FILE; reports the formatting cost
+//                     per line with and without symbols and the heap
+//                     allocations it makes, against a copy of as many bytes
+//                     and R6502::disassemble
+//   --record FILE     record every instruction into FILE (InstructionTrace.h,
+//                     read back with r6502_trace); reports the size and the
+//                     cost per instruction against a run without, then replays
+//                     the run instruction by instruction and checks every
+//                     record against it
+//   --profile FILE    count the cycles of every address and call stack, and
+//                     write the hot spots and functions to FILE and the call
+//                     stacks to FILE.folded (for flame graphs); reports the
+//                     cost per instruction against a run without
+//   --trace FILE      record every bus access into FILE (builds with
+//                     R6502_TRACE, make native TRACE=1); reports the cost per
+//                     access against a run without the tracer
+//   --batch N         run N independent instances on a work stealing thread
+//                     pool, each for the given number of cycles (with -r, instance
+//                     i fills RAM from seed + i), once per thread count from 1
+//                     up to -j, and report the scaling curve
+//   -j, --threads J   largest thread count for --batch (default: one per core)
+//   --compare         run the lookup engine and the selected engine in lockstep
+//                     and stop at the first instruction where their state differs
+//   --slice N         with --compare, check after every run(N) call instead of
+//                     after every instruction, so compiled JIT blocks are entered.
+//                     With --dirty, also checks that every byte that changed
+//                     was marked dirty
+//
+// A .nes image (iNES or NES 2.0) is mapped as a cartridge instead, banked
+// through its mapper (NROM, MMC1, UxROM, CNROM or MMC3), starting from its
+// reset vector (use -d off for the 2A03). There is no PPU, so expect it to
+// wait for vblank.
+//
+// Without an image a small built-in workload (loads, ALU, indirect stores,
+// JSR/RTS and branches) is run from $0400.
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <fstream>
+#include <map>
+#include <memory>
+#include <new>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "BatchRunner.h"
+#include "Breakpoints.h"
+#include "Bus.h"
+#include "Cartridge.h"
+#include "Disassembly.h"
+#include "InstructionTrace.h"
+#include "Mapper.h"
+#include "Profiler.h"
+#include "R6502.h"
+#include "SaveState.h"
+#include "Snapshots.h"
+
+// Every heap allocation is counted, for --listing to show it makes none. Kept
+// out of line, as GCC takes inlined pairs of them for mismatched ones
+static std::atomic<uint64_t> allocations{0};
+
+__attribute__((noinline)) void *operator new(size_t size)
+{
+    allocations.fetch_add(1, std::memory_order_relaxed);
+    if (void *p = std::malloc(size ? size : 1))
+        return p;
+    throw std::bad_alloc();
+}
+__attribute__((noinline)) void operator delete(void *p) noexcept { std::free(p); }
+__attribute__((noinline)) void operator delete(void *p, size_t) noexcept { std::free(p); }
+
+// Built-in workload, assembled at $0400
+//
+// start: LDX #$00 / LDY #$00
+// outer: LDA #$00 / STA $10 / LDA #$06 / STA $11      ; ($10) -> $0600
+// inner: LDA $0500,X / CLC / ADC #$03 / EOR $20 / STA ($10),Y
+//        JSR sub / INY / INX / CPX #$80 / BNE inner
+//        INC $20 / JMP outer
+// sub:   PHA / ASL A / ROL $21 / PLA / RTS
+static const uint8_t builtin_program[] = {
+    0xA2, 0x00, 0xA0, 0x00, 0xA9, 0x00, 0x85, 0x10, 0xA9, 0x06, 0x85, 0x11,
+    0xBD, 0x00, 0x05, 0x18, 0x69, 0x03, 0x45, 0x20, 0x91, 0x10, 0x20, 0x24,
+    0x04, 0xC8, 0xE8, 0xE0, 0x80, 0xD0, 0xED, 0xE6, 0x20, 0x4C, 0x04, 0x04,
+    0x48, 0x0A, 0x26, 0x21, 0x68, 0x60,
+};
+static const uint16_t builtin_origin = 0x0400;
+
+struct Options
+{
+    uint64_t cycles = 100000000;
+    uint16_t load = 0x0000;
+    int32_t start = -1;
+    int32_t trap = -1;
+    R6502::ENGINE engine = R6502::SWITCH;
+    R6502::DECIMAL decimal = R6502::DECIMAL_NMOS;
+    std::string mode = "run";
+    int64_t seed = -1;
+    bool compare = false;
+    uint32_t slice = 0;
+    int32_t io_first = -1;
+    int32_t io_last = -1;
+    Bus::DIRTY dirty = Bus::DIRTY_OFF;
+    uint32_t snapshots = 0;
+    std::string states;
+    uint32_t disasm = 0;
+    std::vector<Breakpoints::BREAKPOINT> breaks;
+    std::string listing;
+    std::string record;
+    std::string profile;
+    std::string trace;
+    uint32_t batch = 0;
+    uint32_t threads = 0;
+    std::string image;
+};
+
+struct Result
+{
+    uint64_t cycles = 0;
+    uint64_t instructions = 0;
+    double seconds = 0.0;
+    bool trapped = false;
+    uint64_t dirty_pages = 0; // Sum of the dirty pages taken
+    uint64_t snapshots = 0;
+    uint64_t snapshot_pages = 0; // Pages copied by them
+    double snapshot_seconds = 0.0;
+    uint32_t oldest_snapshot = 0; // The oldest one kept, and when it was taken
+    uint64_t oldest_cycles = 0;
+    uint64_t states = 0;
+    uint64_t state_bytes = 0; // Sum of their sizes
+    double save_seconds = 0.0;
+    double load_seconds = 0.0;
+    uint64_t disasm_frames = 0;
+    uint64_t disasm_pages = 0; // Pages found changed by them
+    double disasm_seconds = 0.0;
+    uint64_t stops = 0; // By breakpoints
+};
+
+static void usage(const char *argv0)
+{
+    fprintf(stderr,
+            "usage: %s [-c cycles] [-l load_addr] [-s start_pc] [-t trap_addr]\n"
+            "       [-e lookup|switch|cached|jit] [-d nmos|cmos|off] [-m clock|step|run] [-r seed]\n"
+            "       [-i first:last] [--dirty page|line] [--snapshots N] [--states raw|lz]\n"
+            "       [--disasm N] [--break x|r|w:addr[=value]] [--listing FILE]\n"
+            "       [--record file] [--profile file] [--trace file]\n"
+            "       [--compare [--slice N]]\n"
+            "       [--batch N [-j threads]]\n"
+            "       [image.bin]\n",
+            argv0);
+}
+
+// KIND:ADDR[=VALUE], KIND being any of x, r and w
+static bool parse_break(const std::string &spec, Breakpoints::BREAKPOINT &b)
+{
+    size_t colon = spec.find(':');
+    if (colon == std::string::npos || colon == 0)
+        return false;
+    b.kinds = 0;
+    for (char c : spec.substr(0, colon))
+    {
+        if (c == 'x')
+            b.kinds |= Breakpoints::EXECUTE;
+        else if (c == 'r')
+            b.kinds |= Breakpoints::READ;
+        else if (c == 'w')
+            b.kinds |= Breakpoints::WRITE;
+        else
+            return false;
+    }
+    size_t equals = spec.find('=', colon);
+    b.first = b.last = (uint16_t)strtoul(spec.substr(colon + 1, equals - colon - 1).c_str(), nullptr, 0);
+    if (equals != std::string::npos)
+    {
+        b.condition = Breakpoints::EQUAL;
+        b.value = (uint8_t)strtoul(spec.substr(equals + 1).c_str(), nullptr, 0);
+    }
+    return true;
+}
+
+static bool parse_args(int argc, char **argv, Options &opt)
+{
+    for (int i = 1; i < argc; i++)
+    {
+        std::string arg = argv[i];
+        auto value = [&]() -> unsigned long {
+            if (i + 1 >= argc)
+            {
+                fprintf(stderr, "missing value for %s\n", arg.c_str());
+                exit(2);
+            }
+            return strtoul(argv[++i], nullptr, 0);
+        };
+
+        if (arg == "-c" || arg == "--cycles")
+            opt.cycles = value();
+        else if (arg == "-l" || arg == "--load")
+            opt.load = (uint16_t)value();
+        else if (arg == "-s" || arg == "--start")
+            opt.start = (int32_t)(value() & 0xFFFF);
+        else if (arg == "-t" || arg == "--trap")
+            opt.trap = (int32_t)(value() & 0xFFFF);
+        else if (arg == "-m" || arg == "--mode")
+        {
+            opt.mode = i + 1 < argc ? argv[++i] : "";
+            if (opt.mode != "clock" && opt.mode != "step" && opt.mode != "run")
+            {
+                fprintf(stderr, "unknown mode '%s'\n", opt.mode.c_str());
+                return false;
+            }
+        }
+        else if (arg == "-r" || arg == "--random")
+            opt.seed = (int64_t)value();
+        else if (arg == "-i" || arg == "--io")
+        {
+            std::string range = i + 1 < argc ? argv[++i] : "";
+            size_t colon = range.find(':');
+            if (colon == std::string::npos)
+            {
+                fprintf(stderr, "io range '%s' is not first:last\n", range.c_str());
+                return false;
+            }
+            opt.io_first = (int32_t)(strtoul(range.substr(0, colon).c_str(), nullptr, 0) & 0xFFFF);
+            opt.io_last = (int32_t)(strtoul(range.substr(colon + 1).c_str(), nullptr, 0) & 0xFFFF);
+        }
+        else if (arg == "--dirty")
+        {
+            std::string d = i + 1 < argc ? argv[++i] : "";
+            if (d == "page")
+                opt.dirty = Bus::DIRTY_PAGES;
+            else if (d == "line")
+                opt.dirty = Bus::DIRTY_LINES;
+            else
+            {
+                fprintf(stderr, "unknown dirty tracking '%s'\n", d.c_str());
+                return false;
+            }
+        }
+        else if (arg == "--snapshots")
+            opt.snapshots = (uint32_t)value();
+        else if (arg == "--listing")
+            opt.listing = i + 1 < argc ? argv[++i] : "";
+        else if (arg == "--record")
+            opt.record = i + 1 < argc ? argv[++i] : "";
+        else if (arg == "--profile")
+            opt.profile = i + 1 < argc ? argv[++i] : "";
+        else if (arg == "--disasm")
+            opt.disasm = (uint32_t)value();
+        else if (arg == "--break")
+        {
+            std::string spec = i + 1 < argc ? argv[++i] : "";
+            Breakpoints::BREAKPOINT b;
+            if (!parse_break(spec, b))
+            {
+                fprintf(stderr, "breakpoint '%s' is not x|r|w:addr[=value]\n", spec.c_str());
+                return false;
+            }
+            opt.breaks.push_back(b);
+        }
+        else if (arg == "--states")
+        {
+            opt.states = i + 1 < argc ? argv[++i] : "";
+            if (opt.states != "raw" && opt.states != "lz")
+            {
+                fprintf(stderr, "unknown state compression '%s'\n", opt.states.c_str());
+                return false;
+            }
+        }
+        else if (arg == "--trace")
+        {
+#ifdef R6502_TRACE
+            opt.trace = i + 1 < argc ? argv[++i] : "";
+#else
+            fprintf(stderr, "--trace needs a build with R6502_TRACE (make clean native TRACE=1)\n");
+            return false;
+#endif
+        }
+        else if (arg == "--batch")
+            opt.batch = (uint32_t)value();
+        else if (arg == "-j" || arg == "--threads")
+            opt.threads = (uint32_t)value();
+        else if (arg == "--compare")
+            opt.compare = true;
+        else if (arg == "--slice")
+            opt.slice = (uint32_t)value();
+        else if (arg == "-e" || arg == "--engine")
+        {
+            std::string e = i + 1 < argc ? argv[++i] : "";
+            if (e == "lookup")
+                opt.engine = R6502::LOOKUP;
+            else if (e == "switch")
+                opt.engine = R6502::SWITCH;
+            else if (e == "cached")
+                opt.engine = R6502::CACHED;
+            else if (e == "jit")
+                opt.engine = R6502::JIT;
+            else
+            {
+                fprintf(stderr, "unknown engine '%s'\n", e.c_str());
+                return false;
+            }
+        }
+        else if (arg == "-d" || arg == "--decimal")
+        {
+            std::string d = i + 1 < argc ? argv[++i] : "";
+            if (d == "nmos")
+                opt.decimal = R6502::DECIMAL_NMOS;
+            else if (d == "cmos")
+                opt.decimal = R6502::DECIMAL_CMOS;
+            else if (d == "off")
+                opt.decimal = R6502::DECIMAL_OFF;
+            else
+            {
+                fprintf(stderr, "unknown decimal mode '%s'\n", d.c_str());
+                return false;
+            }
+        }
+        else if (arg == "-h" || arg == "--help")
+            return false;
+        else if (arg[0] == '-')
+        {
+            fprintf(stderr, "unknown option %s\n", arg.c_str());
+            return false;
+        }
+        else
+            opt.image = arg;
+    }
+    return true;
+}
+
+// A device that passes every access on to Bus::ram, so --io can route part of
+// the address space through device dispatch without changing what the program
+// sees
+class RamDevice : public BusDevice
+{
+public:
+    explicit RamDevice(Bus &bus) : bus(bus) {}
+
+    uint8_t read(uint16_t addr) override
+    {
+        accesses++;
+        return bus.ram[addr];
+    }
+    void write(uint16_t addr, uint8_t data) override
+    {
+        accesses++;
+        bus.ram[addr] = data;
+    }
+    uint8_t peek(uint16_t addr) const override { return bus.ram[addr]; }
+
+    uint64_t accesses = 0;
+
+private:
+    Bus &bus;
+};
+
+// Loaded once and mapped into every bus, which then share its memory
+static Cartridge cartridge;
+static double cartridge_seconds = 0.0;
+
+static bool is_cartridge(const std::string &path)
+{
+    return path.size() > 4 && path.compare(path.size() - 4, 4, ".nes") == 0;
+}
+
+// Loads the cartridge the first time, so that afterwards buses can be set up
+// from several threads
+static bool load_cartridge(const std::string &path)
+{
+    if (cartridge.format != Cartridge::FORMAT_NONE)
+        return true;
+    auto t0 = std::chrono::steady_clock::now();
+    bool loaded = cartridge.load(path);
+    cartridge_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+    if (!loaded)
+        fprintf(stderr, "%s\n", cartridge.error.c_str());
+    return loaded;
+}
+
+static bool load_image(Machine &bus, Options &opt)
+{
+    if (opt.seed >= 0)
+    {
+        // xorshift32, so the same seed gives the same memory on every host
+        uint32_t state = (uint32_t)opt.seed * 2654435761u + 1;
+        for (auto &b : bus.ram)
+        {
+            state ^= state << 13;
+            state ^= state >> 17;
+            state ^= state << 5;
+            b = (uint8_t)state;
+        }
+        if (opt.image.empty())
+            return true;
+    }
+
+    if (opt.image.empty())
+    {
+        std::memcpy(&bus.ram[builtin_origin], builtin_program, sizeof(builtin_program));
+        if (opt.start < 0)
+            opt.start = builtin_origin;
+        return true;
+    }
+
+    if (is_cartridge(opt.image))
+    {
+        if (!load_cartridge(opt.image))
+            return false;
+        bus.cartridge_mapper = Mapper::create(cartridge, bus);
+        if (!bus.cartridge_mapper)
+        {
+            fprintf(stderr, "mapper %u is not supported\n", cartridge.mapper);
+            return false;
+        }
+        return true;
+    }
+
+    std::ifstream file(opt.image, std::ios::binary);
+    if (!file)
+    {
+        fprintf(stderr, "cannot open %s\n", opt.image.c_str());
+        return false;
+    }
+    std::vector<char> data((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+
+    // Images wrap around the top of the address space rather than overflowing ram
+    for (size_t i = 0; i < data.size() && i < bus.ram.size(); i++)
+        bus.ram[(uint16_t)(opt.load + i)] = (uint8_t)data[i];
+    return true;
+}
+
+static Result run(Bus &bus, const Options &opt, Snapshots *snapshots = nullptr, Disassembly *disassembly = nullptr)
+{
+    Result r;
+    R6502 &cpu = bus.cpu;
+    std::deque<std::pair<uint32_t, uint64_t>> kept; // Snapshot ids and their cycle
+    uint32_t instructions_start = cpu.instruction_count;
+
+    auto t0 = std::chrono::steady_clock::now();
+    if (opt.mode == "clock")
+    {
+        while (r.cycles < opt.cycles)
+        {
+            cpu.clock();
+            r.cycles++;
+
+            // An instruction has retired once its remaining cycles are used up
+            if (cpu.complete() && opt.trap >= 0 && cpu.pc == (uint16_t)opt.trap)
+            {
+                r.trapped = true;
+                break;
+            }
+        }
+    }
+    else if (opt.mode == "step" || opt.trap >= 0)
+    {
+        while (r.cycles < opt.cycles)
+        {
+            r.cycles += cpu.step_instruction();
+            if (bus.breakpoints && bus.breakpoints->stopped())
+            {
+                bus.breakpoints->resume();
+                r.stops++;
+            }
+            if (opt.trap >= 0 && cpu.pc == (uint16_t)opt.trap)
+            {
+                r.trapped = true;
+                break;
+            }
+        }
+    }
+    else
+    {
+        // Slices keep the 32 bit budget from overflowing on long runs. With
+        // --dirty, --snapshots, --states or --disasm they are NES frames, each ending with a checkpoint
+        bool frames = opt.dirty != Bus::DIRTY_OFF || opt.snapshots || !opt.states.empty() || disassembly;
+        const uint64_t slice = frames ? 29781 : 1 << 20;
+        uint64_t pages[4], lines[16];
+        std::vector<uint8_t> state(opt.states.empty() ? 0 : SaveState::size(bus));
+        std::vector<Disassembly::LINE> lines_around(disassembly ? 2 * opt.disasm + 1 : 0);
+        while (r.cycles < opt.cycles)
+        {
+            r.cycles += bus.run((uint32_t)std::min(slice, opt.cycles - r.cycles));
+            if (bus.breakpoints && bus.breakpoints->stopped())
+            {
+                bus.breakpoints->resume();
+                r.stops++;
+            }
+            if (!state.empty())
+            {
+                auto s0 = std::chrono::steady_clock::now();
+                size_t size = SaveState::save(bus, state.data(), state.size(), opt.states == "lz");
+                auto s1 = std::chrono::steady_clock::now();
+                if (!SaveState::load(bus, state.data(), size))
+                    break;
+                auto s2 = std::chrono::steady_clock::now();
+                r.save_seconds += std::chrono::duration<double>(s1 - s0).count();
+                r.load_seconds += std::chrono::duration<double>(s2 - s1).count();
+                r.state_bytes += size;
+                r.states++;
+            }
+            if (disassembly)
+            {
+                auto s0 = std::chrono::steady_clock::now();
+                r.disasm_pages += disassembly->update();
+                disassembly->around(cpu.pc, opt.disasm, opt.disasm, lines_around.data());
+                r.disasm_seconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - s0).count();
+                r.disasm_frames++;
+            }
+            if (snapshots)
+            {
+                auto s0 = std::chrono::steady_clock::now();
+                kept.push_back({snapshots->take(), r.cycles});
+                if (kept.size() > opt.snapshots)
+                {
+                    snapshots->drop(kept.front().first);
+                    kept.pop_front();
+                }
+                r.snapshot_seconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - s0).count();
+                r.snapshot_pages += snapshots->pages_copied;
+                r.snapshots++;
+            }
+            else if (bus.dirty_tracking() != Bus::DIRTY_OFF)
+            {
+                bus.take_dirty(pages, lines);
+                for (uint64_t bits : pages)
+                    r.dirty_pages += __builtin_popcountll(bits);
+            }
+        }
+    }
+    auto t1 = std::chrono::steady_clock::now();
+    if (!kept.empty())
+    {
+        r.oldest_snapshot = kept.front().first;
+        r.oldest_cycles = kept.front().second;
+    }
+
+    r.instructions = (uint32_t)(cpu.instruction_count - instructions_start);
+    r.seconds = std::chrono::duration<double>(t1 - t0).count();
+    return r;
+}
+
+// Executes exactly one instruction (plus any cycles left over from reset)
+static void step(R6502 &cpu)
+{
+    do
+        cpu.clock();
+    while (!cpu.complete());
+}
+
+static bool same_state(const Bus &a, const Bus &b)
+{
+    return a.cpu.pc == b.cpu.pc && a.cpu.a == b.cpu.a && a.cpu.x == b.cpu.x &&
+           a.cpu.y == b.cpu.y && a.cpu.stkp == b.cpu.stkp &&
+           a.cpu.status == b.cpu.status && a.cpu.clock_count == b.cpu.clock_count &&
+           a.cpu.instruction_count == b.cpu.instruction_count;
+}
+
+static void print_state(const char *name, const R6502 &cpu)
+{
+    printf("%-7s: PC=$%04X A=$%02X X=$%02X Y=$%02X SP=$%02X P=$%02X clk=%u\n", name,
+           cpu.pc, cpu.a, cpu.x, cpu.y, cpu.stkp, (uint8_t)cpu.status, cpu.clock_count);
+}
+
+static const char *engine_name(R6502::ENGINE engine)
+{
+    switch (engine)
+    {
+    case R6502::LOOKUP: return "lookup";
+    case R6502::SWITCH: return "switch";
+    case R6502::CACHED: return "cached";
+    case R6502::JIT:    return "jit";
+    }
+    return "?";
+}
+
+// Runs a LOOKUP machine ticked by clock() and a machine with the selected engine
+// driven one instruction at a time (or one run() slice at a time) side by side
+// from identical memory, and reports the first point after which registers,
+// cycles or RAM differ
+static int compare(const Options &opt)
+{
+    auto ref = std::make_unique<Machine>();
+    auto dut = std::make_unique<Machine>();
+    Options o = opt;
+    if (!load_image(*ref, o) || !load_image(*dut, o))
+        return 1;
+
+    RamDevice device(*dut);
+    if (opt.io_first >= 0)
+        dut->attach(&device, (uint16_t)opt.io_first, (uint16_t)opt.io_last);
+    dut->track_dirty(opt.dirty);
+
+    ref->cpu.engine = R6502::LOOKUP;
+    dut->cpu.engine = opt.engine;
+    ref->cpu.decimal = opt.decimal;
+    dut->cpu.decimal = opt.decimal;
+    for (Bus *bus : {ref.get(), dut.get()})
+    {
+        bus->cpu.reset();
+        if (o.start >= 0)
+            bus->cpu.pc = (uint16_t)o.start;
+    }
+
+    uint64_t instructions = 0;
+    auto before = std::make_unique<std::array<uint8_t, 64 * 1024>>();
+    while (ref->cpu.clock_count < opt.cycles)
+    {
+        uint16_t pc = ref->cpu.pc;
+        if (opt.dirty != Bus::DIRTY_OFF)
+            *before = dut->ram;
+        if (opt.slice)
+        {
+            // run() stops on the same instruction whatever the engine
+            ref->run(opt.slice);
+            dut->run(opt.slice);
+            instructions = ref->cpu.instruction_count;
+        }
+        else
+        {
+            step(ref->cpu);
+            dut->cpu.step_instruction();
+            instructions++;
+        }
+
+        if (!same_state(*ref, *dut) || ref->ram != dut->ram)
+        {
+            printf("mismatch after instruction %llu at $%04X (opcode $%02X)\n",
+                   (unsigned long long)instructions, pc, ref->cpu.opcode);
+            print_state("lookup", ref->cpu);
+            print_state(engine_name(opt.engine), dut->cpu);
+            for (size_t i = 0; i < ref->ram.size(); i++)
+                if (ref->ram[i] != dut->ram[i])
+                    printf("ram[$%04zX]: lookup=$%02X %s=$%02X\n", i, ref->ram[i],
+                           engine_name(opt.engine), dut->ram[i]);
+            return 1;
+        }
+        if (opt.dirty != Bus::DIRTY_OFF)
+        {
+            // Every changed byte has to be in a dirty page (and line), but for
+            // those the device wrote
+            uint64_t pages[4], lines[16];
+            dut->take_dirty(pages, lines);
+            for (size_t i = 0; i < dut->ram.size(); i++)
+            {
+                if ((int32_t)i >= opt.io_first && (int32_t)i <= opt.io_last)
+                    continue;
+                bool page = pages[i >> 14] >> ((i >> 8) & 63) & 1;
+                bool line = lines[i >> 12] >> ((i >> 6) & 63) & 1;
+                if ((*before)[i] != dut->ram[i] && (!page || (opt.dirty == Bus::DIRTY_LINES && !line)))
+                {
+                    printf("write to $%04zX after instruction %llu at $%04X not marked dirty\n", i,
+                           (unsigned long long)instructions, pc);
+                    return 1;
+                }
+            }
+        }
+        if (opt.trap >= 0 && ref->cpu.pc == (uint16_t)opt.trap)
+            break;
+    }
+
+    printf("lookup and %s agree over %llu instructions / %u cycles\n",
+           engine_name(opt.engine), (unsigned long long)instructions, ref->cpu.clock_count);
+    return 0;
+}
+
+// Registers, cycle count and RAM of a machine, hashed (FNV-1a)
+static uint64_t fingerprint(const Bus &bus)
+{
+    const R6502 &cpu = bus.cpu;
+    uint8_t regs[] = {cpu.a, cpu.x, cpu.y, cpu.stkp, (uint8_t)cpu.status,
+                      (uint8_t)cpu.pc, (uint8_t)(cpu.pc >> 8)};
+    uint64_t hash = 14695981039346656037ull;
+    auto add = [&](const uint8_t *data, size_t size)
+    {
+        for (size_t i = 0; i < size; i++)
+            hash = (hash ^ data[i]) * 1099511628211ull;
+    };
+    add(regs, sizeof(regs));
+    add((const uint8_t *)&cpu.clock_count, sizeof(cpu.clock_count));
+    add(bus.ram.data(), bus.ram.size());
+    return hash;
+}
+
+// Names for the interrupt vectors and the reset routine, for --listing to
+// show symbols
+class VectorSymbols : public DisassemblySymbols
+{
+public:
+    explicit VectorSymbols(const uint8_t *image) : names(64 * 1024)
+    {
+        names[image[0xFFFC] | image[0xFFFD] << 8] = "reset";
+        names[0xFFFA] = "nmi_vector";
+        names[0xFFFC] = "reset_vector";
+        names[0xFFFE] = "irq_vector";
+    }
+
+    const char *name(uint16_t addr) const override { return names[addr]; }
+
+private:
+    std::vector<const char *> names;
+};
+
+// A line per instruction of the address space, swept from $0000, into out
+// (room for 64 bytes a line). Returns the bytes used
+static size_t list(const uint8_t *image, char *out, const DisassemblySymbols *symbols, uint32_t &lines)
+{
+    char *at = out;
+    lines = 0;
+    for (uint32_t addr = 0; addr < 0x10000; addr += R6502::instruction_length(image[addr]))
+    {
+        at += R6502::format_instruction((uint16_t)addr, &image[addr], at, 63, symbols);
+        *at++ = '\n';
+        lines++;
+    }
+    return at - out;
+}
+
+// Runs a fresh machine instruction by instruction along the trace --record
+// wrote, checking that each record is the state the instruction starts in
+static int replay(Machine &bus, const Options &opt)
+{
+    InstructionTraceReader reader;
+    if (!reader.open(opt.record))
+    {
+        printf("replay       : %s does not open\n", opt.record.c_str());
+        return 1;
+    }
+
+    R6502 &cpu = bus.cpu;
+    InstructionTraceReader::RECORD record;
+    uint64_t records = 0;
+    auto t0 = std::chrono::steady_clock::now();
+    while (reader.next(record))
+    {
+        uint8_t bytes[3] = {};
+        bus.peek_range(cpu.pc, record.length, bytes);
+        if (record.pc != cpu.pc || record.a != cpu.a || record.x != cpu.x || record.y != cpu.y ||
+            record.p != (uint8_t)cpu.status || record.sp != cpu.stkp ||
+            (uint32_t)record.cycle != cpu.clock_count + cpu.cycles || !std::equal(bytes, bytes + 3, record.bytes))
+        {
+            printf("replay       : instruction %llu DIFFERS\n", (unsigned long long)record.index);
+            return 1;
+        }
+        records++;
+
+        // Bus::run(1) can take an interrupt without executing an instruction
+        uint32_t before = cpu.instruction_count;
+        while (cpu.instruction_count == before)
+            bus.run(1);
+    }
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+    printf("replay       : %llu instructions decoded at %.1f M instr/s and replayed, %s\n",
+           (unsigned long long)records, records / seconds / 1e6, reader.damaged ? "trace DAMAGED" : "all match");
+    return reader.damaged ? 1 : 0;
+}
+
+// Writes a listing of bus into opt.listing, timing the formatting against a
+// plain copy of its bytes (what memory bandwidth allows) and against
+// R6502::disassemble, and counting the allocations of each
+static int listing(Bus &bus, const Options &opt)
+{
+    const int repeats = 20;
+
+    // The operands of the last instructions wrap around
+    std::vector<uint8_t> image(0x10002);
+    bus.peek_range(0x0000, (uint32_t)image.size(), image.data());
+    std::vector<char> text(64 * 64 * 1024), copy(text.size());
+    VectorSymbols symbols(image.data());
+
+    auto time = [&](auto &&work, uint64_t &allocated)
+    {
+        uint64_t before = allocations.load();
+        auto t0 = std::chrono::steady_clock::now();
+        for (int i = 0; i < repeats; i++)
+            work();
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count() / repeats;
+        allocated = (allocations.load() - before) / repeats;
+        return seconds;
+    };
+
+    uint32_t lines = 0;
+    size_t size = 0;
+    uint64_t plain_allocated, symbol_allocated, copy_allocated, map_allocated;
+    double plain = time([&] { size = list(image.data(), text.data(), nullptr, lines); }, plain_allocated);
+    double named = time([&] { list(image.data(), copy.data(), &symbols, lines); }, symbol_allocated);
+    double copied = time([&] { std::memcpy(copy.data(), text.data(), size); }, copy_allocated);
+    double mapped = time([&] { bus.cpu.disassemble(0x0000, 0xFFFF); }, map_allocated);
+
+    size = list(image.data(), text.data(), nullptr, lines);
+    auto t0 = std::chrono::steady_clock::now();
+    FILE *file = fopen(opt.listing.c_str(), "wb");
+    if (!file || fwrite(text.data(), 1, size, file) != size || fclose(file) != 0)
+    {
+        fprintf(stderr, "cannot write %s\n", opt.listing.c_str());
+        return 1;
+    }
+    double written = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+
+    printf("listing      : %s, %u lines, %.2f MB, written in %.2f ms\n", opt.listing.c_str(), lines, size / 1e6,
+           written * 1e3);
+    printf("list cost    : %.2f ns/line (%.0f MB/s), %.2f ns/line with symbols, %llu + %llu allocations\n",
+           plain * 1e9 / lines, size / plain / 1e6, named * 1e9 / lines, (unsigned long long)plain_allocated,
+           (unsigned long long)symbol_allocated);
+    printf("list compare : copying the text %.2f ns/line (%.0f MB/s), disassemble() %.2f ns/line and %.2f "
+           "allocations/line\n",
+           copied * 1e9 / lines, size / copied / 1e6, mapped * 1e9 / lines, (double)map_allocated / lines);
+    return plain_allocated + symbol_allocated == 0 ? 0 : 1;
+}
+
+// Writes the report and the folded call stacks of the --profile run, which
+// has to have counted every instruction and end as the run without it did
+static int profile(Bus &bus, const Options &opt, const Profiler &profiler, const Result &r, const Result &baseline,
+                   uint64_t baseline_state)
+{
+    std::vector<uint8_t> image(0x10000);
+    bus.peek_range(0x0000, (uint32_t)image.size(), image.data());
+    VectorSymbols symbols(image.data());
+
+    std::string folded = opt.profile + ".folded";
+    FILE *report = fopen(opt.profile.c_str(), "w");
+    FILE *stacks = fopen(folded.c_str(), "w");
+    if (report)
+        profiler.write_report(report, bus, 20, &symbols);
+    if (stacks)
+        profiler.write_folded(stacks, &symbols);
+    bool written = report && stacks;
+    if (report && fclose(report) != 0)
+        written = false;
+    if (stacks && fclose(stacks) != 0)
+        written = false;
+    if (!written)
+    {
+        fprintf(stderr, "cannot write %s and %s\n", opt.profile.c_str(), folded.c_str());
+        return 1;
+    }
+
+    std::vector<Profiler::SPOT> top = profiler.hot_spots(1);
+    std::vector<Profiler::FUNCTION> functions = profiler.functions();
+    uint64_t cycles = std::max<uint64_t>(profiler.cycles(), 1);
+    printf("profile      : %s, %llu instructions, %llu cycles, %zu functions, %u call stacks\n",
+           opt.profile.c_str(), (unsigned long long)profiler.instructions(), (unsigned long long)profiler.cycles(),
+           functions.size(), profiler.stacks());
+    if (!top.empty())
+        printf("profile top  : $%04X %.1f%% of the cycles, function $%04X %.1f%% self\n", top[0].pc,
+               100.0 * top[0].cycles / cycles, functions[0].addr, 100.0 * functions[0].self / cycles);
+
+    bool counted = profiler.instructions() == r.instructions;
+    bool same = fingerprint(bus) == baseline_state;
+    if (r.instructions > 0)
+        printf("profile cost : %.2f ns/instr, %.2fx the run without (%.3f s), %s, run %s\n",
+               (r.seconds - baseline.seconds) * 1e9 / r.instructions, r.seconds / baseline.seconds,
+               baseline.seconds, counted ? "every instruction counted" : "instructions MISSED",
+               same ? "ends in the same state" : "DIFFERS");
+    return counted && same ? 0 : 1;
+}
+
+// Runs opt.batch independent machines on 1, 2, 4 ... up to opt.threads
+// threads, each count with a new pool set up the same way, and reports the
+// throughput per thread count. Every instance has to end in the same state
+// whatever the number of threads
+static int batch(const Options &opt)
+{
+    uint32_t max_threads = opt.threads ? opt.threads : std::max(1u, std::thread::hardware_concurrency());
+    if (is_cartridge(opt.image) && !load_cartridge(opt.image))
+        return 1;
+
+    std::vector<uint32_t> counts;
+    for (uint32_t t = 1; t < max_threads; t *= 2)
+        counts.push_back(t);
+    counts.push_back(max_threads);
+
+    printf("batch        : %u instances x %llu cycles, %s engine, %s\n", opt.batch,
+           (unsigned long long)opt.cycles, engine_name(opt.engine),
+           opt.image.empty() ? "<builtin>" : opt.image.c_str());
+    printf("threads  host time     M instr/s  speedup  efficiency  steals\n");
+
+    std::vector<uint64_t> reference;
+    double single = 0.0;
+    for (uint32_t threads : counts)
+    {
+        BatchRunner runner(opt.batch, threads);
+        std::atomic<uint32_t> failed{0};
+        runner.run([&](size_t i, Machine &machine)
+        {
+            Options o = opt;
+            if (opt.seed >= 0)
+                o.seed = opt.seed + (int64_t)i;
+            if (!load_image(machine, o))
+            {
+                failed++;
+                return;
+            }
+            machine.cpu.engine = o.engine;
+            machine.cpu.decimal = o.decimal;
+            machine.cpu.reset();
+            if (o.start >= 0)
+                machine.cpu.pc = (uint16_t)o.start;
+        });
+        if (failed)
+            return 1;
+
+        std::vector<uint64_t> instructions(opt.batch);
+        auto t0 = std::chrono::steady_clock::now();
+        runner.run([&](size_t i, Machine &machine) { instructions[i] = run(machine, opt).instructions; });
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+
+        std::vector<uint64_t> states(opt.batch);
+        for (size_t i = 0; i < runner.size(); i++)
+            states[i] = fingerprint(runner[i]);
+        if (reference.empty())
+        {
+            reference = states;
+            single = seconds;
+        }
+        else if (states != reference)
+        {
+            printf("instances ended in a different state on %u threads\n", threads);
+            return 1;
+        }
+
+        uint64_t total = 0;
+        for (uint64_t n : instructions)
+            total += n;
+        printf("%7u  %9.3f s  %12.2f  %7.2f  %9.0f%%  %6llu\n", threads, seconds, total / seconds / 1e6,
+               single / seconds, single / seconds / threads * 100.0, (unsigned long long)runner.steals);
+    }
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    Options opt;
+    if (!parse_args(argc, argv, opt))
+    {
+        usage(argv[0]);
+        return 2;
+    }
+
+    if (opt.snapshots && opt.dirty != Bus::DIRTY_OFF)
+    {
+        fprintf(stderr, "--snapshots uses the dirty bitmaps and can't be combined with --dirty\n");
+        return 2;
+    }
+    if (opt.compare)
+        return compare(opt);
+    if (opt.batch)
+        return batch(opt);
+
+    // 64KB of RAM is too large to keep on the stack
+    auto setup = [&](Options &o) -> std::unique_ptr<Machine>
+    {
+        auto bus = std::make_unique<Machine>();
+        if (!load_image(*bus, o))
+            return nullptr;
+        bus->cpu.engine = o.engine;
+        bus->cpu.decimal = o.decimal;
+        bus->cpu.reset();
+        if (o.start >= 0)
+            bus->cpu.pc = (uint16_t)o.start;
+        return bus;
+    };
+
+    // With --io, --dirty, --trace, --break, --record or --profile, a run
+    // without the device, tracking, tracer, breakpoints, recorder or profiler
+    // first gives the baseline. With --states, --break, --record and
+    // --profile, the machine has to end in the same state as it
+    Result baseline;
+    uint64_t baseline_state = 0;
+    if (opt.io_first >= 0 || opt.dirty != Bus::DIRTY_OFF || !opt.trace.empty() || !opt.states.empty() ||
+        !opt.breaks.empty() || !opt.record.empty() || !opt.profile.empty())
+    {
+        Options o = opt;
+        // A traced bus runs CACHED and JIT as SWITCH
+        if (!opt.trace.empty() && opt.engine != R6502::LOOKUP)
+            o.engine = R6502::SWITCH;
+        o.states.clear();
+        o.breaks.clear();
+        o.record.clear();
+        o.profile.clear();
+        auto plain = setup(o);
+        if (!plain)
+            return 1;
+        baseline = run(*plain, o);
+        baseline_state = fingerprint(*plain);
+    }
+
+    // And with --break, a run with them all disabled, which should cost nothing
+    Result disarmed;
+    if (!opt.breaks.empty())
+    {
+        auto plain = setup(opt);
+        if (!plain)
+            return 1;
+        Breakpoints breakpoints(*plain);
+        for (Breakpoints::BREAKPOINT b : opt.breaks)
+        {
+            b.enabled = false;
+            breakpoints.add(b);
+        }
+        disarmed = run(*plain, opt);
+    }
+
+    auto bus = setup(opt);
+    if (!bus)
+        return 1;
+    RamDevice device(*bus);
+    if (opt.io_first >= 0)
+        bus->attach(&device, (uint16_t)opt.io_first, (uint16_t)opt.io_last);
+    bus->track_dirty(opt.dirty);
+#ifdef R6502_TRACE
+    BusTrace trace;
+    if (!opt.trace.empty())
+    {
+        if (!trace.start(opt.trace))
+        {
+            fprintf(stderr, "cannot create %s\n", opt.trace.c_str());
+            return 1;
+        }
+        bus->trace = &trace;
+    }
+#endif
+
+    std::unique_ptr<Snapshots> snapshots;
+    if (opt.snapshots)
+        snapshots = std::make_unique<Snapshots>(*bus);
+
+    std::unique_ptr<Disassembly> disassembly;
+    if (opt.disasm)
+        disassembly = std::make_unique<Disassembly>(*bus);
+
+    InstructionTrace recorder;
+    if (!opt.record.empty())
+    {
+        if (!recorder.start(opt.record))
+        {
+            fprintf(stderr, "cannot create %s\n", opt.record.c_str());
+            return 1;
+        }
+        bus->instruction_trace = &recorder;
+    }
+
+    Profiler profiler;
+    if (!opt.profile.empty())
+        bus->profiler = &profiler;
+
+    std::unique_ptr<Breakpoints> breakpoints;
+    if (!opt.breaks.empty())
+    {
+        breakpoints = std::make_unique<Breakpoints>(*bus);
+        for (const Breakpoints::BREAKPOINT &b : opt.breaks)
+            breakpoints->add(b);
+    }
+
+    Result r = run(*bus, opt, snapshots.get(), disassembly.get());
+    bus->instruction_trace = nullptr;
+    bus->profiler = nullptr;
+    recorder.stop();
+#ifdef R6502_TRACE
+    bus->trace = nullptr;
+    trace.stop();
+#endif
+    const R6502 &cpu = bus->cpu;
+
+    printf("image        : %s\n", opt.image.empty() ? "<builtin>" : opt.image.c_str());
+    if (cartridge.format != Cartridge::FORMAT_NONE)
+        printf("cartridge    : %s, mapper %u, %uKB PRG, %uKB CHR, loaded in %.1f us\n",
+               cartridge.format == Cartridge::FORMAT_NES2 ? "NES 2.0" : "iNES", cartridge.mapper,
+               cartridge.prg.size / 1024, cartridge.chr.size / 1024, cartridge_seconds * 1e6);
+    printf("engine       : %s (%s)\n", engine_name(opt.engine), opt.mode.c_str());
+    printf("cycles       : %llu\n", (unsigned long long)r.cycles);
+    printf("instructions : %llu\n", (unsigned long long)r.instructions);
+    printf("host time    : %.3f s\n", r.seconds);
+    if (r.seconds > 0.0 && r.instructions > 0)
+    {
+        printf("emulated     : %.2f MHz\n", r.cycles / r.seconds / 1e6);
+        printf("throughput   : %.2f M instr/s\n", r.instructions / r.seconds / 1e6);
+        printf("cost         : %.2f ns/instr\n", r.seconds * 1e9 / r.instructions);
+    }
+    if (opt.io_first >= 0)
+    {
+        printf("io range     : $%04X-$%04X, %llu device accesses\n", opt.io_first, opt.io_last,
+               (unsigned long long)device.accesses);
+        if (device.accesses > 0)
+            printf("io cost      : %.2f ns/access (%.3f s without the device)\n",
+                   (r.seconds - baseline.seconds) * 1e9 / device.accesses, baseline.seconds);
+    }
+    if (opt.dirty != Bus::DIRTY_OFF)
+    {
+        uint64_t frames = (r.cycles + 29780) / 29781;
+        printf("dirty        : %s, %.1f pages per frame\n",
+               opt.dirty == Bus::DIRTY_PAGES ? "pages" : "lines", (double)r.dirty_pages / frames);
+        if (r.instructions > 0)
+            printf("dirty cost   : %.2f ns/instr (%.3f s without tracking)\n",
+                   (r.seconds - baseline.seconds) * 1e9 / r.instructions, baseline.seconds);
+    }
+#ifdef R6502_TRACE
+    if (!opt.trace.empty())
+    {
+        uint64_t accesses = trace.records() + trace.dropped();
+        printf("trace        : %s, %llu records (%.1f MB), %llu dropped\n", opt.trace.c_str(),
+               (unsigned long long)trace.records(), trace.records() * sizeof(BusTrace::RECORD) / 1e6,
+               (unsigned long long)trace.dropped());
+        if (accesses > 0)
+            printf("trace cost   : %.2f ns/access (%.3f s without the tracer)\n",
+                   (r.seconds - baseline.seconds) * 1e9 / accesses, baseline.seconds);
+    }
+#endif
+    printf("final state  : PC=$%04X A=$%02X X=$%02X Y=$%02X SP=$%02X P=$%02X%s\n",
+           cpu.pc, cpu.a, cpu.x, cpu.y, cpu.stkp, (uint8_t)cpu.status,
+           r.trapped ? " (trapped)" : "");
+
+    if (r.states > 0)
+    {
+        bool same = fingerprint(*bus) == baseline_state;
+        printf("states       : %llu saved and loaded, %.0f bytes each (%s)\n", (unsigned long long)r.states,
+               (double)r.state_bytes / r.states, opt.states.c_str());
+        printf("state cost   : save %.2f us, load %.2f us, run %s\n", r.save_seconds * 1e6 / r.states,
+               r.load_seconds * 1e6 / r.states, same ? "ends in the same state" : "DIFFERS");
+        if (!same)
+            return 1;
+    }
+
+    if (disassembly && r.disasm_frames > 0)
+    {
+        printf("disasm       : %llu frames, %.2f pages changed per frame, %llu lines decoded\n",
+               (unsigned long long)r.disasm_frames, (double)r.disasm_pages / r.disasm_frames,
+               (unsigned long long)disassembly->decoded);
+        printf("disasm cost  : %.2f us per frame for %u lines around PC\n", r.disasm_seconds * 1e6 / r.disasm_frames,
+               2 * opt.disasm + 1);
+
+        // The lines of the whole address space, from the cache against a
+        // disassembly from scratch
+        disassembly->update();
+        auto t0 = std::chrono::steady_clock::now();
+        std::map<uint16_t, std::string> full = bus->cpu.disassemble(0x0000, 0xFFFF);
+        double full_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+        size_t differ = 0;
+        for (const auto &line : full)
+            differ += line.second != disassembly->line(line.first).text;
+        printf("disasm full  : %zu lines in %.2f us from scratch, cached lines %s\n", full.size(),
+               full_seconds * 1e6, differ ? "DIFFER" : "match");
+        if (differ)
+            return 1;
+    }
+
+    if (breakpoints)
+    {
+        printf("breaks       : %llu stops, hits", (unsigned long long)r.stops);
+        for (uint32_t id = 0; id < breakpoints->size(); id++)
+        {
+            const Breakpoints::BREAKPOINT *b = breakpoints->get(id);
+            printf(" %s%s%s:$%04X %u", b->kinds & Breakpoints::EXECUTE ? "x" : "",
+                   b->kinds & Breakpoints::READ ? "r" : "", b->kinds & Breakpoints::WRITE ? "w" : "", b->first,
+                   b->hits);
+        }
+        printf("\n");
+        bool same = fingerprint(*bus) == baseline_state;
+        if (r.instructions > 0)
+            printf("break cost   : %.2f ns/instr armed, %.2f disabled (%.3f s without), run %s\n",
+                   (r.seconds - baseline.seconds) * 1e9 / r.instructions,
+                   (disarmed.seconds - baseline.seconds) * 1e9 / r.instructions, baseline.seconds,
+                   same ? "ends in the same state" : "DIFFERS");
+        if (!same)
+            return 1;
+    }
+
+    if (!opt.record.empty())
+    {
+        bool same = fingerprint(*bus) == baseline_state;
+        printf("record       : %s, %llu instructions in %.1f MB, %.2f bytes/instr, %llu dropped\n",
+               opt.record.c_str(), (unsigned long long)recorder.records(), recorder.bytes() / 1e6,
+               (double)recorder.bytes() / std::max<uint64_t>(recorder.records(), 1),
+               (unsigned long long)recorder.dropped());
+        if (r.instructions > 0)
+            printf("record cost  : %.2f ns/instr, %.2fx the run without (%.3f s), run %s\n",
+                   (r.seconds - baseline.seconds) * 1e9 / r.instructions, r.seconds / baseline.seconds,
+                   baseline.seconds, same ? "ends in the same state" : "DIFFERS");
+        auto again = setup(opt);
+        if (!same || !again || replay(*again, opt) != 0)
+            return 1;
+    }
+
+    if (!opt.profile.empty() && profile(*bus, opt, profiler, r, baseline, baseline_state) != 0)
+        return 1;
+
+    if (!opt.listing.empty() && listing(*bus, opt) != 0)
+        return 1;
+
+    if (snapshots && r.snapshots > 0)
+    {
+        printf("snapshots    : %llu taken, %.1f pages copied each, %.2f us each\n",
+               (unsigned long long)r.snapshots, (double)r.snapshot_pages / r.snapshots,
+               r.snapshot_seconds * 1e6 / r.snapshots);
+        printf("snapshot mem : %zu kept in %.1f KB\n", snapshots->count(), snapshots->memory() / 1024.0);
+
+        // Rewind to the oldest snapshot and replay up to the end, which has to
+        // give the same machine. Mapper registers are not in snapshots
+        uint64_t end = fingerprint(*bus);
+        auto t0 = std::chrono::steady_clock::now();
+        snapshots->restore(r.oldest_snapshot);
+        double restore_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+        uint32_t restored = snapshots->pages_copied;
+        Options replay = opt;
+        replay.cycles = r.cycles - r.oldest_cycles;
+        run(*bus, replay, snapshots.get());
+        bool same = fingerprint(*bus) == end;
+        printf("rewind       : %llu cycles back, %u pages restored in %.2f us, replay %s\n",
+               (unsigned long long)replay.cycles, restored, restore_seconds * 1e6,
+               same ? "ends in the same state" : "DIFFERS");
+        if (!same)
+            return 1;
+    }
+
+    return r.trapped || opt.trap < 0 ? 0 : 1;
+}
@@ -0,0 +1,154 @@
+// r6502_trace - decodes and searches instruction traces
+//
+// Reads a trace written by InstructionTrace (src/InstructionTrace.h), for
+// instance by r6502_bench --record, and prints one line per instruction: its
+// index, the cycle it started on, its disassembly and the registers before it.
+//
+// Usage: r6502_trace [options] trace.bin
+//   --pc ADDR         only the instructions at ADDR
+//   --a V, --x V, --y V, --p V, --sp V
+//                     only the instructions starting with the register at V
+//   -f, --from N      start at instruction N, skipping the blocks before it
+//   -n, --count N     stop after N lines
+//   --stats           print no lines, only how many instructions match and the
+//                     size of the trace per instruction
+//
+// Filters combine, so --pc 0x8000 --a 0 lists the times $8000 ran with A = 0.
+
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+
+#include "InstructionTrace.h"
+#include "R6502.h"
+
+struct Options
+{
+    int32_t pc = -1;
+    int32_t registers[5] = {-1, -1, -1, -1, -1}; // A, X, Y, P, SP
+    uint64_t from = 0;
+    uint64_t count = ~0ull;
+    bool stats = false;
+    std::string trace;
+};
+
+static void usage(const char *argv0)
+{
+    fprintf(stderr,
+            "usage: %s [--pc addr] [--a v] [--x v] [--y v] [--p v] [--sp v]\n"
+            "       [-f first] [-n count] [--stats] trace.bin\n",
+            argv0);
+}
+
+static bool parse_args(int argc, char **argv, Options &opt)
+{
+    static const char *register_args[5] = {"--a", "--x", "--y", "--p", "--sp"};
+    for (int i = 1; i < argc; i++)
+    {
+        std::string arg = argv[i];
+        auto value = [&]() -> unsigned long long {
+            if (i + 1 >= argc)
+            {
+                fprintf(stderr, "missing value for %s\n", arg.c_str());
+                exit(2);
+            }
+            return strtoull(argv[++i], nullptr, 0);
+        };
+
+        bool known = true;
+        if (arg == "--pc")
+            opt.pc = (int32_t)(value() & 0xFFFF);
+        else if (arg == "-f" || arg == "--from")
+            opt.from = value();
+        else if (arg == "-n" || arg == "--count")
+            opt.count = value();
+        else if (arg == "--stats")
+            opt.stats = true;
+        else if (arg[0] != '-' && opt.trace.empty())
+            opt.trace = arg;
+        else
+            known = false;
+
+        for (uint32_t r = 0; r < 5 && !known; r++)
+            if (arg == register_args[r])
+            {
+                opt.registers[r] = (int32_t)(value() & 0xFF);
+                known = true;
+            }
+        if (!known)
+        {
+            fprintf(stderr, "unknown option '%s'\n", arg.c_str());
+            return false;
+        }
+    }
+    return !opt.trace.empty();
+}
+
+static bool matches(const Options &opt, const InstructionTraceReader::RECORD &r)
+{
+    const uint8_t registers[5] = {r.a, r.x, r.y, r.p, r.sp};
+    if (opt.pc >= 0 && r.pc != opt.pc)
+        return false;
+    for (uint32_t i = 0; i < 5; i++)
+        if (opt.registers[i] >= 0 && registers[i] != opt.registers[i])
+            return false;
+    return true;
+}
+
+int main(int argc, char **argv)
+{
+    Options opt;
+    if (!parse_args(argc, argv, opt))
+    {
+        usage(argv[0]);
+        return 2;
+    }
+
+    InstructionTraceReader reader;
+    if (!reader.open(opt.trace))
+    {
+        fprintf(stderr, "%s is not an instruction trace\n", opt.trace.c_str());
+        return 1;
+    }
+    if (opt.from > 0 && !reader.seek(opt.from))
+    {
+        fprintf(stderr, "%s ends before instruction %llu\n", opt.trace.c_str(), (unsigned long long)opt.from);
+        return 1;
+    }
+
+    auto t0 = std::chrono::steady_clock::now();
+    InstructionTraceReader::RECORD r;
+    uint64_t records = 0, found = 0;
+    char text[R6502::LINE_SIZE];
+    while (found < opt.count && reader.next(r))
+    {
+        records++;
+        if (!matches(opt, r))
+            continue;
+        found++;
+        if (opt.stats)
+            continue;
+        R6502::format_instruction(r.pc, r.bytes, text, sizeof(text));
+        printf("%10llu %12llu  %-28s A:%02X X:%02X Y:%02X P:%02X SP:%02X\n", (unsigned long long)r.index,
+               (unsigned long long)r.cycle, text, r.a, r.x, r.y, r.p, r.sp);
+    }
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+
+    if (opt.stats)
+    {
+        printf("trace        : %s, %llu blocks\n", opt.trace.c_str(), (unsigned long long)reader.blocks);
+        printf("instructions : %llu read, %llu match\n", (unsigned long long)records, (unsigned long long)found);
+        if (records > 0)
+            printf("size         : %.2f bytes/instr, decoded at %.1f M instr/s\n",
+                   (double)reader.record_bytes / records, records / seconds / 1e6);
+    }
+    if (reader.damaged)
+    {
+        fprintf(stderr, "%s is damaged after instruction %llu\n", opt.trace.c_str(),
+                (unsigned long long)(records ? r.index : opt.from));
+        return 1;
+    }
+    return 0;
+}